@@ -50,6 +50,32 @@ void DEV_GPIO_Init(void)
     DEV_Digital_Write(LCD_CS_PIN, 1);
     DEV_Digital_Write(LCD_BKL_PIN, 1);
     DEV_Digital_Write(SD_CS_PIN, 1);
+    DEV_PWM_Init();
+}
+
+/********************************************************************************
+function:	Backlight PWM
+note:
+	DEV_PWM_Init() : Drive the backlight pin from its PWM slice, fully on
+	DEV_Set_PWM(value) : Backlight level 0..LCD_BKL_PWM_WRAP
+********************************************************************************/
+void DEV_PWM_Init(void)
+{
+	uint slice_num = pwm_gpio_to_slice_num(LCD_BKL_PIN);
+	pwm_config config = pwm_get_default_config();
+	pwm_config_set_clkdiv(&config, LCD_BKL_PWM_CLKDIV);
+	pwm_config_set_wrap(&config, LCD_BKL_PWM_WRAP - 1);
+	pwm_init(slice_num, &config, false);
+	DEV_Set_PWM(LCD_BKL_PWM_WRAP);
+	gpio_set_function(LCD_BKL_PIN, GPIO_FUNC_PWM);
+	pwm_set_enabled(slice_num, true);
+}
+
+void DEV_Set_PWM(UWORD Value)
+{
+	if(Value > LCD_BKL_PWM_WRAP)
+		Value = LCD_BKL_PWM_WRAP;
+	pwm_set_gpio_level(LCD_BKL_PIN, Value);
 }
 
 
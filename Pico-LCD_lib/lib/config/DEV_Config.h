@@ -15,6 +15,7 @@
 
 #include "pico/stdlib.h"
 #include "hardware/spi.h"
+#include "hardware/pwm.h"
 #include "stdio.h"
 
 #define UBYTE   uint8_t
@@ -33,6 +34,8 @@
 #define SD_CS_PIN		22
 
 #define SPI_PORT		spi1
+#define LCD_BKL_PWM_WRAP	1000	//Backlight levels 0..1000
+#define LCD_BKL_PWM_CLKDIV	12.5f	//10 kHz at 125 MHz, above audible
 #define  MAX_BMP_FILES  25 
 /*------------------------------------------------------------------------------------------------------*/
 
@@ -40,6 +43,8 @@ void DEV_Digital_Write(UWORD Pin, UBYTE Value);
 UBYTE DEV_Digital_Read(UWORD Pin);
 void DEV_GPIO_Mode(UWORD Pin, UWORD Mode);
 void DEV_GPIO_Init(void);
+void DEV_PWM_Init(void);
+void DEV_Set_PWM(UWORD Value);
 
 uint8_t System_Init(void);
 void System_Exit(void);
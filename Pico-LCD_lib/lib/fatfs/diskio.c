@@ -55,7 +55,7 @@ DRESULT disk_read (
 	BYTE drv,		/* Physical drive nmuber (0..) */
 	BYTE *buff,		/* Data buffer to store read data */
 	DWORD sector,	/* Sector address (LBA) */
-	BYTE count		/* Number of sectors to read (1..255) */
+	UINT count		/* Number of sectors to read (1..128) */
 )
 {
 	uint8_t res=0; 
@@ -88,7 +88,7 @@ DRESULT disk_write (
 	BYTE drv,			/* Physical drive nmuber (0..) */
 	const BYTE *buff,	        /* Data to be written */
 	DWORD sector,		/* Sector address (LBA) */
-	BYTE count			/* Number of sectors to write (1..255) */
+	UINT count			/* Number of sectors to write (1..128) */
 )
 {
 	uint8_t res=0;  
@@ -57,6 +57,8 @@
 /** @defgroup STORAGE_Private_Defines
 * @{
 */
+#define BMP_HEADER_SIZE     54                  /* file header + BITMAPINFOHEADER */
+#define BMP_CHUNK_SIZE      (16 * _MAX_SS)      /* BMP data read at once */
 /**
 * @}
 */
@@ -83,8 +85,11 @@ DIR MyDirectory;
 FIL MyFile;
 UINT BytesWritten;
 UINT BytesRead;
-uint16_t pic[76800];
-extern uint8_t id;
+
+/* Rows of the BMP being drawn as read from the card, and the last two
+   converted ones, big-endian RGB565 as the LCD takes them */
+static uint8_t BmpChunk[BMP_CHUNK_SIZE];
+static uint8_t BmpRow[2][LCD_X_MAXPIXEL * 2];
 /**
 * @}
 */
@@ -101,107 +106,119 @@ extern uint8_t id;
 * @{
 */
 
+static uint32_t Storage_ReadLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* BGR888 to big-endian RGB565 */
+static void Storage_ConvertRow(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const uint8_t *end = src + width * 3;
+    uint8_t r, g, b;
+
+    while (src < end) {
+        b = src[0];
+        g = src[1];
+        r = src[2];
+        dst[0] = (r & 0xF8) | (g >> 5);
+        dst[1] = ((g << 3) & 0xE0) | (b >> 3);
+        src += 3;
+        dst += 2;
+    }
+}
+
 
 
 
 /**
-* @brief  Open a file and copy its content to a buffer
-* @param  DirName: the Directory name to open
-* @param  FileName: the file name to open
-* @param  BufferAddress: A pointer to a buffer to copy the file to
-* @param  FileLen: the File length
+* @brief  Draw a 24-bit BMP file with its top left corner at (Xpoz, Ypoz).
+*         Rows are read from the card a chunk at a time and each one is
+*         converted to RGB565 while the previous one goes out over DMA, all
+*         into one LCD window. The part off the screen is clipped.
+* @param  Xpoz: X coordinate of the top left corner
+* @param  Ypoz: Y coordinate of the top left corner
+* @param  BmpName: the file name to open
 * @retval err: Error status (0=> success, 1=> fail)
 */
-
-uint32_t Storage_OpenReadFile(uint8_t Xpoz, uint16_t Ypoz, const char* BmpName)
+uint32_t Storage_OpenReadFile(uint16_t Xpoz, uint16_t Ypoz, const char* BmpName)
 {
-    uint16_t i, j, k, h;
-    
-    uint32_t index = 0, size = 0, width = 0, height = 0;
-    uint32_t bmpaddress, bit_pixel = 0;
-    FIL file1; 
-
-    f_open(&file1, BmpName, FA_READ);	
-    f_read(&file1, aBuffer, 30, &BytesRead);
-
-	bmpaddress = (uint32_t)aBuffer;
-
-	/* Read bitmap size */
-	size = *(uint16_t *) (bmpaddress + 2);
-	size |= (*(uint16_t *) (bmpaddress + 4)) << 16;
-//	printf("file size =  %d \r\n",size);
-	/* Get bitmap data address offset */
-	index = *(uint16_t *) (bmpaddress + 10);
-	index |= (*(uint16_t *) (bmpaddress + 12)) << 16;
-	// printf("file index =  %d \r\n",index);
-	/* Read bitmap width */
-	width = *(uint16_t *) (bmpaddress + 18);
-	width |= (*(uint16_t *) (bmpaddress + 20)) << 16;
-	// printf("file width =  %d \r\n",width);
-	/* Read bitmap height */
-	height = *(uint16_t *) (bmpaddress + 22);
-	height |= (*(uint16_t *) (bmpaddress + 24)) << 16;
-	// printf("file height =  %d \r\n",height);
-	/* Read bit/pixel */
-	bit_pixel = *(uint16_t *) (bmpaddress + 28);  
-//	printf("bit_pixel = %d \r\n",bit_pixel);
-	f_close (&file1);
-
-    if (24 != bit_pixel) {
-        return 0;
+    uint32_t offset, width, stride, height, rows, cols;
+    uint32_t chunk_rows, first, count, pos, i, saved_baud;
+    uint32_t err = 0;
+    int32_t info_height;
+    uint8_t cur = 0;
+    FIL file1;
+
+    if (f_open(&file1, BmpName, FA_READ) != FR_OK) {
+        return 1;
+    }
+    if (f_read(&file1, BmpChunk, BMP_HEADER_SIZE, &BytesRead) != FR_OK ||
+        BytesRead != BMP_HEADER_SIZE ||
+        BmpChunk[0] != 'B' || BmpChunk[1] != 'M' ||
+        (BmpChunk[28] | BmpChunk[29] << 8) != 24 ||   /* bit/pixel */
+        Storage_ReadLe32(BmpChunk + 30) != 0) {       /* BI_RGB, uncompressed */
+        f_close(&file1);
+        return 1;
     }
 
-	if (width != sLCD_DIS.LCD_Dis_Column || height != sLCD_DIS.LCD_Dis_Page) {
-		// printf("width != sLCD_DIS.LCD_Dis_Column \r\n");
-		// printf("file width =  %d \r\n",width);
-		// printf("file height =  %d \r\n",height);
-		// printf("sLCD_DIS.LCD_Dis_Column =  %d \r\n",sLCD_DIS.LCD_Dis_Column);
-		// printf("sLCD_DIS.LCD_Dis_Page =  %d \r\n",sLCD_DIS.LCD_Dis_Page);
-		return 1;
-	}
-	
-    /* Synchronize f_read right in front of the image data */
-    f_open(&file1, (TCHAR const*)BmpName, FA_READ);
-    f_read(&file1, aBuffer, index, &BytesRead);
-    
-    if(LCD_2_8 == id){
-		for (i = 0; i < height; i ++) {
-			  f_read(&file1, aBuffer, 360, (UINT *)&BytesRead);
-			  f_read(&file1, aBuffer + 360, 360, (UINT *)&BytesRead);
-			  for (j = 0; j < width; j ++) {
-				  k = j * 3; 
-				  pic[i*240+j] = (uint16_t)(((aBuffer[k + 2] >> 3) << 11 ) | ((aBuffer[k + 1] >> 2) << 5) | (aBuffer[k] >> 3));
-			  }
-		}
-		/* LCD_SetCursor if dont write here ,it will display innormal*/
-		LCD_SetCursor(0, 0);
-		DEV_Digital_Write(LCD_DC_PIN, 1);
-		DEV_Digital_Write(LCD_CS_PIN, 0);
-		spi_set_baudrate(SPI_PORT,30*1000*1000);
-		for(index=0;index<76800;index++){
-			  SPI4W_Write_Byte((pic[index] >> 8) & 0xFF);
-			  SPI4W_Write_Byte(pic[index] & 0xFF);
-		}
-		DEV_Digital_Write(LCD_CS_PIN, 1);
-    }else{
-		LCD_SetCursor(0, 0);
-		spi_set_baudrate(SPI_PORT,30*1000*1000);
-		for(i = 0; i < height; i ++){
-			  f_read(&file1, aBuffer, 360, (UINT *)&BytesRead);
-			  f_read(&file1, aBuffer+360, 360, (UINT *)&BytesRead);
-			  f_read(&file1, aBuffer+720, 360, (UINT *)&BytesRead);
-			  f_read(&file1, aBuffer+1080, 360, (UINT *)&BytesRead);
-			  for (j = 0; j < width; j ++) {
-				  k = j * 3;
-				  pic[j] = (uint16_t)(((aBuffer[k+2]>>3)<<11)|((aBuffer[k+1]>>2)<<5)|(aBuffer[k]>>3));
-				  LCD_WriteData(pic[j]);
-			  }
-		}
+    /* Get bitmap data address offset, width and height */
+    offset = Storage_ReadLe32(BmpChunk + 10);
+    width = Storage_ReadLe32(BmpChunk + 18);
+    info_height = (int32_t)Storage_ReadLe32(BmpChunk + 22);
+    /* A negative height marks rows stored top to bottom */
+    height = info_height < 0 ? -info_height : info_height;
+    /* Each row is padded to a multiple of 4 bytes */
+    stride = (width * 3 + 3) & ~3u;
+
+    if (width == 0 || height == 0 || stride > BMP_CHUNK_SIZE ||
+        Xpoz >= sLCD_DIS.LCD_Dis_Column || Ypoz >= sLCD_DIS.LCD_Dis_Page) {
+        f_close(&file1);
+        return 1;
+    }
+    cols = width;
+    if (cols > sLCD_DIS.LCD_Dis_Column - Xpoz) {
+        cols = sLCD_DIS.LCD_Dis_Column - Xpoz;
     }
+    rows = height;
+    if (rows > sLCD_DIS.LCD_Dis_Page - Ypoz) {
+        rows = sLCD_DIS.LCD_Dis_Page - Ypoz;
+    }
+    chunk_rows = BMP_CHUNK_SIZE / stride;
+
+    saved_baud = spi_get_baudrate(SPI_PORT);
+    spi_set_baudrate(SPI_PORT, LCD_SPI_BAUD_BLIT);
+    LCD_SetWindow(Xpoz, Ypoz, Xpoz + cols, Ypoz + rows);
+
+    /* Rows on the screen are numbered from the top, first..first+count-1 is
+       a run of them that also lies next to each other in the file */
+    for (first = 0; first < rows; first += count) {
+        count = rows - first < chunk_rows ? rows - first : chunk_rows;
+        /* First row of the run in the file */
+        pos = info_height < 0 ? first : height - first - count;
+
+        /* The card shares the bus, the last row has to be out first */
+        LCD_WaitData_DMA();
+        if (f_lseek(&file1, offset + pos * stride) != FR_OK ||
+            f_read(&file1, BmpChunk, count * stride, &BytesRead) != FR_OK ||
+            BytesRead != count * stride) {
+            err = 1;
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            const uint8_t *src = info_height < 0 ? BmpChunk + i * stride
+                                                 : BmpChunk + (count - 1 - i) * stride;
+            Storage_ConvertRow(BmpRow[cur], src, cols);
+            LCD_WaitData_DMA();
+            LCD_WriteData_DMA(BmpRow[cur], cols * 2);
+            cur ^= 1;
+        }
+    }
+    LCD_WaitData_DMA();
+
     f_close(&file1);
-    spi_set_baudrate(SPI_PORT,3000*1000);
-	Driver_Delay_ms(1500);
-    return 1;
+    spi_set_baudrate(SPI_PORT, saved_baud);
+    return err;
 }
 
 
@@ -92,6 +92,7 @@ void LCD_Show_bmp( LCD_SCAN_DIR Bmp_ScanDir, LCD_SCAN_DIR Lcd_ScanDir){
 			
 			/* Open the image and display the picture */
 			Storage_OpenReadFile(0, 0, (const char*)str);
+			Driver_Delay_ms(1500);
         }else if (checkstatus == 1){
 			/* Display message: SD card does not exist */
 			//Restore the default scan
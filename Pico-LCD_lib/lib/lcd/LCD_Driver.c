@@ -14,9 +14,14 @@
 
 /**************************Intermediate driver layer**************************/
 #include "LCD_Driver.h"
+#include "hardware/dma.h"
 
 LCD_DIS sLCD_DIS;
 uint8_t id;
+
+//DMA channel pushing pixel data, claimed on first use
+static int LCD_DMA_Tx = -1;
+static uint8_t LCD_DMA_Busy;
 /*******************************************************************************
 function:
 	Hardware reset
@@ -31,9 +36,9 @@ static void LCD_Reset(void)
     Driver_Delay_ms(500);
 }
 
-static void LCD_SetBackLight(uint16_t value)
+void LCD_SetBackLight(uint16_t value)
 {
-//	PWM_SetValue(value);
+	DEV_Set_PWM(value);
 }
 /*******************************************************************************
 function:
@@ -80,6 +85,46 @@ static void LCD_Write_AllData(uint16_t Data, uint32_t DataLen)
 	DEV_Digital_Write(LCD_CS_PIN,1);
 }
 
+/*******************************************************************************
+function:
+		Write a run of pixel data (big-endian RGB565 bytes) with DMA
+note:
+	LCD_WriteData_DMA starts the transfer and returns. LCD_WaitData_DMA
+	waits for it to finish and gives the bus back, which the SD card and
+	the touch controller share, so call it before anything else uses SPI.
+*******************************************************************************/
+void LCD_WriteData_DMA(const uint8_t *Data, uint32_t Len)
+{
+	dma_channel_config c;
+
+	if(LCD_DMA_Tx < 0)
+		LCD_DMA_Tx = dma_claim_unused_channel(true);
+	c = dma_channel_get_default_config(LCD_DMA_Tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_dreq(&c, spi_get_dreq(SPI_PORT, true));
+
+	DEV_Digital_Write(LCD_DC_PIN,1);
+	DEV_Digital_Write(LCD_CS_PIN,0);
+	dma_channel_configure(LCD_DMA_Tx, &c, &spi_get_hw(SPI_PORT)->dr, Data, Len, true);
+	LCD_DMA_Busy = 1;
+}
+
+void LCD_WaitData_DMA(void)
+{
+	if(!LCD_DMA_Busy)
+		return;
+	dma_channel_wait_for_finish_blocking(LCD_DMA_Tx);
+	//the last bytes are still in the FIFO
+	while(spi_is_busy(SPI_PORT))
+		tight_loop_contents();
+	//nobody read what came back, drop it so the next reader starts clean
+	while(spi_is_readable(SPI_PORT))
+		(void)spi_get_hw(SPI_PORT)->dr;
+	spi_get_hw(SPI_PORT)->icr = SPI_SSPICR_RORIC_BITS;
+	DEV_Digital_Write(LCD_CS_PIN,1);
+	LCD_DMA_Busy = 0;
+}
+
 /*******************************************************************************
 function:
 		Common register initialization
@@ -357,7 +402,7 @@ void LCD_Init(LCD_SCAN_DIR LCD_ScanDir, uint16_t LCD_BLval)
 	
 	if(LCD_BLval > 1000)
 		LCD_BLval = 1000;
-	//LCD_SetBackLight(LCD_BLval);
+	LCD_SetBackLight(LCD_BLval);
 	
 	LCD_SetGramScanWay(LCD_ScanDir);//Set the display scan and color transfer modes
 	Driver_Delay_ms(200);
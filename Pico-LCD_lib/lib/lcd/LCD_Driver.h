@@ -41,6 +41,8 @@ function:
 #define LCD_2_8_WIDTH  	240  //LCD width
 #define LCD_2_8_HEIGHT   320
 
+#define LCD_SPI_BAUD_BLIT   (30*1000*1000)   //bus speed for streaming pixel data
+
 /********************************************************************************
 function:
 			scanning method
@@ -76,9 +78,12 @@ function:
 ********************************************************************************/
 void LCD_Init(LCD_SCAN_DIR LCD_ScanDir, uint16_t LCD_BLval);
 void LCD_SetGramScanWay(LCD_SCAN_DIR Scan_dir);
+void LCD_SetBackLight(uint16_t value);
 
 void LCD_WriteReg(uint8_t Reg);
 void LCD_WriteData(uint16_t Data);
+void LCD_WriteData_DMA(const uint8_t *Data, uint32_t Len);
+void LCD_WaitData_DMA(void);
 
 void LCD_SetWindow(POINT Xstart, POINT Ystart, POINT Xend, POINT Yend);
 void LCD_SetCursor(POINT Xpoint, POINT Ypoint);
@@ -1,8 +1,15 @@
 #include "DEV_Config.h"
 #include "MMC_SD.h"			   
+#include "hardware/dma.h"
 					   					   
 unsigned char  SD_Type=0;  //version of the sd card
 
+//DMA channels moving sector data, claimed on first use
+static int SD_DMA_Tx = -1;
+static int SD_DMA_Rx = -1;
+//baud rate of the shared bus before the card took it
+static unsigned int SD_Saved_Baud;
+
 //data: data to be written to sd card.
 //return: data read from sd card.
 unsigned char SD_SPI_ReadWriteByte(unsigned char CMD)
@@ -11,21 +18,67 @@ unsigned char SD_SPI_ReadWriteByte(unsigned char CMD)
 //	return SPI_Read_Byte();
 }	  
 
-//set spi in low speed mode.
+//set spi in low speed mode, cards must be initialized at 400 kHz at most.
 void SD_SPI_SpeedLow(void)
 {
-//	SPI1->CR1&=0XFFC7; 
-//	SPI1->CR1|=SPI_BaudRatePrescaler_256;
-//	SPI_Cmd(SPI1,ENABLE); 
+	spi_set_baudrate(SPI_PORT,SD_SPI_BAUD_LOW);
 }
 
 
 //set spi in high speed mode.
 void SD_SPI_SpeedHigh(void)
 {
-//	SPI1->CR1&=0XFFC7; 
-//	SPI1->CR1|=SPI_BaudRatePrescaler_32;
-//	SPI_Cmd(SPI1,ENABLE); 
+	spi_set_baudrate(SPI_PORT,SD_SPI_BAUD_HIGH);
+}
+
+//the bus is shared with the LCD and the touch controller, which run at
+//their own speeds. Take it over at the card speed and give it back after.
+static void SD_BusAcquire(void)
+{
+	SD_Saved_Baud = spi_get_baudrate(SPI_PORT);
+	SD_SPI_SpeedHigh();
+}
+
+static void SD_BusRelease(void)
+{
+	spi_set_baudrate(SPI_PORT,SD_Saved_Baud);
+}
+
+static void SD_DMA_Init(void)
+{
+	if(SD_DMA_Tx >= 0)return;
+	SD_DMA_Tx = dma_claim_unused_channel(true);
+	SD_DMA_Rx = dma_claim_unused_channel(true);
+}
+
+//move len bytes over the bus with DMA. tx==NULL sends 0xFF (reading),
+//rx==NULL discards what comes back (writing).
+static void SD_SPI_TransferDMA(const unsigned char *tx, unsigned char *rx, unsigned int len)
+{
+	static const unsigned char fill = 0xFF;
+	static unsigned char discard;
+	dma_channel_config c;
+
+	SD_DMA_Init();
+	c = dma_channel_get_default_config(SD_DMA_Tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_dreq(&c, spi_get_dreq(SPI_PORT, true));
+	channel_config_set_read_increment(&c, tx != NULL);
+	channel_config_set_write_increment(&c, false);
+	dma_channel_configure(SD_DMA_Tx, &c, &spi_get_hw(SPI_PORT)->dr,
+	                      tx ? tx : &fill, len, false);
+
+	c = dma_channel_get_default_config(SD_DMA_Rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_dreq(&c, spi_get_dreq(SPI_PORT, false));
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, rx != NULL);
+	dma_channel_configure(SD_DMA_Rx, &c, rx ? rx : &discard,
+	                      &spi_get_hw(SPI_PORT)->dr, len, false);
+
+	//start both at once, so the RX FIFO never overflows
+	dma_start_channel_mask((1u << SD_DMA_Tx) | (1u << SD_DMA_Rx));
+	dma_channel_wait_for_finish_blocking(SD_DMA_Rx);
 }
 
 
@@ -81,10 +134,7 @@ unsigned char SD_RecvData(unsigned char *buf,unsigned short len)
 {			  	  
 	if(SD_GetResponse(0xFE))
 		return 1;//waiting for start command send back from sd card.
-    while(len--){//receiving data...
-        *buf = SD_SPI_ReadWriteByte(0xFF);
-        buf++;
-    }
+    SD_SPI_TransferDMA(NULL, buf, len);//receiving data...
 
     //send 2 dummy write (dummy CRC)
     SD_SPI_ReadWriteByte(0xFF);
@@ -102,8 +152,7 @@ unsigned char SD_SendBlock(unsigned char*buf,unsigned char cmd)
 	if(SD_WaitReady())return 1;
 	SD_SPI_ReadWriteByte(cmd);
 	if(cmd!=0XFD){
-		for(t=0;t<512;t++)
-			SD_SPI_ReadWriteByte(buf[t]);
+		SD_SPI_TransferDMA(buf, NULL, 512);
 	    SD_SPI_ReadWriteByte(0xFF);//ignoring CRC
 	    SD_SPI_ReadWriteByte(0xFF);
 		t = SD_SPI_ReadWriteByte(0xFF);
@@ -148,11 +197,13 @@ unsigned char SD_GetCID(unsigned char *cid_data)
 {
     unsigned char r1;	   
 
+	SD_BusAcquire();
     r1=SD_SendCmd(CMD10,0,0x01);
     if(r1 == 0x00){
 		r1=SD_RecvData(cid_data,16);	 
     }
 	SD_DisSelect();
+	SD_BusRelease();
 	if(r1)return 1;
 	else return 0;
 }																				  
@@ -163,11 +214,13 @@ unsigned char SD_GetCID(unsigned char *cid_data)
 unsigned char SD_GetCSD(unsigned char *csd_data)
 {
     unsigned char r1;	 
+	SD_BusAcquire();
     r1 = SD_SendCmd(CMD9,0,0x01);//CMD9CSD send CMD9 in order to get CSD
     if(r1 == 0)	{
     	r1=SD_RecvData(csd_data, 16);
     }
 	SD_DisSelect();
+	SD_BusRelease();
 	if(r1)return 1;
 	else return 0;
 }  
@@ -205,6 +258,7 @@ unsigned char SD_Initialize(void)
     unsigned char buf[4];  
 	unsigned short i;
    	
+	SD_Saved_Baud = spi_get_baudrate(SPI_PORT);
 	DEV_Digital_Write(SD_CS_PIN,1);
  	SD_SPI_SpeedLow();	
  	for(i=0;i<10;i++)SD_SPI_ReadWriteByte(0XFF);
@@ -261,22 +315,23 @@ unsigned char SD_Initialize(void)
 		}
 	}
 	SD_DisSelect();
-	SD_SPI_SpeedHigh();
+	SD_BusRelease();
 	if(SD_Type)return 0;
 	else if(r1)return r1; 	   
 	return 0xaa;
 }
 
 
-//read SD card
+//read SD card, several sectors are streamed with one CMD18
 //buf: data buffer
 //sector: sector
 //cnt: totals of sectors]
 //return: 0 ok, other for failure
-uint8_t SD_ReadDisk(uint8_t *buf,uint32_t sector,uint8_t cnt)
+uint8_t SD_ReadDisk(uint8_t *buf,uint32_t sector,uint32_t cnt)
 {
 	unsigned char r1;
 	if(SD_Type!=SD_TYPE_V2HC)sector <<= 9;
+	SD_BusAcquire();
 	if(cnt==1)
 	{
 		r1=SD_SendCmd(CMD17,sector,0X01);
@@ -295,19 +350,21 @@ uint8_t SD_ReadDisk(uint8_t *buf,uint32_t sector,uint8_t cnt)
 		SD_SendCmd(CMD12,0,0X01);	
 	}   
 	SD_DisSelect();
+	SD_BusRelease();
 	return r1;//
 }
 
 
-//write sd card 
+//write sd card, several sectors are streamed with one CMD25
 //buf: data buffer
 //sector: start sector
 //cnt: totals of sectors]
 //return: 0 ok, other for failure
-uint8_t SD_WriteDisk(uint8_t *buf,uint32_t sector,uint8_t cnt)
+uint8_t SD_WriteDisk(uint8_t *buf,uint32_t sector,uint32_t cnt)
 {
 	unsigned char r1;
 	if(SD_Type!=SD_TYPE_V2HC)sector *= 512;
+	SD_BusAcquire();
 	if(cnt==1)
 	{
 		r1=SD_SendCmd(CMD24,sector,0X01);
@@ -330,10 +387,11 @@ uint8_t SD_WriteDisk(uint8_t *buf,uint32_t sector,uint8_t cnt)
 				r1=SD_SendBlock(buf,0xFC); 
 				buf+=512;  
 			}while(--cnt && r1==0);
-			r1=SD_SendBlock(0,0xFD);
+			if(SD_SendBlock(0,0xFD))r1=1;
 		}
 	}   
 	SD_DisSelect();
+	SD_BusRelease();
 	return r1;
 }	   
 
@@ -7,6 +7,9 @@
 #define SD_TYPE_V1      0X02
 #define SD_TYPE_V2      0X04
 #define SD_TYPE_V2HC    0X06	   
+
+#define SD_SPI_BAUD_LOW     (400*1000)
+#define SD_SPI_BAUD_HIGH    (25*1000*1000)   //default speed mode limit
    
 #define CMD0    0       
 #define CMD1    1
@@ -50,8 +53,8 @@ void SD_SPI_SpeedHigh(void);
 uint8_t SD_WaitReady(void);							    
 uint8_t SD_GetResponse(uint8_t Response);					
 uint8_t SD_Initialize(void);							
-uint8_t SD_ReadDisk(uint8_t*buf,uint32_t sector,uint8_t cnt);		
-uint8_t SD_WriteDisk(uint8_t*buf,uint32_t sector,uint8_t cnt);		
+uint8_t SD_ReadDisk(uint8_t*buf,uint32_t sector,uint32_t cnt);		
+uint8_t SD_WriteDisk(uint8_t*buf,uint32_t sector,uint32_t cnt);		
 uint32_t SD_GetSectorCount(void);   					
 uint8_t SD_GetCID(uint8_t *cid_data);                     
 uint8_t SD_GetCSD(uint8_t *csd_data);                     
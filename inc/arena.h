@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// First-fit allocator over a fixed buffer.
+//
+// Blocks carry an 8 byte header, free neighbours are merged on free and
+// while searching. Not thread safe, callers serialise access (mbedTLS only
+// runs under the lwIP lock). Resetting an arena with no live blocks brings
+// it back to one contiguous free block, so fragmentation cannot accumulate
+// across connections.
+
+#define ARENA_ALIGNMENT 8
+
+struct arena {
+    unsigned char *base;
+    size_t size;
+    size_t used; // Including block headers
+    size_t peak;
+    size_t failures;
+};
+
+void arena_init(struct arena *arena, void *buffer, size_t size);
+void arena_reset(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena, void *ptr);
+// Usable size of an allocated block, at least what was asked for
+size_t arena_block_size(const void *ptr);
+bool arena_contains(const struct arena *arena, const void *ptr);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Images and icons pre-converted on the host by tools/pack_assets.py into
+// one file on the SD card.
+//
+// The file starts with a header and an index of fixed size entries, read
+// into RAM once as they are. The data of every asset starts on a sector
+// boundary, so fetching one is a single seek and a multi-sector read. Pixels
+// are big-endian RGB565 as the LCD takes them, either raw or run-length
+// encoded in packets of a control byte c: below 0x80 c + 1 literal pixels
+// follow, otherwise one pixel repeated c - 0x7e times.
+//
+// All integers are little-endian.
+
+#define ASSETS_FILE_NAME "ASSETS.PAK"
+#define ASSETS_MAGIC "RGBP"
+#define ASSETS_VERSION 1
+#define ASSETS_MAX 64
+#define ASSETS_NAME_LENGTH 16  // Including the terminating zero
+#define ASSETS_CHUNK_SIZE 4096 // Data read at once while drawing, in sectors
+#define ASSETS_ROW_BUFFER_SIZE 1024 // Decoded pixels pushed at once, bytes
+
+enum asset_format {
+    ASSET_RGB565,
+    ASSET_RLE,
+};
+
+struct assets_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t reserved[2];
+};
+static_assert(sizeof(struct assets_header) == 16, "Layout of the file");
+
+struct asset {
+    char name[ASSETS_NAME_LENGTH];
+    uint16_t width;
+    uint16_t height;
+    uint8_t format; // enum asset_format
+    uint8_t reserved[3];
+    uint32_t offset; // From the start of the file
+    uint32_t size;   // Of the data, bytes
+};
+static_assert(sizeof(struct asset) == 32, "Layout of the file");
+
+// Mount the card and read the index, false if there is no usable pack
+bool assets_init(void);
+// NULL if the pack has no asset of that name
+const struct asset *assets_find(const char *name);
+// Read the data of an asset as stored, size must be at least asset->size
+bool assets_read(const struct asset *asset, void *buffer, size_t size);
+// Decode an asset into RGB565 pixels as the LCD takes them, size must be at
+// least 2 * width * height
+bool assets_decode(const struct asset *asset, void *pixels, size_t size);
+// Draw an asset with its top left corner at (x, y), it must fit the screen
+bool assets_draw(const struct asset *asset, uint16_t x, uint16_t y);
+// Draw decoded pixels with one window and one DMA transfer
+void assets_blit(uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+                 const void *pixels);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// Backlight brightness: fades, a daylight schedule and an optional light
+// sensor.
+//
+// Levels are the PWM levels LCD_SetBackLight takes, 0 to BACKLIGHT_MAX.
+// Fades are stepped from a timer alarm and move linearly in perceived
+// brightness, the square root of the level, so they stay smooth at the dark
+// end. The ambient level comes from a light sensor on an ADC input when
+// BACKLIGHT_SENSOR_ADC is set, otherwise from the time of day: between
+// sunrise and sunset of the first weather location it is the day level,
+// at night the much lower night level, with a ramp through the twilight.
+// Before the first weather update fixed day hours are used. The power
+// module scales the ambient level down for idle and dark screens.
+
+#ifndef BACKLIGHT_SENSOR_ADC
+#define BACKLIGHT_SENSOR_ADC -1 // ADC input 0 to 2 (GPIO 26 to 28), or none
+#endif
+
+#define BACKLIGHT_MAX 1000
+#define BACKLIGHT_DAY 800
+#define BACKLIGHT_NIGHT 120
+#define BACKLIGHT_TWILIGHT_S 3600 // Centred on sunrise and sunset
+#define BACKLIGHT_DAY_START_HOUR 7 // Local time, without sunrise and sunset
+#define BACKLIGHT_DAY_END_HOUR 20
+#define BACKLIGHT_FADE_STEP_MS 20
+#define BACKLIGHT_FADE_MS 400          // Waking up and dimming
+#define BACKLIGHT_AMBIENT_FADE_MS 3000 // Following the ambient level
+#define BACKLIGHT_HYSTERESIS 20        // Ambient changes smaller are ignored
+
+// Raw 12-bit readings of the sensor, brighter is higher, mapped to the
+// night and the full level
+#define BACKLIGHT_SENSOR_DARK 200
+#define BACKLIGHT_SENSOR_BRIGHT 3000
+#define BACKLIGHT_SENSOR_SMOOTHING 4 // Moving average over 2^N readings
+
+// Take over the backlight from LCD_Init and fade in to the day level
+void backlight_init(void);
+// Fade to the level over the given time, 0 sets it at once. Safe from
+// interrupts, backlight_tick() later moves on to the ambient level.
+void backlight_fade(uint16_t level, uint32_t fade_ms);
+// Fade to the ambient level times scale, permille, at once instead of on the
+// next tick. Safe from interrupts.
+void backlight_set_scale(uint16_t scale);
+// Read the sensor or the schedule and follow the ambient level times scale,
+// from the main loop
+void backlight_tick(uint16_t scale);
+// The level now, in the middle of a fade too
+uint16_t backlight_level(void);
+// Average level since backlight_init(), for the energy estimate
+uint16_t backlight_average(void);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "LCD_Driver.h"
+
+#include <stdint.h>
+
+// Small charts of a series of values, one column per value.
+//
+// Every column is a vertical span of rows, a bar from the bottom or the
+// piece of a line from one value to the next. The spans on the screen are
+// remembered, and a redraw only clears and fills the rows of a column that
+// differ, so new data costs a few small rectangles instead of clearing the
+// whole chart.
+
+#define CHART_MAX_COLUMNS 48
+#define CHART_MISSING INT16_MIN // A value without a column
+#define CHART_LINE_WIDTH 2
+
+enum chart_style {
+    CHART_LINE,
+    CHART_BARS, // With a gap of a pixel between the columns
+};
+
+// Rows [top, bottom), nothing if equal
+struct chart_span {
+    uint16_t top;
+    uint16_t bottom;
+};
+
+struct chart {
+    uint16_t x;
+    uint16_t y;
+    uint16_t height;
+    uint16_t column_width;
+    enum chart_style style;
+    COLOR color;
+    COLOR background;
+    struct chart_span drawn[CHART_MAX_COLUMNS]; // As on the screen
+};
+
+// Draw up to CHART_MAX_COLUMNS values, with low at the bottom and high at
+// the top, columns past count are cleared
+void chart_draw(struct chart *chart, const int16_t *values, unsigned count,
+                int32_t low, int32_t high);
+// The screen was cleared, the next draw fills every column
+void chart_invalidate(struct chart *chart);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by zlib and Ethernet. Pass 0 to start, or the previous
+// result to continue over more data.
+uint32_t crc32(uint32_t crc, const void *data, size_t length);
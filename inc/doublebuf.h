@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+// Two copies of a model, published without locks.
+//
+// The low bit of the sequence number selects the published copy. The writer
+// fills the other one in private and publishes it by incrementing the
+// sequence. Readers copy the published one out and start over if a publish
+// happened meanwhile, because the writer then moves on to the copy they were
+// reading. Nothing disables interrupts, neither side waits for the other.
+// There must be a single writer at a time.
+
+struct doublebuf {
+    atomic_uint sequence;
+};
+
+// The copy to fill, initialized from the published one
+static inline void *doublebuf_begin(struct doublebuf *buffer, void *copies,
+                                    size_t size) {
+    unsigned sequence =
+        atomic_load_explicit(&buffer->sequence, memory_order_relaxed);
+    char *published = (char *)copies + (sequence & 1) * size;
+    char *spare = (char *)copies + (~sequence & 1) * size;
+    memcpy(spare, published, size);
+    return spare;
+}
+
+// Make the copy from doublebuf_begin() the published one
+static inline void doublebuf_publish(struct doublebuf *buffer) {
+    atomic_fetch_add_explicit(&buffer->sequence, 1, memory_order_release);
+}
+
+// Copy the published copy to out, without a lock. Concurrent readers need
+// their own out.
+static inline void doublebuf_read(struct doublebuf *buffer, void *out,
+                                  const void *copies, size_t size) {
+    unsigned sequence;
+    do {
+        sequence =
+            atomic_load_explicit(&buffer->sequence, memory_order_acquire);
+        memcpy(out, (const char *)copies + (sequence & 1) * size, size);
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&buffer->sequence, memory_order_relaxed) !=
+             sequence);
+}
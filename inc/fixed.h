@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Decimal numbers as scaled integers, a value with one decimal is in tenths
+// and -15 is -1.5. Parsing and printing them needs neither floating point
+// nor the float support of printf, both done in software on the RP2040.
+// tools/bench_fixed.c compares them with strtod and snprintf.
+
+#define FIXED_MAX_DECIMALS 9
+// Longest int32_t with a sign, a point and the terminating zero
+#define FIXED_STRING_SIZE 13
+
+// A plain decimal number without an exponent, scaled by 10^decimals and
+// rounded half away from zero, false if it is not one or does not fit
+bool fixed_parse(const char *text, size_t length, unsigned decimals,
+                 int32_t *value);
+// Exactly decimals digits after the point, buffer must hold
+// FIXED_STRING_SIZE, returns the length
+size_t fixed_format(char *buffer, int32_t value, unsigned decimals);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming DEFLATE decoder (RFC 1951) with zlib (RFC 1950) and gzip
+// (RFC 1952) wrappers.
+//
+// The decoder writes into one flat output buffer which also serves as the
+// sliding window, so there is no separate 32 KB history buffer. Input can be
+// fed in arbitrarily sized pieces, e.g. straight from the TLS receive
+// callback; the few bytes of an incomplete symbol at the end of a piece are
+// kept in a small stash until the next one arrives.
+
+#define INFLATE_STASH_SIZE 16
+#define INFLATE_MAX_LITLEN_SYMBOLS 288
+#define INFLATE_MAX_DIST_SYMBOLS 32
+
+enum inflate_format {
+    INFLATE_FORMAT_RAW,
+    INFLATE_FORMAT_ZLIB,
+    INFLATE_FORMAT_GZIP,
+};
+
+enum inflate_status {
+    INFLATE_NEED_INPUT, // Everything fed so far was consumed
+    INFLATE_DONE,       // End of stream reached
+    INFLATE_ERROR,      // Corrupted stream
+    INFLATE_OVERFLOW,   // Output does not fit the buffer
+};
+
+struct inflate_huffman {
+    uint16_t counts[16];
+    uint16_t symbols[INFLATE_MAX_LITLEN_SYMBOLS];
+};
+
+struct inflate_state {
+    enum inflate_format format;
+    int state;
+    bool final_block;
+
+    // Bit reader over the stash followed by the current input piece
+    uint32_t bitbuf;
+    unsigned bitcnt;
+    uint8_t stash[INFLATE_STASH_SIZE];
+    size_t stash_len;
+    size_t stash_pos;
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+
+    // Block decoding
+    unsigned stored_left;
+    unsigned gzip_flags;
+    unsigned skip_left;
+    unsigned hlit;
+    unsigned hdist;
+    unsigned hclen;
+    unsigned lengths_index;
+    uint8_t lengths[INFLATE_MAX_LITLEN_SYMBOLS + INFLATE_MAX_DIST_SYMBOLS];
+    struct inflate_huffman litlen;
+    struct inflate_huffman dist;
+
+    // Output, which is also the window for back references
+    uint8_t *out;
+    size_t out_size;
+    size_t out_len;
+};
+
+void inflate_init(struct inflate_state *state, enum inflate_format format,
+                  uint8_t *out, size_t out_size);
+enum inflate_status inflate_feed(struct inflate_state *state,
+                                 const uint8_t *in, size_t len);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pull parser over JSON text, one value at a time and without a node pool,
+// for responses with long arrays.
+//
+// Keys, strings and numbers are spans of the text, neither copied nor
+// unescaped, so keys with escapes only match as they are written. The text
+// is not modified and must be zero terminated.
+
+#define JSON_READER_MAX_DEPTH 8
+
+enum json_reader_event {
+    JSON_READER_ERROR,
+    JSON_READER_DONE, // The top level value is complete
+    JSON_READER_OBJECT, // Opened, members follow until JSON_READER_OBJECT_END
+    JSON_READER_OBJECT_END,
+    JSON_READER_ARRAY,
+    JSON_READER_ARRAY_END,
+    JSON_READER_STRING,
+    JSON_READER_NUMBER,
+    JSON_READER_LITERAL, // true, false or null
+};
+
+struct json_reader {
+    const char *next;
+    unsigned depth;
+    bool in_object[JSON_READER_MAX_DEPTH]; // Per open container
+    bool expect_comma;
+    bool done;
+    bool failed;
+    // Of the value just read, key is NULL outside of objects
+    const char *key;
+    size_t key_length;
+    const char *value; // Without the quotes of strings
+    size_t value_length;
+};
+
+void json_reader_init(struct json_reader *reader, const char *text);
+enum json_reader_event json_reader_next(struct json_reader *reader);
+// Skip the rest of the innermost open object or array, false on error
+bool json_reader_skip(struct json_reader *reader);
+// The value just read has this key
+bool json_reader_key(const struct json_reader *reader, const char *key);
+// The value just read is this literal or string
+bool json_reader_value(const struct json_reader *reader, const char *value);
+// The number just read scaled by 10^decimals, see fixed_parse
+bool json_reader_fixed(const struct json_reader *reader, unsigned decimals,
+                       int32_t *value);
+// The integer just read, false if it has a fraction or does not fit
+bool json_reader_integer(const struct json_reader *reader, int64_t *value);
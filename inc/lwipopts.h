@@ -158,6 +158,14 @@
 //
 #define ALTCP_MBEDTLS_AUTHMODE MBEDTLS_SSL_VERIFY_REQUIRED
 
+// Keep Mbed-TLS allocations out of the lwIP heap
+//
+//  With MBEDTLS_PLATFORM_MEMORY, lwIP would otherwise redirect them to its
+//  own small heap (MEM_SIZE). The application installs calloc/free backed
+//  by per-connection arenas instead, see network.c.
+//
+#define ALTCP_MBEDTLS_PLATFORM_ALLOC 0
+
 /* Network interface options
  * **************************************************/
 
@@ -56,6 +56,8 @@
 #define MBEDTLS_PK_C
 #define MBEDTLS_PK_PARSE_C
 #define MBEDTLS_PLATFORM_C
+// Allocations go to per-connection arenas, see network.c
+#define MBEDTLS_PLATFORM_MEMORY
 #define MBEDTLS_RSA_C
 #define MBEDTLS_SHA1_C
 #define MBEDTLS_SHA224_C
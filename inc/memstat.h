@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+// Memory instrumentation: stack high-water marks of both cores (by painting
+// the stacks at boot), heap usage, lwIP heap statistics and mbedTLS
+// allocations (through MBEDTLS_PLATFORM_MEMORY).
+
+#define MEMSTAT_STACK_PAINT 0x5ca1ab1e
+#define MEMSTAT_STACK_PAINT_MARGIN 256 // Bytes below the current SP left alone
+
+struct memstat {
+    size_t stack_size[2];
+    size_t stack_used[2]; // High-water mark
+    size_t heap_arena;    // Heap obtained from sbrk, never shrinks
+    size_t heap_current;
+    size_t heap_peak; // Sampled, see memstat_sample()
+    size_t heap_free_top; // Largest block available at the top of the heap
+    size_t lwip_used;
+    size_t lwip_peak;
+    size_t lwip_size;
+    size_t lwip_failures;
+    size_t tls_current;
+    size_t tls_peak;
+    size_t tls_allocations;
+    size_t tls_failures;
+};
+
+// Call first thing in main, before the stack gets deep
+void memstat_init(void);
+// Update the sampled heap peak
+void memstat_sample(void);
+// Account mbedTLS allocations, safe from interrupts
+void memstat_tls_allocated(size_t bytes);
+void memstat_tls_failed(void);
+void memstat_tls_freed(size_t bytes);
+void memstat_get(struct memstat *stats);
+// Print one line with all the numbers over USB stdio
+void memstat_dump(void);
+// Draw the numbers on the diagnostics page, below the trace table
+void memstat_render(void);
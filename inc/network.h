@@ -2,14 +2,30 @@
 
 #include "pico/cyw43_arch.h"
 
+#include "arena.h"
+#include "inflate.h"
+
 #include <stdatomic.h>
 
 typedef err_t lwip_err_t;
 
 #define HTTPS_WIFI_TIMEOUT_MS 20000
+#define HTTPS_MAX_CONNECTIONS 2
+// Everything mbedTLS allocates for one connection: the 16 KB input record
+// buffer, the output buffer, the handshake and both certificate chains. The
+// 'm' USB command reports the actual peak.
+#define HTTPS_TLS_ARENA_SIZE (32 * 1024)
+// Of the decoded body. Compression only saves airtime, a body which decodes
+// to more fails like an uncompressed one would. Per connection, so a build
+// expecting larger responses has to trade RAM for it.
+#ifndef HTTPS_RESPONSE_MAX_SIZE
 #define HTTPS_RESPONSE_MAX_SIZE (8 * 1024)
-#define HTTPS_RESOLVE_POLL_INTERVAL_MS 100
+#endif
+#define HTTPS_REQUEST_MAX_SIZE 1024
+#define HTTPS_VALIDATOR_MAX_SIZE 64
+#define HTTPS_HEADER_LINE_MAX_SIZE 256
 #define HTTPS_ALTCP_CONNECT_POLL_INTERVAL_MS 100
+#define HTTPS_TCP_CONNECT_POLL_INTERVAL_MS 10 // Resolution of TRACE_TCP_CONNECT
 #define HTTPS_ALTCP_IDLE_POLL_SHOTS 2
 #define HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_INTERVAL_MS 200
 #define HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_SHOTS 20
@@ -17,6 +33,22 @@ typedef err_t lwip_err_t;
 
 #define MAX_JSON_FIELDS 200
 
+enum http_transfer_state {
+    HTTP_TRANSFER_HEADER,
+    HTTP_TRANSFER_BODY, // Not chunked, delimited by Content-Length or content
+    HTTP_TRANSFER_CHUNK_SIZE,
+    HTTP_TRANSFER_CHUNK_DATA,
+    HTTP_TRANSFER_CHUNK_DATA_END,
+    HTTP_TRANSFER_TRAILER,
+    HTTP_TRANSFER_DONE,
+};
+
+enum http_content_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+};
+
 struct connection_state {
     const char *hostname;
     const char *cert;
@@ -25,16 +57,53 @@ struct connection_state {
     struct altcp_tls_config *config;
     struct altcp_pcb *pcb;
     ip_addr_t ipaddr;
+    struct sched_task *task; // Querying, signalled by the lwIP callbacks
     atomic_bool connected;
+    atomic_bool remote_closed; // The server ended its side, e.g. when idle
     atomic_uint send_acknowledged_bytes;
     _Atomic lwip_err_t received_err;
+    char http_request[HTTPS_REQUEST_MAX_SIZE];
+    // Decoded response body, zero terminated. Written exactly once while
+    // receiving and parsed in place by the consumers, so they may modify it.
     char http_response[HTTPS_RESPONSE_MAX_SIZE];
     unsigned http_response_offset;
+    unsigned braces_open;
+    unsigned braces_closed;
+    // Header is parsed line by line as it arrives
+    char http_header_line[HTTPS_HEADER_LINE_MAX_SIZE];
+    unsigned http_header_line_len;
+    unsigned http_status;
+    long http_content_length; // -1 if not sent by the server
+    bool http_chunked;
+    enum http_transfer_state transfer_state;
+    unsigned long body_received; // Raw body bytes, for Content-Length
+    unsigned long chunk_left;
+    bool chunk_extension;
+    unsigned trailer_line_len;
+    enum http_content_encoding content_encoding;
+    struct inflate_state inflater;
+    bool inflate_done;
+    // Timestamps of the refresh cycle taken in callbacks, see trace.h
+    uint32_t trace_connected_us;
+    uint32_t trace_sent_us;
+    volatile uint32_t trace_first_byte_us;
+    volatile uint32_t trace_last_byte_us;
+    // Cache validators of the last successful response, empty if not sent
+    char etag[HTTPS_VALIDATOR_MAX_SIZE];
+    char last_modified[HTTPS_VALIDATOR_MAX_SIZE];
+    // Backs all mbedTLS allocations of this connection, see network.c
+    struct arena tls_arena;
+    unsigned char tls_arena_buffer[HTTPS_TLS_ARENA_SIZE]
+        __attribute__((aligned(ARENA_ALIGNMENT)));
 };
 
+// Also installs the mbedTLS allocator, call before any TLS connection
 void init_cyw43(void);
 void connect_to_wifi(const char *ssid, const char *passwd);
 
+// Takes one of the HTTPS_MAX_CONNECTIONS statically allocated connections
 struct connection_state *init_connection(const char *hostname, const char *cert,
                                          size_t cert_len, const char *request);
+// Returns true only if a new response body is available in http_response,
+// i.e. not on failure nor on 304 Not Modified
 bool query_connection(struct connection_state *connection);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// SNTP client disciplining a software UTC clock.
+//
+// Every NTP_POLL_INTERVAL_S a burst of requests goes to one server, and the
+// sample with the smallest round-trip delay wins. The first sample and any
+// large offset step the clock. Smaller offsets are slewed in gradually, and
+// the drift between two syncs corrects the rate of the timer crystal. All of
+// it runs in the background from lwIP context.
+
+#define NTP_SERVER "pool.ntp.org"
+#define NTP_BURST_SAMPLES 4
+#define NTP_SAMPLE_SPACING_MS 1000
+#define NTP_RESPONSE_TIMEOUT_MS 1000
+#define NTP_POLL_INTERVAL_S (60 * 60)
+#define NTP_RETRY_INTERVAL_S 15
+#define NTP_STEP_THRESHOLD_US 500000 // Larger offsets are stepped
+#define NTP_SLEW_RATE_PPM 500
+#define NTP_MAX_FREQUENCY_PPB 500000
+#define NTP_MIN_FREQUENCY_INTERVAL_S (15 * 60) // Shorter ones are too noisy
+
+// Must be called once the wireless network is up
+void ntp_init(void);
+bool ntp_synchronized(void);
+// Disciplined UTC in microseconds since the Unix epoch, 0 until synchronized
+int64_t ntp_time_us(void);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Power management of the display.
+//
+// The CYW43 is kept in its aggressive power-save mode and switched to the
+// performance mode only for the network window, in which all the fetches of
+// one update are done back to back. Without a touch for a while the display
+// goes idle: the backlight is dimmed below the ambient level of backlight.h,
+// the clock and departures are redrawn less often and updates are spaced
+// out. In the night hours an idle display goes dark with the backlight off
+// and nothing redrawn. A touch wakes it.
+//
+// The energy report integrates the time spent in each state with typical
+// currents of the board, it is an estimate and not a measurement.
+
+#define POWER_IDLE_TIMEOUT_S 120 // Since the last touch
+#define POWER_NIGHT_START_HOUR 23 // Local time
+#define POWER_NIGHT_END_HOUR 6
+
+// Backlight as permille of the ambient level
+#define POWER_BACKLIGHT_ACTIVE 1000
+#define POWER_BACKLIGHT_IDLE 200
+#define POWER_BACKLIGHT_DARK 0
+
+#define POWER_IDLE_REFRESH_S 30 // Of the clock and departures
+#define POWER_UPDATE_INTERVAL_MS 10000
+#define POWER_IDLE_UPDATE_INTERVAL_MS 60000
+#define POWER_DARK_UPDATE_INTERVAL_MS 600000
+
+// Typical currents from the 5 V supply, mA
+#define POWER_SUPPLY_MV 5000
+#define POWER_CURRENT_BASE_MA 18       // Both cores in WFE at 125 MHz, LCD logic
+#define POWER_CURRENT_BUSY_MA 12       // Extra while rendering or fetching
+#define POWER_CURRENT_RADIO_ACTIVE_MA 40 // CYW43 in the performance mode
+#define POWER_CURRENT_RADIO_SAVE_MA 4  // Associated, in aggressive power save
+#define POWER_CURRENT_BACKLIGHT_MA 80  // At full level, linear in the level
+
+enum power_mode {
+    POWER_ACTIVE,
+    POWER_IDLE,
+    POWER_DARK,
+};
+
+struct power_report {
+    enum power_mode mode;
+    uint32_t elapsed_s;  // Since power_init()
+    uint16_t busy;       // Duty cycle of the scheduled tasks, permille
+    uint16_t radio;      // Time in the performance mode, permille
+    uint16_t backlight;  // Average level, of 1000
+    uint32_t energy_mwh; // Estimated per hour, the same number as average mW
+};
+
+// Put the radio into power save and start the active mode, after the Wi-Fi
+// connection is up and before the timers and the touch interrupt start. The
+// backlight is turned on by backlight_init().
+void power_init(void);
+// Re-evaluate the idle timeout and the night schedule, from a task
+void power_tick(void);
+// A touch. True if the display was idle or dark, so the touch only woke it
+// up
+bool power_wake(void);
+// Whether the periodic redraw should run now, from the render task
+bool power_refresh_due(void);
+// Whether anything drawn now can be seen
+bool power_display_on(void);
+// Time between updates in the current mode
+uint32_t power_update_interval_ms(void);
+// Around the fetches of one update, from the update task
+void power_network_begin(void);
+void power_network_end(void);
+void power_get(struct power_report *report);
+// Print one line with the estimate over USB stdio
+void power_dump(void);
+// Draw the estimate on the diagnostics page, below the memory numbers
+void power_render(void);
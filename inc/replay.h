@@ -0,0 +1,81 @@
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// HTTP responses recorded to the SD card and played back in place of the
+// network, to exercise and benchmark the response decoding, the parsers and
+// the rendering with the same data every time.
+//
+// With REPLAY_MODE set to REPLAY_RECORD every complete response is captured
+// as it arrives, with its header and transfer coding, together with the time
+// of every received slice since the request was sent, and appended to the
+// fixture file of its connection. With REPLAY_PLAY no connection is made,
+// every query takes the next response of the fixture, starting over after
+// the last one, and feeds it through the same decoder at the recorded pace.
+// The traces of the refresh cycle, see trace.h, cover the played responses.
+//
+// tools/replay_server.py records fixtures on the host, lists them and serves
+// them over HTTPS with added latency, chunking and fragmentation.
+//
+// A fixture is a sequence of responses, each a response header followed by
+// its segments, each a segment header followed by its data. All integers are
+// little-endian, the headers are written as they lie in RAM.
+
+#define REPLAY_OFF 0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY 2
+#ifndef REPLAY_MODE
+#define REPLAY_MODE REPLAY_OFF
+#endif
+
+// Of the connection numbered in the order of init_connection()
+#define REPLAY_FILE_FORMAT "REPLAY%u.BIN"
+#define REPLAY_FILE_NAME_SIZE 16
+#define REPLAY_MAGIC 0x594c5052 // "RPLY"
+#define REPLAY_VERSION 1
+#define REPLAY_MAX_FIXTURES 4
+#define REPLAY_MAX_FILE_SIZE (256 * 1024) // Later responses are not recorded
+#define REPLAY_CAPTURE_SIZE (12 * 1024)   // One response with segment headers
+#define REPLAY_READ_SIZE 1024             // Fed to the decoder at once
+#ifndef REPLAY_PACED
+#define REPLAY_PACED 1 // At the recorded pace, 0 as fast as possible
+#endif
+
+struct replay_response {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t segment_count;
+    uint32_t size; // Of the segments with their headers
+    uint32_t reserved;
+};
+static_assert(sizeof(struct replay_response) == 16, "Layout of the file");
+
+struct replay_segment {
+    uint32_t offset_us; // Since the request was sent
+    uint32_t length;    // Of the data following
+};
+static_assert(sizeof(struct replay_segment) == 8, "Layout of the file");
+
+// Takes received data, false stops the playback
+typedef bool (*replay_feed_t)(void *arg, const char *data, size_t length);
+
+#if REPLAY_MODE == REPLAY_RECORD
+// Start capturing the response of the request about to be sent
+void replay_capture_begin(void);
+// Append received data as one segment, from the lwIP receive callback
+void replay_capture(const void *data, size_t length);
+// Stop capturing and append the response to the fixture if it is complete,
+// from a task
+void replay_capture_end(unsigned fixture, bool complete);
+#else
+static inline void replay_capture_begin(void) {}
+static inline void replay_capture(const void *data, size_t length) {}
+static inline void replay_capture_end(unsigned fixture, bool complete) {}
+#endif
+
+// Feed the next response of the fixture until feed returns false or the
+// response ends, from a task. False if there is no response to play.
+bool replay_play(unsigned fixture, replay_feed_t feed, void *arg);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "pico/cyw43_arch.h"
+
+#include <stdbool.h>
+
+// Shared asynchronous DNS resolver.
+//
+// Queries the DHCP provided DNS servers directly over UDP, so that all A
+// records of a host and their TTL are known. Results are cached, refreshed
+// in the background shortly before they expire, and served stale while a
+// refresh is failing. Connections report unreachable addresses, which makes
+// the next lookup fail over to the next A record.
+
+#define RESOLVER_MAX_HOSTS 4
+#define RESOLVER_MAX_ADDRESSES 4
+#define RESOLVER_MAX_WAITERS 4
+#define RESOLVER_TICK_MS 500
+#define RESOLVER_QUERY_TIMEOUT_MS 2000
+#define RESOLVER_QUERY_RETRIES 3
+#define RESOLVER_RETRY_BACKOFF_S 30
+#define RESOLVER_MIN_TTL_S 30
+#define RESOLVER_MAX_TTL_S (24 * 60 * 60)
+#define RESOLVER_REFRESH_MARGIN_S 10
+#define RESOLVER_POLL_INTERVAL_MS 10
+#define RESOLVER_HOSTNAME_LENGTH 64 // Of restored hosts, including the zero
+
+// Addresses kept across restarts, IPv4 in network byte order
+struct resolver_snapshot_host {
+    char hostname[RESOLVER_HOSTNAME_LENGTH]; // Empty if unused
+    uint32_t addresses[RESOLVER_MAX_ADDRESSES];
+    uint32_t address_count;
+};
+
+struct resolver_snapshot {
+    struct resolver_snapshot_host hosts[RESOLVER_MAX_HOSTS];
+};
+
+// Same shape as the lwIP dns_found_callback, ipaddr is NULL on failure
+typedef void (*resolver_callback_fn)(const char *hostname,
+                                     const ip_addr_t *ipaddr, void *arg);
+
+// Must be called once the wireless network is up
+void resolver_init(void);
+
+// Non-blocking lookup, must be called from lwIP context or with the lwIP lock
+// held. The callback runs immediately on a cache hit, otherwise from lwIP
+// context once the query finishes. A NULL callback only warms the cache.
+// The hostname must stay valid forever, it is kept in the cache.
+void resolver_lookup(const char *hostname, resolver_callback_fn callback,
+                     void *arg);
+
+// Blocking lookup for the main thread
+bool resolver_resolve(const char *hostname, ip_addr_t *ipaddr);
+
+// Mark an address as unreachable, the next lookup returns another A record
+void resolver_report_failure(const char *hostname, const ip_addr_t *ipaddr);
+
+void resolver_save(struct resolver_snapshot *snapshot);
+// Seed the cache, the addresses are served while they are refreshed right
+// after resolver_init()
+void resolver_restore(const struct resolver_snapshot *snapshot);
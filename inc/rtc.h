@@ -1,5 +1,4 @@
 // Copyright 2023 Jakub Sosnovec
 #pragma once
 
-void set_rtc(void);
 void render_time(void);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cooperative run-to-completion scheduler of the firmware.
+//
+// Tasks are functions run on core 0 outside of interrupts, whenever their
+// period elapses or one of their events is signalled. Interrupts and lwIP
+// callbacks only signal events. Of the ready tasks the one with the highest
+// priority runs first, among equals the one ready the longest. A task runs
+// to completion, but a long one, like a fetch waiting for a TLS handshake,
+// waits through sched_wait(), which meanwhile runs the ready tasks of higher
+// priority on top of it. With nothing ready the core sleeps until the next
+// period or interrupt.
+//
+// Every task accounts its runs, its own run time without nested tasks and
+// waiting, and the latency from becoming ready to being started.
+
+#define SCHED_MAX_TASKS 8
+
+enum sched_priority {
+    SCHED_LOW,
+    SCHED_NORMAL,
+    SCHED_HIGH,
+};
+
+// A task gets the ones pending when it is started
+enum sched_event {
+    SCHED_EVENT_TIMER = 1u << 0, // The period elapsed
+    SCHED_EVENT_TOUCH = 1u << 1,
+    SCHED_EVENT_NETWORK = 1u << 2, // Progress of a connection
+    SCHED_EVENT_UPDATE = 1u << 3,  // Time to fetch new data
+};
+
+struct sched_task;
+typedef void (*sched_run_t)(uint32_t events);
+
+struct sched_stats {
+    const char *name;
+    enum sched_priority priority;
+    uint32_t runs;
+    uint64_t run_us; // Own time
+    uint32_t max_run_us;
+    uint32_t max_latency_us; // Ready until started
+};
+
+void sched_init(void);
+// Period 0 for a task run only on events
+struct sched_task *sched_add(const char *name, enum sched_priority priority,
+                             uint32_t period_ms, sched_run_t run);
+// Safe from interrupts and lwIP callbacks, a NULL task is ignored
+void sched_signal(struct sched_task *task, uint32_t events);
+// The task running now, NULL outside of tasks
+struct sched_task *sched_current(void);
+// Run the tasks, never returns
+void sched_run(void);
+// Wait until one of the events is signalled to the current task or the time
+// passes, running the ready tasks of higher priority meanwhile. Returns the
+// events that ended the wait, cleared, or 0 on timeout. Outside of tasks it
+// only sleeps.
+uint32_t sched_wait(uint32_t events, uint32_t timeout_ms);
+static inline void sched_sleep_ms(uint32_t ms) { sched_wait(0, ms); }
+// Own run time of all tasks since sched_run()
+uint64_t sched_busy_us(void);
+// Up to max entries, returns the number of tasks
+unsigned sched_get(struct sched_stats *stats, unsigned max);
+// Print one line per task over USB stdio
+void sched_dump(void);
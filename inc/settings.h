@@ -0,0 +1,72 @@
+#pragma once
+
+#include "tram.h"
+#include "weather.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Runtime configuration kept in the last sectors of the flash, so a deployed
+// unit is re-targeted over USB serial instead of rebuilt.
+//
+// Records are appended to a log of fixed slots spread over the reserved
+// sectors, the valid one with the highest sequence number wins. A sector is
+// erased only when the log wraps into it, while the newest record is in the
+// other one, so a power loss during a save keeps the previous settings. The
+// settings are used in place in the memory mapped flash. Until the first
+// save the compile-time defaults from CMake are used.
+
+#define SETTINGS_FLASH_SECTORS 2 // At the end of the flash
+#define SETTINGS_SLOT_SIZE 1024
+#define SETTINGS_MAGIC 0x47464e43 // "CNFG"
+#define SETTINGS_VERSION 2
+#define SETTINGS_CONSOLE_TIMEOUT_MS 60000
+#define SETTINGS_CONSOLE_POLL_MS 20
+#define SETTINGS_LINE_MAX_SIZE 512
+
+// Sizes include the terminating zero
+#define SETTINGS_SSID_SIZE 33
+#define SETTINGS_PASSWORD_SIZE 65
+#define SETTINGS_API_KEY_SIZE 384
+#define SETTINGS_STOP_SIZE 16
+#define SETTINGS_LOCATION_NAME_SIZE 12
+#define SETTINGS_COORDINATE_SIZE 12
+
+struct settings_location {
+    char name[SETTINGS_LOCATION_NAME_SIZE]; // Shown with its forecast
+    // Decimal degrees as they go into the weather query
+    char latitude[SETTINGS_COORDINATE_SIZE];
+    char longitude[SETTINGS_COORDINATE_SIZE];
+};
+
+struct settings {
+    char wifi_ssid[SETTINGS_SSID_SIZE];
+    char wifi_password[SETTINGS_PASSWORD_SIZE];
+    char golemio_api_key[SETTINGS_API_KEY_SIZE];
+    char tram_stop[SETTINGS_STOP_SIZE]; // PID stop ID, e.g. U876Z1P
+    // The first one also gives the current weather, unused ones are empty
+    struct settings_location locations[WEATHER_MAX_LOCATIONS];
+    // Route short names, empty ones are not shown
+    char tram_lines[TRAM_MAX_LINES][TRAM_LINE_NAME_SIZE];
+};
+
+struct settings_record {
+    uint32_t magic;
+    uint32_t sequence;
+    uint16_t version;
+    uint16_t size; // Of the settings
+    uint32_t crc;  // Of the settings
+    struct settings settings;
+};
+static_assert(sizeof(struct settings_record) <= SETTINGS_SLOT_SIZE,
+              "A record fits one slot");
+
+// Find the newest record, before anything reads the settings
+void settings_init(void);
+// Points into the flash, valid until the next save
+const struct settings *settings_get(void);
+// Everything needed to connect and query is set
+bool settings_complete(void);
+// Edit the settings line by line over USB stdio until exit, a save reboots
+void settings_console(void);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "resolver.h"
+#include "tram.h"
+#include "weather.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// The last known state kept on the SD card, so a restart shows the weather
+// and the departures right away instead of an empty screen until the network
+// is up.
+//
+// Records alternate between two files, the one with the higher sequence
+// number and a valid CRC wins, so a write cut short by a power loss costs at
+// most the newer record. Restored values are drawn as stale until the first
+// update. Departures are wall-clock times and the RP2040 keeps no time across
+// a reset, so they come back only once the clock is synchronized.
+//
+// All integers are little-endian, the record is written as it lies in RAM.
+
+#define SNAPSHOT_FILE_NAMES {"STATE0.BIN", "STATE1.BIN"}
+#define SNAPSHOT_MAGIC 0x54415453 // "STAT"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_INTERVAL_S 600
+
+struct snapshot_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size; // Of the whole record
+    uint32_t sequence;
+    uint32_t crc; // Of the whole record with this field zeroed
+    int64_t saved_utc;
+    struct weather_snapshot weather;
+    struct tram_snapshot tram;
+    struct resolver_snapshot resolver;
+};
+static_assert(sizeof(struct snapshot_record) <= UINT16_MAX, "Fits the size");
+
+// Load the newest record and restore the weather and the DNS cache from it,
+// false if there is none
+bool snapshot_restore(void);
+// Restore the departures of the loaded record, the clock must be synchronized
+void snapshot_restore_departures(void);
+// Capture the current state at most every SNAPSHOT_INTERVAL_S, the file is
+// written later by snapshot_flush
+void snapshot_save(void);
+// Write a captured record, from the context that draws on the LCD, which
+// shares the bus with the card
+void snapshot_flush(void);
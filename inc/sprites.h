@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Small images from the asset pack, drawn from a RAM cache.
+//
+// Decoded tiles are kept in a few fixed slots, the least recently used one
+// is replaced on a miss, so changing a sprite costs at most one asset fetch.
+// A sprite is blitted with one LCD window and one DMA transfer. What was
+// drawn where is remembered, and drawing the same sprite at the same place
+// again does nothing until the screen is invalidated.
+
+#define SPRITES_CACHE_SLOTS 4
+#define SPRITES_TILE_MAX_PIXELS (64 * 64)
+#define SPRITES_MAX_PLACEMENTS 4
+
+// Draw the named sprite with its top left corner at (x, y), false if it is
+// not in the pack or does not fit a cache slot
+bool sprites_draw(const char *name, uint16_t x, uint16_t y);
+// The screen was cleared, the next draws must not be skipped
+void sprites_invalidate(void);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+// The SD card in the slot of the LCD board, shared by everything that keeps
+// files on it. FatFs is not reentrant, all users run from the same context.
+
+// Mount the card, later calls return the result of the first one
+bool storage_mount(void);
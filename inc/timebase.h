@@ -0,0 +1,39 @@
+#pragma once
+
+#include "pico/time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// The one time source of the firmware.
+//
+// Intervals and deadlines use the monotonic 64-bit microsecond timer, which
+// never jumps. UTC is that plus the offset kept by the NTP client, and local
+// time is derived from UTC through the time zone table, computed at most
+// once per second. Wall-clock times that are waited for, like departures,
+// are turned into monotonic deadlines once, so a later NTP correction does
+// not move them.
+
+#define TIMEBASE_SYNC_POLL_INTERVAL_MS 100
+
+struct timebase_local {
+    int64_t utc; // Epoch seconds
+    struct tm tm;
+    const char *abbreviation; // Of the time zone, e.g. CEST
+};
+
+// Start NTP and wait for the first sync, the network must be up
+void timebase_init(void);
+
+// Microseconds since boot
+static inline uint64_t timebase_now_us(void) { return time_us_64(); }
+// Microseconds since the Unix epoch
+int64_t timebase_utc_us(void);
+// Monotonic time at which the given UTC epoch second is reached, now if that
+// was before boot
+uint64_t timebase_deadline_us(int64_t utc);
+// UTC epoch second of a monotonic deadline, the inverse of the above
+int64_t timebase_deadline_utc(uint64_t deadline_us);
+// Current local time, safe from interrupts
+void timebase_local(struct timebase_local *local);
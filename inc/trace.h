@@ -0,0 +1,57 @@
+#pragma once
+
+#include "pico/time.h"
+
+#include <stdint.h>
+
+// Lightweight latency tracing of the refresh cycle.
+//
+// Spans are timed with the microsecond timer, kept in a ring of the most
+// recent events and accumulated into per-stage log-linear histograms (four
+// buckets per power of two). Recording is safe from interrupts.
+
+#define TRACE_RING_SIZE 256
+#define TRACE_HISTOGRAM_SUB_BITS 2
+#define TRACE_HISTOGRAM_BUCKETS (32 << TRACE_HISTOGRAM_SUB_BITS)
+
+enum trace_stage {
+    TRACE_DNS,
+    TRACE_TCP_CONNECT,
+    TRACE_TLS_HANDSHAKE,
+    TRACE_REQUEST_SEND,
+    TRACE_FIRST_BYTE, // Request sent until the first response byte
+    TRACE_LAST_BYTE,  // First until the last response byte
+    TRACE_JSON_PARSE,
+    TRACE_STATE_UPDATE,
+    TRACE_RENDER_TIME,
+    TRACE_RENDER_TRAM,
+    TRACE_RENDER_WEATHER,
+    TRACE_STAGE_COUNT,
+};
+
+static inline uint32_t trace_now(void) { return time_us_32(); }
+
+void trace_record(enum trace_stage stage, uint32_t start_us, uint32_t end_us);
+
+struct trace_scope {
+    enum trace_stage stage;
+    uint32_t start_us;
+};
+
+static inline void trace_scope_end(struct trace_scope *scope) {
+    trace_record(scope->stage, scope->start_us, trace_now());
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Trace the rest of the enclosing block
+#define TRACE_SCOPE(stage)                                                     \
+    struct trace_scope TRACE_CONCAT(trace_scope_, __LINE__)                    \
+        __attribute__((cleanup(trace_scope_end))) = {(stage), trace_now()}
+
+// Print one line per stage with the summary and the non-empty buckets
+void trace_dump_histograms(void);
+// Print the event ring as Chrome trace JSON, for chrome://tracing or Perfetto
+void trace_dump_chrome(void);
+// Draw the per-stage latencies over a cleared screen
+void trace_render(void);
@@ -1,17 +1,23 @@
 #pragma once
 
+#include <stdint.h>
+
 #define HTTPS_TRAM_HOSTNAME "api.golemio.cz"
-#define HTTPS_TRAM_QUERY                                                       \
+// Takes the stop ID
+#define HTTPS_TRAM_QUERY_FORMAT                                                \
     "/v2/pid/"                                                                 \
-    "departureboards?ids=U876Z1P&minutesBefore=0&minutesAfter=15&"             \
+    "departureboards?ids=%s&minutesBefore=0&minutesAfter=15&"                  \
     "includeMetroTrains=false&airCondition=false&mode=departures&order=real&"  \
     "skip=canceled&limit=20&total=20&offset=0"
 
-#define HTTPS_TRAM_REQUEST                                                     \
-    "GET " HTTPS_TRAM_QUERY " HTTP/1.1\r\n"                                    \
+// Request head without the terminating empty line, network.c appends the
+// conditional headers and the final CRLF on every query. Takes the stop ID
+// and the API key.
+#define HTTPS_TRAM_REQUEST_FORMAT                                              \
+    "GET " HTTPS_TRAM_QUERY_FORMAT " HTTP/1.1\r\n"                             \
     "Host: " HTTPS_TRAM_HOSTNAME "\r\n"                                        \
-    "X-Access-Token: " GOLEMIO_API_KEY "\r\n"                                  \
-    "\r\n"
+    "X-Access-Token: %s\r\n"
+#define HTTPS_TRAM_REQUEST_MAX_SIZE 768
 
 #define TRAM_TLS_ROOT_CERT                                                     \
     "-----BEGIN CERTIFICATE-----\n\
@@ -37,6 +43,25 @@ pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n\
 MrY=\n\
 -----END CERTIFICATE-----\n"
 
+#define TRAM_MAX_LINES 3 // Tracked routes, set in the settings
+#define TRAM_MAX_RECORDS_PER_LINE 4
+#define TRAM_LINE_NAME_SIZE 8 // Including the terminating zero
+
+// Departures kept across restarts, as UTC epoch seconds, 0 if there are fewer
+struct tram_snapshot {
+    // Matched by name on restore, the tracked lines may have changed
+    char lines[TRAM_MAX_LINES][TRAM_LINE_NAME_SIZE];
+    int64_t departures[TRAM_MAX_LINES][TRAM_MAX_RECORDS_PER_LINE];
+};
+
+// Builds the request from the settings
 void init_tram(void);
-void update_tram(const char *http_response);
+// Request head for init_connection, built once
+const char *tram_request(void);
+// Parses the zero terminated response body in place, modifying it
+void update_tram(char *http_response);
 void render_tram(void);
+// The clock must be synchronized for both, departures are wall-clock times
+void tram_save(struct tram_snapshot *snapshot);
+// Show the departures as stale until the next update
+void tram_restore(const struct tram_snapshot *snapshot);
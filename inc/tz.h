@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Time zone conversions without libc's TZ handling.
+//
+// The UTC offset transitions of one zone are compiled from tzdata at build
+// time by tools/tzgen.py (TZ_ZONE, TZ_FIRST_YEAR and TZ_LAST_YEAR in
+// CMake). Lookups are a binary search, broken-down time is computed
+// arithmetically, so nothing here calls mktime.
+
+struct tz_transition {
+    uint32_t utc; // First second with the new offset
+    int32_t offset; // Seconds east of UTC
+    const char *abbreviation;
+};
+
+// Generated table, transitions sorted by time
+extern const char tz_zone_name[];
+extern const int32_t tz_initial_offset;
+extern const char tz_initial_abbreviation[];
+extern const struct tz_transition tz_transitions[];
+extern const size_t tz_transition_count;
+
+// Seconds east of UTC at the given UTC time
+int32_t tz_offset(int64_t utc);
+const char *tz_abbreviation(int64_t utc);
+
+// UTC <-> broken-down time of the same instant, tm_isdst and tm_gmtoff are
+// not used
+void tz_utc_to_tm(int64_t utc, int32_t offset, struct tm *tm);
+int64_t tz_tm_to_utc(const struct tm *tm, int32_t offset);
+
+// Local time of the zone
+void tz_localtime(int64_t utc, struct tm *tm);
+// Ambiguous times at the end of DST resolve to the earlier instant, times
+// skipped at its start are moved forward by the gap
+int64_t tz_local_to_utc(const struct tm *tm);
+
+// Parse an ISO 8601 date and time with an explicit offset, such as
+// 2024-03-31T02:30:00+02:00 or 2024-03-31T00:30:00.000Z
+bool tz_parse_iso8601(const char *str, int64_t *utc);
@@ -1,16 +1,24 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define HTTPS_WEATHER_HOSTNAME "api.open-meteo.com"
-#define HTTPS_WEATHER_QUERY                                                    \
+// Takes comma separated latitudes and longitudes, with more than one
+// location the response is an array of them
+#define HTTPS_WEATHER_QUERY_FORMAT                                             \
     "/v1/"                                                                     \
-    "forecast?latitude=50.07&longitude=14.42&current=temperature_2m,"          \
-    "precipitation&daily="                                                     \
-    "temperature_2m_max,precipitation_sum&timezone=auto&forecast_days=1"
+    "forecast?latitude=%s&longitude=%s&current=temperature_2m,"                \
+    "precipitation,weather_code,is_day&hourly=temperature_2m,precipitation&"   \
+    "daily=temperature_2m_max,precipitation_sum,sunrise,sunset&"               \
+    "timezone=auto&forecast_days=3&forecast_hours=48&timeformat=unixtime"
 
-#define HTTPS_WEATHER_REQUEST                                                  \
-    "GET " HTTPS_WEATHER_QUERY " HTTP/1.1\r\n"                                 \
-    "Host: " HTTPS_WEATHER_HOSTNAME "\r\n"                                     \
-    "\r\n"
+// Request head without the terminating empty line, network.c appends the
+// conditional headers and the final CRLF on every query
+#define HTTPS_WEATHER_REQUEST_FORMAT                                           \
+    "GET " HTTPS_WEATHER_QUERY_FORMAT " HTTP/1.1\r\n"                          \
+    "Host: " HTTPS_WEATHER_HOSTNAME "\r\n"
+#define HTTPS_WEATHER_REQUEST_MAX_SIZE 512
 
 #define WEATHER_TLS_ROOT_CERT                                                  \
     "-----BEGIN CERTIFICATE-----\n\
@@ -45,6 +53,48 @@ mRGunUHBcnWEvgJBQl9nJEiU0Zsnvgc/ubhPgXRR4Xq37Z0j4r7g1SgEEzwxA57d\n\
 emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=\n\
 -----END CERTIFICATE-----\n"
 
+#define WEATHER_MAX_LOCATIONS 3 // Set in the settings
+#define WEATHER_FORECAST_HOURS 48
+
+// Condition icon, a sprite named after the weather code, see weather.c
+#define WEATHER_ICON_X 400
+#define WEATHER_ICON_Y 236
+
+// Hourly forecast of one location at a time, a column per hour, see chart.h
+#define WEATHER_CHART_X 20
+#define WEATHER_CHART_COLUMN_WIDTH 7
+#define WEATHER_TEMPERATURE_CHART_Y 232
+#define WEATHER_TEMPERATURE_CHART_HEIGHT 44
+#define WEATHER_TEMPERATURE_CHART_MIN_SPREAD 50 // Tenths of a degree
+#define WEATHER_PRECIPITATION_CHART_Y 280
+#define WEATHER_PRECIPITATION_CHART_HEIGHT 36
+#define WEATHER_PRECIPITATION_CHART_MIN_TOP 20 // Tenths of a mm
+#define WEATHER_LOCATION_X 364 // Name of the location of the charts
+#define WEATHER_LOCATION_Y 304
+
+// Kept across restarts
+struct weather_snapshot {
+    int32_t current_temp; // Tenths of a degree C
+    int32_t max_daily_temp;
+    int32_t current_precipitation; // Tenths of a mm
+    int32_t precipitation_sum;
+    int32_t weather_code;
+    uint32_t is_day;
+};
+
+// Builds the request from the settings
 void init_weather(void);
-void update_weather(const char *http_response);
+// Request head for init_connection, built once
+const char *weather_request(void);
+// Parses the zero terminated response body in place, modifying it
+void update_weather(char *http_response);
+// Also moves the forecast charts on to the next location
 void render_weather(void);
+// The screen was cleared, the charts are drawn again in full
+void weather_invalidate(void);
+// Today's sunrise and sunset at the first location as UTC epoch seconds,
+// false until the first update. From a task, it reads into a static copy.
+bool weather_daylight(int64_t *sunrise, int64_t *sunset);
+void weather_save(struct weather_snapshot *snapshot);
+// Show the values as stale until the next update
+void weather_restore(const struct weather_snapshot *snapshot);
@@ -22,6 +22,18 @@
 
 #include "log.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef LOG_DEFERRED
+#include "hardware/sync.h"
+#include "pico/platform.h"
+
+#include "timebase.h"
+#include "tz.h"
+#endif
+
 #define MAX_CALLBACKS 32
 
 typedef struct {
@@ -30,12 +42,18 @@ typedef struct {
   int level;
 } Callback;
 
+typedef struct {
+  const char *module;
+  int level;
+} ModuleLevel;
+
 static struct {
   void *udata;
   log_LockFn lock;
   int level;
   bool quiet;
   Callback callbacks[MAX_CALLBACKS];
+  ModuleLevel modules[LOG_MAX_MODULES];
 } L;
 
 
@@ -112,6 +130,58 @@ void log_set_quiet(bool enable) {
 }
 
 
+int log_set_module_level(const char *module, int level) {
+  ModuleLevel *free_slot = NULL;
+  for (int i = 0; i < LOG_MAX_MODULES; i++) {
+    ModuleLevel *m = &L.modules[i];
+    if (m->module && strcmp(m->module, module) == 0) {
+      m->level = level;
+      return 0;
+    }
+    if (!m->module && !free_slot) { free_slot = m; }
+  }
+  if (!free_slot) { return -1; }
+  *free_slot = (ModuleLevel) { module, level };
+  return 0;
+}
+
+
+void log_clear_module_level(const char *module) {
+  for (int i = 0; i < LOG_MAX_MODULES; i++) {
+    if (L.modules[i].module && strcmp(L.modules[i].module, module) == 0) {
+      L.modules[i].module = NULL;
+    }
+  }
+}
+
+
+/* Level override of the module the file belongs to, -1 if there is none */
+static int module_level(const char *file) {
+  size_t file_len = strlen(file);
+  for (int i = 0; i < LOG_MAX_MODULES; i++) {
+    const char *module = L.modules[i].module;
+    if (!module) { continue; }
+    size_t len = strlen(module);
+    /* Full paths are matched by their file name */
+    if (len <= file_len && strcmp(file + file_len - len, module) == 0 &&
+        (len == file_len || file[file_len - len - 1] == '/')) {
+      return L.modules[i].level;
+    }
+  }
+  return -1;
+}
+
+
+static bool stdout_enabled(int level, int override) {
+  return !L.quiet && level >= (override >= 0 ? override : L.level);
+}
+
+
+static bool callback_enabled(const Callback *cb, int level, int override) {
+  return level >= cb->level && level >= override;
+}
+
+
 int log_add_callback(log_LogFn fn, void *udata, int level) {
   for (int i = 0; i < MAX_CALLBACKS; i++) {
     if (!L.callbacks[i].fn) {
@@ -137,6 +207,352 @@ static void init_event(log_Event *ev, void *udata) {
 }
 
 
+#ifdef LOG_DEFERRED
+
+/* Epoch seconds of 2001, the time since boot never gets that far */
+#define LOG_SYNCED_MIN_S 1000000000
+
+/* UTC in microseconds, or the time since boot before the clock is
+ * synchronized. Safe from interrupts. */
+static int64_t now_us(void) {
+  int64_t utc_us = timebase_utc_us();
+  return utc_us != 0 ? utc_us : (int64_t)timebase_now_us();
+}
+
+/* Output an event, filtered with the module override it was recorded with */
+static void dispatch(int level, const char *file, int line, int64_t time_us,
+                     int override, const char *fmt, ...) {
+  struct tm tm;
+  int64_t seconds = time_us / 1000000;
+  if (seconds >= LOG_SYNCED_MIN_S) {
+    tz_localtime(seconds, &tm);
+  } else {
+    tz_utc_to_tm(seconds, 0, &tm);
+  }
+  log_Event ev = {
+    .fmt   = fmt,
+    .file  = file,
+    .line  = line,
+    .level = level,
+    .time  = &tm,
+  };
+
+  lock();
+
+  if (stdout_enabled(level, override)) {
+    init_event(&ev, stderr);
+    va_start(ev.ap, fmt);
+    stdout_callback(&ev);
+    va_end(ev.ap);
+  }
+
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    Callback *cb = &L.callbacks[i];
+    if (callback_enabled(cb, level, override)) {
+      init_event(&ev, cb->udata);
+      va_start(ev.ap, fmt);
+      cb->fn(&ev);
+      va_end(ev.ap);
+    }
+  }
+
+  unlock();
+}
+
+
+/*
+ * Deferred logging: log_log only copies the format string pointer, the
+ * source location and the raw arguments into a ring buffer. Strings are
+ * copied by value (truncated), since they often live on the caller's stack.
+ * log_drain() later formats the records and runs the usual outputs, so
+ * interrupt handlers never touch the time zone table, printf or USB stdio.
+ * Records carry the time of the firmware's time base, see timebase.h, shown
+ * as local time once NTP is synchronized and as the time since boot before.
+ *
+ * Cortex-M0+ has no compare-and-swap, so a record is encoded on the stack
+ * and then copied into the ring with interrupts disabled for the copy only.
+ */
+
+typedef enum {
+  ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_PTRDIFF, ARG_INTMAX,
+  ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR
+} ArgType;
+
+typedef struct {
+  int len;         /* Length of the conversion specification */
+  ArgType type;
+  bool star_width;
+  bool star_precision;
+} Spec;
+
+typedef struct {
+  uint16_t size;   /* Whole record, including this header */
+  uint8_t level;
+  int8_t override; /* Module level when recorded, -1 if none */
+  const char *file;
+  int line;
+  const char *fmt;
+  int64_t time_us; /* See now_us() */
+} Record;
+
+static struct {
+  uint8_t buf[LOG_RING_SIZE];
+  volatile uint32_t head;    /* Written by producers with interrupts off */
+  volatile uint32_t tail;    /* Written by log_drain only */
+  volatile uint32_t dropped;
+} R;
+
+
+/* Parse the conversion specification starting at the '%' */
+static Spec parse_spec(const char *p) {
+  Spec spec = { 1, ARG_NONE, false, false };
+  const char *s = p + 1;
+  if (*s == '%') { spec.len = 2; return spec; }
+  while (*s && strchr("-+ #0", *s)) { s++; }
+  if (*s == '*') { spec.star_width = true; s++; }
+  while (*s >= '0' && *s <= '9') { s++; }
+  if (*s == '.') {
+    s++;
+    if (*s == '*') { spec.star_precision = true; s++; }
+    while (*s >= '0' && *s <= '9') { s++; }
+  }
+
+  int length = 0; /* 1 l, 2 ll, 3 z, 4 t, 5 j, 6 L */
+  if (*s == 'h') { s++; if (*s == 'h') { s++; } }
+  else if (*s == 'l') { s++; length = 1; if (*s == 'l') { s++; length = 2; } }
+  else if (*s == 'z') { s++; length = 3; }
+  else if (*s == 't') { s++; length = 4; }
+  else if (*s == 'j') { s++; length = 5; }
+  else if (*s == 'L') { s++; length = 6; }
+
+  static const ArgType int_types[] = {
+    ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_PTRDIFF, ARG_INTMAX, ARG_INT
+  };
+  switch (*s) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      spec.type = int_types[length]; break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+    case 'A':
+      spec.type = length == 6 ? ARG_LDOUBLE : ARG_DOUBLE; break;
+    case 'p': spec.type = ARG_PTR; break;
+    case 's': spec.type = ARG_STR; break;
+    default: spec.len = s - p; return spec; /* Unsupported, printed as is */
+  }
+  spec.len = s - p + 1;
+  return spec;
+}
+
+
+#define ENCODE(type) do { \
+    type v = va_arg(ap, type); \
+    if (pos + sizeof(v) > n) { return false; } \
+    memcpy(out + pos, &v, sizeof(v)); pos += sizeof(v); \
+  } while (0)
+
+/* Copy the arguments described by fmt and store their length, false if they
+ * do not fit */
+static bool encode_args(uint8_t *out, size_t n, size_t *len, const char *fmt,
+                        va_list ap) {
+  size_t pos = 0;
+  for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+    Spec spec = parse_spec(p);
+    p += spec.len;
+    if (spec.star_width) { ENCODE(int); }
+    if (spec.star_precision) { ENCODE(int); }
+    switch (spec.type) {
+      case ARG_NONE: break;
+      case ARG_INT: ENCODE(int); break;
+      case ARG_LONG: ENCODE(long); break;
+      case ARG_LLONG: ENCODE(long long); break;
+      case ARG_SIZE: ENCODE(size_t); break;
+      case ARG_PTRDIFF: ENCODE(ptrdiff_t); break;
+      case ARG_INTMAX: ENCODE(intmax_t); break;
+      case ARG_DOUBLE: ENCODE(double); break;
+      case ARG_LDOUBLE: ENCODE(long double); break;
+      case ARG_PTR: ENCODE(void *); break;
+      case ARG_STR: {
+        const char *str = va_arg(ap, const char *);
+        if (!str) { str = "(null)"; }
+        size_t str_len = strnlen(str, LOG_STRING_MAX - 1);
+        if (pos + str_len + 1 > n) { return false; }
+        memcpy(out + pos, str, str_len);
+        out[pos + str_len] = '\0';
+        pos += str_len + 1;
+        break;
+      }
+    }
+  }
+  *len = pos;
+  return true;
+}
+
+
+#define DECODE(type) do { \
+    type v; memcpy(&v, args, sizeof(v)); args += sizeof(v); \
+    written = snprintf(out + pos, n - pos, spec_str, v); \
+  } while (0)
+
+/* Format the record arguments the same way vsnprintf would */
+static void decode_args(char *out, size_t n, const char *fmt,
+                        const uint8_t *args) {
+  size_t pos = 0;
+  const char *p = fmt;
+  while (*p && pos < n - 1) {
+    if (*p != '%') { out[pos++] = *p++; continue; }
+    Spec spec = parse_spec(p);
+
+    /* Substitute the '*' values to get a plain specification */
+    char spec_str[32];
+    size_t spec_pos = 0;
+    for (int i = 0; i < spec.len && spec_pos < sizeof(spec_str) - 12; i++) {
+      if (p[i] == '*') {
+        int v;
+        memcpy(&v, args, sizeof(v));
+        args += sizeof(v);
+        spec_pos += sprintf(spec_str + spec_pos, "%d", v);
+      } else {
+        spec_str[spec_pos++] = p[i];
+      }
+    }
+    spec_str[spec_pos] = '\0';
+    p += spec.len;
+
+    int written = 0;
+    switch (spec.type) {
+      case ARG_NONE:
+        /* Either "%%" or a specification we do not know, printed as is */
+        written = snprintf(out + pos, n - pos,
+                           strcmp(spec_str, "%%") == 0 ? "%%" : "%s",
+                           spec_str);
+        break;
+      case ARG_INT: DECODE(int); break;
+      case ARG_LONG: DECODE(long); break;
+      case ARG_LLONG: DECODE(long long); break;
+      case ARG_SIZE: DECODE(size_t); break;
+      case ARG_PTRDIFF: DECODE(ptrdiff_t); break;
+      case ARG_INTMAX: DECODE(intmax_t); break;
+      case ARG_DOUBLE: DECODE(double); break;
+      case ARG_LDOUBLE: DECODE(long double); break;
+      case ARG_PTR: DECODE(void *); break;
+      case ARG_STR:
+        written = snprintf(out + pos, n - pos, spec_str, (const char *)args);
+        args += strlen((const char *)args) + 1;
+        break;
+    }
+    if (written > 0) { pos += written; }
+    if (pos > n - 1) { pos = n - 1; }
+  }
+  out[pos] = '\0';
+}
+
+
+static void ring_copy_in(uint32_t at, const void *data, size_t len) {
+  uint32_t offset = at % LOG_RING_SIZE;
+  size_t first = LOG_RING_SIZE - offset;
+  if (first > len) { first = len; }
+  memcpy(R.buf + offset, data, first);
+  memcpy(R.buf, (const uint8_t *)data + first, len - first);
+}
+
+
+static void ring_copy_out(uint32_t at, void *data, size_t len) {
+  uint32_t offset = at % LOG_RING_SIZE;
+  size_t first = LOG_RING_SIZE - offset;
+  if (first > len) { first = len; }
+  memcpy(data, R.buf + offset, first);
+  memcpy((uint8_t *)data + first, R.buf, len - first);
+}
+
+
+static bool is_enabled(int level, int override) {
+  if (stdout_enabled(level, override)) { return true; }
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (callback_enabled(&L.callbacks[i], level, override)) { return true; }
+  }
+  return false;
+}
+
+
+void log_drain(void) {
+  /* Producers increment it with interrupts off too */
+  uint32_t irq = save_and_disable_interrupts();
+  uint32_t dropped = R.dropped;
+  R.dropped = 0;
+  restore_interrupts(irq);
+  if (dropped) {
+    dispatch(LOG_WARN, LOG_FILE, __LINE__, now_us(), -1,
+             "%u log records dropped", (unsigned)dropped);
+  }
+
+  while (R.tail != R.head) {
+    struct {
+      Record rec;
+      uint8_t args[LOG_RECORD_MAX - sizeof(Record)];
+    } entry;
+    ring_copy_out(R.tail, &entry.rec, sizeof(entry.rec));
+    ring_copy_out(R.tail + sizeof(entry.rec), entry.args,
+                  entry.rec.size - sizeof(entry.rec));
+    R.tail += entry.rec.size;
+
+    char message[LOG_MESSAGE_MAX];
+    decode_args(message, sizeof(message), entry.rec.fmt, entry.args);
+    dispatch(entry.rec.level, entry.rec.file, entry.rec.line, entry.rec.time_us,
+             entry.rec.override, "%s", message);
+  }
+}
+
+
+void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  int override = module_level(file);
+  if (!is_enabled(level, override)) { return; }
+
+  struct {
+    Record rec;
+    uint8_t args[LOG_RECORD_MAX - sizeof(Record)];
+  } entry;
+  va_list ap;
+  va_start(ap, fmt);
+  size_t args_len;
+  bool encoded = encode_args(entry.args, sizeof(entry.args), &args_len, fmt,
+                             ap);
+  va_end(ap);
+  if (!encoded) {
+    /* Arguments too long, keep at least the location */
+    fmt = "(log arguments too long)";
+    args_len = 0;
+  }
+  /* Keep records 4-byte aligned in the ring */
+  size_t size = (sizeof(entry.rec) + args_len + 3) & ~(size_t)3;
+  entry.rec = (Record) {
+    .size     = size,
+    .level    = level,
+    .override = override,
+    .file     = file,
+    .line     = line,
+    .fmt      = fmt,
+    .time_us  = now_us(),
+  };
+
+  uint32_t irq = save_and_disable_interrupts();
+  if (R.head - R.tail + size > LOG_RING_SIZE) {
+    R.dropped++;
+  } else {
+    ring_copy_in(R.head, &entry, size);
+    R.head += size;
+  }
+  restore_interrupts(irq);
+
+  /* Do not lose the last words before a crash */
+  if (level == LOG_FATAL && __get_current_exception() == 0) {
+    log_drain();
+  }
+}
+
+#else
+
+void log_drain(void) {}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
   log_Event ev = {
     .fmt   = fmt,
@@ -145,9 +561,11 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
+  int override = module_level(file);
+
   lock();
 
-  if (!L.quiet && level >= L.level) {
+  if (stdout_enabled(level, override)) {
     init_event(&ev, stderr);
     va_start(ev.ap, fmt);
     stdout_callback(&ev);
@@ -156,7 +574,7 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
 
   for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
     Callback *cb = &L.callbacks[i];
-    if (level >= cb->level) {
+    if (callback_enabled(cb, level, override)) {
       init_event(&ev, cb->udata);
       va_start(ev.ap, fmt);
       cb->fn(&ev);
@@ -166,3 +584,5 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
 
   unlock();
 }
+
+#endif
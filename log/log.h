@@ -15,6 +15,23 @@
 
 #define LOG_VERSION "0.1.0"
 
+/* Deferred logging, see log_drain() */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 4096 /* Must be a power of two */
+#endif
+#ifndef LOG_RECORD_MAX
+#define LOG_RECORD_MAX 160
+#endif
+#ifndef LOG_STRING_MAX
+#define LOG_STRING_MAX 48
+#endif
+#ifndef LOG_MESSAGE_MAX
+#define LOG_MESSAGE_MAX 256
+#endif
+#ifndef LOG_MAX_MODULES
+#define LOG_MAX_MODULES 8
+#endif
+
 typedef struct {
   va_list ap;
   const char *fmt;
@@ -28,22 +45,73 @@ typedef struct {
 typedef void (*log_LogFn)(log_Event *ev);
 typedef void (*log_LockFn)(bool lock, void *udata);
 
-enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
+/* Numeric levels, usable in #if */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_FATAL 5
+#define LOG_LEVEL_NONE  6
+
+enum {
+  LOG_TRACE = LOG_LEVEL_TRACE,
+  LOG_DEBUG = LOG_LEVEL_DEBUG,
+  LOG_INFO  = LOG_LEVEL_INFO,
+  LOG_WARN  = LOG_LEVEL_WARN,
+  LOG_ERROR = LOG_LEVEL_ERROR,
+  LOG_FATAL = LOG_LEVEL_FATAL
+};
+
+/*
+ * Levels below the compile-time threshold compile to nothing: the call, its
+ * format string and its arguments are all dropped, but still type checked.
+ * The threshold comes from the build (LOG_DEFAULT_COMPILE_LEVEL), a
+ * translation unit may define its own LOG_COMPILE_LEVEL before including
+ * this header.
+ */
+#ifndef LOG_DEFAULT_COMPILE_LEVEL
+#define LOG_DEFAULT_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEFAULT_COMPILE_LEVEL
+#endif
+
+/* Only the file name, the module name for runtime overrides */
+#ifdef __FILE_NAME__
+#define LOG_FILE __FILE_NAME__
+#else
+#define LOG_FILE __FILE__
+#endif
+
+#define LOG_AT(level, ...) do { \
+    if (LOG_COMPILE_LEVEL <= LOG_LEVEL_ ## level) { \
+      log_log(LOG_ ## level, LOG_FILE, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#define log_trace(...) LOG_AT(TRACE, __VA_ARGS__)
+#define log_debug(...) LOG_AT(DEBUG, __VA_ARGS__)
+#define log_info(...)  LOG_AT(INFO,  __VA_ARGS__)
+#define log_warn(...)  LOG_AT(WARN,  __VA_ARGS__)
+#define log_error(...) LOG_AT(ERROR, __VA_ARGS__)
+#define log_fatal(...) LOG_AT(FATAL, __VA_ARGS__)
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
 void log_set_level(int level);
 void log_set_quiet(bool enable);
+/* Runtime level of one module, i.e. source file name such as "network.c",
+ * replacing the global level for it. Levels compiled out stay out. The name
+ * is kept by pointer. */
+int log_set_module_level(const char *module, int level);
+void log_clear_module_level(const char *module);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
+/* With LOG_DEFERRED, log_log only records the event and this formats and
+ * outputs everything recorded so far. Call from thread context only. */
+void log_drain(void);
 
 #endif
@@ -0,0 +1,91 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+struct arena_block {
+    uint32_t size; // Including this header
+    uint32_t free;
+};
+
+#define ALIGN_DOWN(x) ((x) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ALIGN_UP(x) ALIGN_DOWN((x) + ARENA_ALIGNMENT - 1)
+
+static struct arena_block *next_block(struct arena_block *block) {
+    return (struct arena_block *)((unsigned char *)block + block->size);
+}
+
+static struct arena_block *end_block(const struct arena *arena) {
+    return (struct arena_block *)(arena->base + arena->size);
+}
+
+// Absorb all free blocks directly following this free block
+static void coalesce(struct arena *arena, struct arena_block *block) {
+    struct arena_block *end = end_block(arena);
+    for (struct arena_block *next = next_block(block); next < end && next->free;
+         next = next_block(block))
+        block->size += next->size;
+}
+
+void arena_init(struct arena *arena, void *buffer, size_t size) {
+    uintptr_t start = ALIGN_UP((uintptr_t)buffer);
+    arena->base = (unsigned char *)start;
+    arena->size = ALIGN_DOWN(size - (start - (uintptr_t)buffer));
+    arena->peak = 0;
+    arena->failures = 0;
+    arena_reset(arena);
+}
+
+void arena_reset(struct arena *arena) {
+    struct arena_block *block = (struct arena_block *)arena->base;
+    block->size = arena->size;
+    block->free = 1;
+    arena->used = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size_t needed = sizeof(struct arena_block) + ALIGN_UP(size);
+    struct arena_block *end = end_block(arena);
+    for (struct arena_block *block = (struct arena_block *)arena->base;
+         block < end; block = next_block(block)) {
+        if (!block->free)
+            continue;
+        coalesce(arena, block);
+        if (block->size < needed)
+            continue;
+
+        // Split off the rest if it can hold at least a minimal block
+        if (block->size - needed >= 2 * sizeof(struct arena_block)) {
+            struct arena_block *rest =
+                (struct arena_block *)((unsigned char *)block + needed);
+            rest->size = block->size - needed;
+            rest->free = 1;
+            block->size = needed;
+        }
+        block->free = 0;
+        arena->used += block->size;
+        if (arena->used > arena->peak)
+            arena->peak = arena->used;
+        return block + 1;
+    }
+    ++arena->failures;
+    return NULL;
+}
+
+void arena_free(struct arena *arena, void *ptr) {
+    struct arena_block *block = (struct arena_block *)ptr - 1;
+    assert(arena_contains(arena, ptr) && !block->free);
+    block->free = 1;
+    arena->used -= block->size;
+    coalesce(arena, block);
+}
+
+size_t arena_block_size(const void *ptr) {
+    const struct arena_block *block = (const struct arena_block *)ptr - 1;
+    return block->size - sizeof(*block);
+}
+
+bool arena_contains(const struct arena *arena, const void *ptr) {
+    const unsigned char *p = ptr;
+    return p >= arena->base && p < arena->base + arena->size;
+}
@@ -0,0 +1,257 @@
+#include "pico/stdlib.h"
+
+#include "DEV_Config.h"
+#include "LCD_Driver.h"
+#include "ff.h"
+
+#include "assets.h"
+#include "log.h"
+#include "storage.h"
+
+#include <string.h>
+
+// Room in front of the data read for the tail of a packet split by the
+// previous read, so that reads stay sector aligned
+#define RLE_CARRY_SIZE 4
+
+extern LCD_DIS sLCD_DIS;
+
+struct assets_state {
+    FIL file; // Kept open, fetching an asset is only a seek and a read
+    struct asset index[ASSETS_MAX];
+    uint16_t count;
+    bool loaded;
+    uint8_t chunk[RLE_CARRY_SIZE + ASSETS_CHUNK_SIZE];
+    uint8_t rows[2][ASSETS_ROW_BUFFER_SIZE];
+};
+static struct assets_state state;
+
+bool assets_init(void) {
+    if (!storage_mount())
+        return false;
+
+    FRESULT result = f_open(&state.file, ASSETS_FILE_NAME, FA_READ);
+    if (result != FR_OK) {
+        log_warn("No asset pack %s: %d", ASSETS_FILE_NAME, result);
+        return false;
+    }
+
+    struct assets_header header;
+    UINT read;
+    result = f_read(&state.file, &header, sizeof(header), &read);
+    if (result != FR_OK || read != sizeof(header) ||
+        memcmp(header.magic, ASSETS_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ASSETS_VERSION || header.count > ASSETS_MAX) {
+        log_error("Invalid asset pack header");
+        f_close(&state.file);
+        return false;
+    }
+
+    // The entries are used as they lie in the file
+    UINT index_size = header.count * sizeof(struct asset);
+    result = f_read(&state.file, state.index, index_size, &read);
+    if (result != FR_OK || read != index_size) {
+        log_error("Failed to read the asset index: %d", result);
+        f_close(&state.file);
+        return false;
+    }
+    for (unsigned i = 0; i < header.count; ++i) {
+        struct asset *asset = &state.index[i];
+        asset->name[ASSETS_NAME_LENGTH - 1] = '\0';
+        bool valid = asset->format == ASSET_RLE ||
+                     (asset->format == ASSET_RGB565 &&
+                      asset->size == 2u * asset->width * asset->height);
+        if (!valid) {
+            log_error("Invalid asset %s", asset->name);
+            f_close(&state.file);
+            return false;
+        }
+    }
+
+    state.count = header.count;
+    state.loaded = true;
+    log_info("Loaded %u assets", state.count);
+    return true;
+}
+
+const struct asset *assets_find(const char *name) {
+    for (unsigned i = 0; i < state.count; ++i) {
+        if (strcmp(state.index[i].name, name) == 0)
+            return &state.index[i];
+    }
+    return NULL;
+}
+
+static bool read_data(void *buffer, uint32_t size) {
+    UINT read;
+    FRESULT result = f_read(&state.file, buffer, size, &read);
+    if (result != FR_OK || read != size) {
+        log_error("Failed to read asset data: %d", result);
+        return false;
+    }
+    return true;
+}
+
+static bool seek(const struct asset *asset) {
+    FRESULT result = f_lseek(&state.file, asset->offset);
+    if (result != FR_OK) {
+        log_error("Failed to seek to asset %s: %d", asset->name, result);
+        return false;
+    }
+    return true;
+}
+
+bool assets_read(const struct asset *asset, void *buffer, size_t size) {
+    assert(state.loaded);
+    if (size < asset->size) {
+        log_error("Buffer too small for asset %s", asset->name);
+        return false;
+    }
+    return seek(asset) && read_data(buffer, asset->size);
+}
+
+static bool draw_raw(const struct asset *asset) {
+    uint8_t *data = state.chunk + RLE_CARRY_SIZE;
+    for (uint32_t left = asset->size; left > 0;) {
+        uint32_t size = MIN(left, ASSETS_CHUNK_SIZE);
+        // The card is on the same bus as the LCD
+        LCD_WaitData_DMA();
+        if (!read_data(data, size))
+            return false;
+        LCD_WriteData_DMA(data, size);
+        left -= size;
+    }
+    return true;
+}
+
+struct rle_output {
+    uint8_t *row;
+    uint32_t fill;
+    uint32_t pixels_left;
+    bool to_lcd; // Otherwise row is the whole destination
+    uint8_t current;
+};
+
+// Push the filled row buffer and continue in the other one, so the next
+// pixels are decoded while it goes out
+static void flush(struct rle_output *out) {
+    LCD_WaitData_DMA();
+    LCD_WriteData_DMA(out->row, out->fill);
+    out->current ^= 1;
+    out->row = state.rows[out->current];
+    out->fill = 0;
+}
+
+static void emit(struct rle_output *out, const uint8_t *pixel,
+                 uint32_t count) {
+    count = MIN(count, out->pixels_left);
+    out->pixels_left -= count;
+    while (count-- > 0) {
+        out->row[out->fill++] = pixel[0];
+        out->row[out->fill++] = pixel[1];
+        if (out->to_lcd && out->fill == ASSETS_ROW_BUFFER_SIZE)
+            flush(out);
+    }
+}
+
+static bool decode_rle(const struct asset *asset, struct rle_output *out) {
+    uint8_t *data = state.chunk + RLE_CARRY_SIZE;
+    uint32_t carry = 0;
+    unsigned literals = 0; // Still to come in the current literal packet
+
+    for (uint32_t left = asset->size; left > 0;) {
+        uint32_t size = MIN(left, ASSETS_CHUNK_SIZE);
+        LCD_WaitData_DMA();
+        if (!read_data(data, size))
+            return false;
+        left -= size;
+
+        const uint8_t *p = data - carry;
+        const uint8_t *end = data + size;
+        while (p < end) {
+            if (literals > 0) {
+                if (end - p < 2)
+                    break;
+                emit(out, p, 1);
+                p += 2;
+                --literals;
+            } else if (*p < 0x80) {
+                literals = *p + 1;
+                p += 1;
+            } else {
+                if (end - p < 3)
+                    break;
+                emit(out, p + 1, *p - 0x7e);
+                p += 3;
+            }
+        }
+        carry = end - p;
+        memmove(data - carry, p, carry);
+    }
+    if (out->to_lcd && out->fill > 0)
+        flush(out);
+
+    if (carry > 0 || out->pixels_left > 0) {
+        log_error("Corrupted asset %s", asset->name);
+        return false;
+    }
+    return true;
+}
+
+bool assets_decode(const struct asset *asset, void *pixels, size_t size) {
+    assert(state.loaded);
+    if (size < 2u * asset->width * asset->height) {
+        log_error("Buffer too small for asset %s", asset->name);
+        return false;
+    }
+    if (asset->format == ASSET_RGB565)
+        return assets_read(asset, pixels, size);
+
+    struct rle_output out = {
+        .row = pixels,
+        .pixels_left = (uint32_t)asset->width * asset->height,
+    };
+    return seek(asset) && decode_rle(asset, &out);
+}
+
+bool assets_draw(const struct asset *asset, uint16_t x, uint16_t y) {
+    assert(state.loaded);
+    if (x + asset->width > sLCD_DIS.LCD_Dis_Column ||
+        y + asset->height > sLCD_DIS.LCD_Dis_Page) {
+        log_error("Asset %s at %u,%u does not fit the screen", asset->name, x,
+                  y);
+        return false;
+    }
+    if (!seek(asset))
+        return false;
+
+    uint saved_baudrate = spi_get_baudrate(SPI_PORT);
+    spi_set_baudrate(SPI_PORT, LCD_SPI_BAUD_BLIT);
+    LCD_SetWindow(x, y, x + asset->width, y + asset->height);
+    bool drawn;
+    if (asset->format == ASSET_RLE) {
+        struct rle_output out = {
+            .row = state.rows[0],
+            .pixels_left = (uint32_t)asset->width * asset->height,
+            .to_lcd = true,
+        };
+        drawn = decode_rle(asset, &out);
+    } else {
+        drawn = draw_raw(asset);
+    }
+    LCD_WaitData_DMA();
+    spi_set_baudrate(SPI_PORT, saved_baudrate);
+    return drawn;
+}
+
+void assets_blit(uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+                 const void *pixels) {
+    assert(x + width <= sLCD_DIS.LCD_Dis_Column &&
+           y + height <= sLCD_DIS.LCD_Dis_Page);
+    uint saved_baudrate = spi_get_baudrate(SPI_PORT);
+    spi_set_baudrate(SPI_PORT, LCD_SPI_BAUD_BLIT);
+    LCD_SetWindow(x, y, x + width, y + height);
+    LCD_WriteData_DMA(pixels, 2u * width * height);
+    LCD_WaitData_DMA();
+    spi_set_baudrate(SPI_PORT, saved_baudrate);
+}
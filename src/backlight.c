@@ -0,0 +1,214 @@
+#include "hardware/adc.h"
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+#include "DEV_Config.h"
+#include "LCD_Driver.h"
+
+#include "backlight.h"
+#include "log.h"
+#include "timebase.h"
+#include "weather.h"
+
+#include <stdlib.h>
+
+struct backlight_state {
+    critical_section_t cs;
+    uint16_t level; // Applied to the PWM
+    // Fade in perceived brightness, from and to are square roots of levels
+    uint16_t from;
+    uint16_t to;
+    uint64_t fade_start_us;
+    uint64_t fade_end_us;
+    bool fading; // The step alarm is pending
+    uint16_t target; // Level the fade ends at
+    uint16_t ambient;
+    uint16_t scale; // Permille of the ambient level
+    uint32_t sensor; // Smoothed reading times 2^BACKLIGHT_SENSOR_SMOOTHING
+    // Integral of the level, for the average
+    uint64_t start_us;
+    uint64_t changed_us;
+    uint64_t level_us;
+};
+static struct backlight_state state;
+
+static uint16_t perceived(uint16_t level) {
+    // Integer square root of level * BACKLIGHT_MAX
+    uint32_t value = (uint32_t)level * BACKLIGHT_MAX;
+    uint32_t root = 0;
+    for (uint32_t bit = 1u << 20; bit > 0; bit >>= 2) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+static uint16_t actual(uint16_t perceived) {
+    return (uint32_t)perceived * perceived / BACKLIGHT_MAX;
+}
+
+// Between the levels by a permille of perceived brightness
+static uint16_t mix(uint16_t low, uint16_t high, int32_t permille) {
+    if (permille <= 0)
+        return low;
+    if (permille >= 1000)
+        return high;
+    int32_t from = perceived(low);
+    return actual(from + (perceived(high) - from) * permille / 1000);
+}
+
+// With the lock held
+static void apply(uint16_t level, uint64_t now) {
+    state.level_us += (now - state.changed_us) * state.level;
+    state.changed_us = now;
+    if (level != state.level) {
+        state.level = level;
+        LCD_SetBackLight(level);
+    }
+}
+
+static int64_t fade_step(alarm_id_t id, void *user_data) {
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    bool done = now >= state.fade_end_us;
+    // The square root is rounded, the last step lands on the exact target
+    uint16_t level = state.target;
+    if (!done) {
+        int64_t elapsed = now - state.fade_start_us;
+        int64_t duration = state.fade_end_us - state.fade_start_us;
+        level = actual(state.from +
+                       ((int32_t)state.to - state.from) * elapsed / duration);
+    }
+    apply(level, now);
+    state.fading = !done;
+    critical_section_exit(&state.cs);
+    return done ? 0 : BACKLIGHT_FADE_STEP_MS * 1000;
+}
+
+void backlight_fade(uint16_t level, uint32_t fade_ms) {
+    level = MIN(level, BACKLIGHT_MAX);
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    state.target = level;
+    state.from = perceived(state.level);
+    state.to = perceived(level);
+    state.fade_start_us = now;
+    state.fade_end_us = now + fade_ms * 1000ull;
+    if (fade_ms == 0)
+        apply(level, now);
+    // A pending step picks the new fade up
+    bool start = fade_ms > 0 && !state.fading;
+    state.fading |= start;
+    critical_section_exit(&state.cs);
+
+    // Outside the lock, the alarm pool takes its own
+    if (start && add_alarm_in_ms(BACKLIGHT_FADE_STEP_MS, fade_step, NULL,
+                                 true) < 0) {
+        critical_section_enter_blocking(&state.cs);
+        state.fading = false;
+        apply(level, timebase_now_us());
+        critical_section_exit(&state.cs);
+    }
+}
+
+#if BACKLIGHT_SENSOR_ADC >= 0
+static void sensor_init(void) {
+    adc_init();
+    adc_gpio_init(26 + BACKLIGHT_SENSOR_ADC);
+    adc_select_input(BACKLIGHT_SENSOR_ADC);
+    state.sensor = (uint32_t)adc_read() << BACKLIGHT_SENSOR_SMOOTHING;
+}
+
+static uint16_t sensed(void) {
+    // Exponential moving average, a passing shadow does not flicker
+    adc_select_input(BACKLIGHT_SENSOR_ADC);
+    state.sensor +=
+        adc_read() - (int32_t)(state.sensor >> BACKLIGHT_SENSOR_SMOOTHING);
+    int32_t reading = state.sensor >> BACKLIGHT_SENSOR_SMOOTHING;
+    return mix(BACKLIGHT_NIGHT, BACKLIGHT_MAX,
+               (reading - BACKLIGHT_SENSOR_DARK) * 1000 /
+                   (BACKLIGHT_SENSOR_BRIGHT - BACKLIGHT_SENSOR_DARK));
+}
+#else
+// Permille of daylight, rising and falling through the twilight, outside of
+// 0 to 1000 before and after
+static int32_t day_permille(int64_t utc, int64_t sunrise, int64_t sunset) {
+    int64_t half = BACKLIGHT_TWILIGHT_S / 2;
+    int64_t rise = (utc - sunrise + half) * 1000 / BACKLIGHT_TWILIGHT_S;
+    int64_t fall = (sunset - utc + half) * 1000 / BACKLIGHT_TWILIGHT_S;
+    return MIN(rise, fall);
+}
+
+static uint16_t scheduled(void) {
+    struct timebase_local local;
+    timebase_local(&local);
+    int64_t sunrise, sunset;
+    int32_t day;
+    if (weather_daylight(&sunrise, &sunset)) {
+        day = day_permille(local.utc, sunrise, sunset);
+    } else {
+        int hour = local.tm.tm_hour;
+        day = hour >= BACKLIGHT_DAY_START_HOUR && hour < BACKLIGHT_DAY_END_HOUR
+                  ? 1000
+                  : 0;
+    }
+    return mix(BACKLIGHT_NIGHT, BACKLIGHT_DAY, day);
+}
+#endif
+
+void backlight_init(void) {
+    critical_section_init(&state.cs);
+    uint64_t now = timebase_now_us();
+    state.start_us = now;
+    state.changed_us = now;
+    state.level = 0; // LCD_Init leaves it off
+    state.ambient = BACKLIGHT_DAY;
+    state.scale = 1000;
+#if BACKLIGHT_SENSOR_ADC >= 0
+    sensor_init();
+#endif
+    backlight_fade(BACKLIGHT_DAY, BACKLIGHT_FADE_MS);
+}
+
+void backlight_set_scale(uint16_t scale) {
+    critical_section_enter_blocking(&state.cs);
+    state.scale = scale;
+    uint16_t level = (uint32_t)state.ambient * scale / 1000;
+    critical_section_exit(&state.cs);
+    backlight_fade(level, BACKLIGHT_FADE_MS);
+}
+
+void backlight_tick(uint16_t scale) {
+#if BACKLIGHT_SENSOR_ADC >= 0
+    uint16_t ambient = sensed();
+#else
+    uint16_t ambient = scheduled();
+#endif
+    critical_section_enter_blocking(&state.cs);
+    bool dimmed = scale != state.scale;
+    state.scale = scale;
+    state.ambient = ambient;
+    uint16_t level = (uint32_t)ambient * scale / 1000;
+    bool changed = abs((int)level - state.target) > BACKLIGHT_HYSTERESIS ||
+                   (level == 0) != (state.target == 0);
+    critical_section_exit(&state.cs);
+    if (dimmed || changed)
+        backlight_fade(level, dimmed ? BACKLIGHT_FADE_MS
+                                     : BACKLIGHT_AMBIENT_FADE_MS);
+}
+
+uint16_t backlight_level(void) { return state.level; }
+
+uint16_t backlight_average(void) {
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    apply(state.level, now);
+    uint64_t elapsed = now - state.start_us;
+    uint16_t average = elapsed == 0 ? state.level : state.level_us / elapsed;
+    critical_section_exit(&state.cs);
+    return average;
+}
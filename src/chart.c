@@ -0,0 +1,83 @@
+#include "pico/stdlib.h"
+
+#include "LCD_GUI.h"
+
+#include "chart.h"
+
+#include <string.h>
+
+static uint16_t clamp(int32_t value, int32_t low, int32_t high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+// Row of a value, counted from the top of the chart
+static uint16_t row(int32_t value, int32_t low, int32_t high, int32_t rows) {
+    return clamp(rows - (value - low) * rows / (high - low), 0, rows);
+}
+
+static struct chart_span span(const struct chart *chart, const int16_t *values,
+                              unsigned count, unsigned i, int32_t low,
+                              int32_t high) {
+    struct chart_span result = {0, 0};
+    if (i >= count || values[i] == CHART_MISSING)
+        return result;
+
+    if (chart->style == CHART_BARS) {
+        result.top = row(values[i], low, high, chart->height);
+        result.bottom = chart->height;
+        return result;
+    }
+    // Down to the next value, so the columns join into a line
+    int32_t rows = chart->height - CHART_LINE_WIDTH;
+    uint16_t from = row(values[i], low, high, rows);
+    uint16_t to = from;
+    if (i + 1 < count && values[i + 1] != CHART_MISSING)
+        to = row(values[i + 1], low, high, rows);
+    result.top = MIN(from, to);
+    result.bottom = MAX(from, to) + CHART_LINE_WIDTH;
+    return result;
+}
+
+static void fill(const struct chart *chart, unsigned column, uint16_t top,
+                 uint16_t bottom, COLOR color) {
+    if (top >= bottom)
+        return;
+    uint16_t x = chart->x + column * chart->column_width;
+    uint16_t width = chart->column_width - (chart->style == CHART_BARS);
+    GUI_DrawRectangle(x, chart->y + top, x + width, chart->y + bottom, color,
+                      DRAW_FULL, DOT_PIXEL_DFT);
+}
+
+// Only the rows in one of the spans but not in the other change
+static void update(struct chart *chart, unsigned column,
+                   struct chart_span next) {
+    struct chart_span *drawn = &chart->drawn[column];
+    if (drawn->top == next.top && drawn->bottom == next.bottom)
+        return;
+    if (drawn->top == drawn->bottom || next.top == next.bottom) {
+        fill(chart, column, drawn->top, drawn->bottom, chart->background);
+        fill(chart, column, next.top, next.bottom, chart->color);
+    } else {
+        fill(chart, column, drawn->top, MIN(drawn->bottom, next.top),
+             chart->background);
+        fill(chart, column, MAX(drawn->top, next.bottom), drawn->bottom,
+             chart->background);
+        fill(chart, column, next.top, MIN(next.bottom, drawn->top),
+             chart->color);
+        fill(chart, column, MAX(next.top, drawn->bottom), next.bottom,
+             chart->color);
+    }
+    *drawn = next;
+}
+
+void chart_draw(struct chart *chart, const int16_t *values, unsigned count,
+                int32_t low, int32_t high) {
+    if (high <= low)
+        high = low + 1;
+    for (unsigned i = 0; i < CHART_MAX_COLUMNS; ++i)
+        update(chart, i, span(chart, values, count, i, low, high));
+}
+
+void chart_invalidate(struct chart *chart) {
+    memset(chart->drawn, 0, sizeof(chart->drawn));
+}
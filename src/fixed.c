@@ -0,0 +1,79 @@
+#include "fixed.h"
+
+#include <assert.h>
+
+// Only 32-bit arithmetic, 64-bit multiplication is a library call on the M0+
+static bool append_digit(uint32_t *value, unsigned digit) {
+    if (*value > (INT32_MAX - digit) / 10)
+        return false;
+    *value = *value * 10 + digit;
+    return true;
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool fixed_parse(const char *text, size_t length, unsigned decimals,
+                 int32_t *value) {
+    const char *p = text;
+    const char *end = text + length;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+
+    uint32_t result = 0;
+    bool digits = false;
+    for (; p < end && is_digit(*p); ++p, digits = true) {
+        if (!append_digit(&result, *p - '0'))
+            return false;
+    }
+    bool round_up = false; // By the first digit that does not fit
+    if (p < end && *p == '.') {
+        bool dropped = false;
+        for (++p; p < end && is_digit(*p); ++p, digits = true) {
+            if (decimals > 0) {
+                if (!append_digit(&result, *p - '0'))
+                    return false;
+                --decimals;
+            } else if (!dropped) {
+                round_up = *p >= '5';
+                dropped = true;
+            }
+        }
+    }
+    if (!digits || p != end)
+        return false;
+    for (; decimals > 0; --decimals) {
+        if (!append_digit(&result, 0))
+            return false;
+    }
+    if (round_up) {
+        if (result == INT32_MAX)
+            return false;
+        ++result;
+    }
+
+    *value = negative ? -(int32_t)result : (int32_t)result;
+    return true;
+}
+
+size_t fixed_format(char *buffer, int32_t value, unsigned decimals) {
+    assert(decimals <= FIXED_MAX_DECIMALS);
+    char digits[10]; // Reversed
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    unsigned count = 0;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0 || count <= decimals);
+
+    char *p = buffer;
+    if (value < 0)
+        *p++ = '-';
+    while (count > 0) {
+        *p++ = digits[--count];
+        if (count == decimals && decimals > 0)
+            *p++ = '.';
+    }
+    *p = '\0';
+    return p - buffer;
+}
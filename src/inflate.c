@@ -0,0 +1,505 @@
+#include "inflate.h"
+
+#include <assert.h>
+#include <string.h>
+
+enum {
+    STATE_ZLIB_HEADER,
+    STATE_GZIP_HEADER,
+    STATE_GZIP_EXTRA_LEN,
+    STATE_GZIP_SKIP,
+    STATE_GZIP_NAME,
+    STATE_GZIP_COMMENT,
+    STATE_GZIP_HCRC,
+    STATE_BLOCK_HEADER,
+    STATE_STORED_HEADER,
+    STATE_STORED_COPY,
+    STATE_DYNAMIC_COUNTS,
+    STATE_DYNAMIC_CODE_LENGTHS,
+    STATE_DYNAMIC_LENGTHS,
+    STATE_CODES,
+    STATE_TRAILER,
+    STATE_DONE,
+};
+
+// Result of a single decoding step
+enum step_result { STEP_OK, STEP_NEED_INPUT, STEP_DONE, STEP_ERROR,
+                   STEP_OVERFLOW };
+
+#define GZIP_FLAG_HCRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+static const uint16_t length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+    33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which the code length code lengths are stored
+static const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Next input byte, -1 if the input is exhausted
+static int next_byte(struct inflate_state *state) {
+    if (state->stash_pos < state->stash_len)
+        return state->stash[state->stash_pos++];
+    if (state->in_pos < state->in_len)
+        return state->in[state->in_pos++];
+    return -1;
+}
+
+// Read n <= 16 bits LSB first, -1 if the input is exhausted
+static int get_bits(struct inflate_state *state, unsigned n) {
+    while (state->bitcnt < n) {
+        int byte = next_byte(state);
+        if (byte < 0)
+            return -1;
+        state->bitbuf |= (uint32_t)byte << state->bitcnt;
+        state->bitcnt += 8;
+    }
+    int value = state->bitbuf & ((1u << n) - 1);
+    state->bitbuf >>= n;
+    state->bitcnt -= n;
+    return value;
+}
+
+// Drop the bits up to the next byte boundary
+static void align_to_byte(struct inflate_state *state) {
+    state->bitbuf >>= state->bitcnt & 7;
+    state->bitcnt &= ~7u;
+}
+
+// Build canonical Huffman decoding table, lengths of 0 mean unused symbols
+static bool build_huffman(struct inflate_huffman *huffman,
+                          const uint8_t *lengths, unsigned num) {
+    uint16_t offsets[16];
+    memset(huffman->counts, 0, sizeof(huffman->counts));
+    for (unsigned i = 0; i < num; ++i)
+        huffman->counts[lengths[i]]++;
+    huffman->counts[0] = 0;
+
+    // Reject over-subscribed codes, incomplete ones are valid (e.g. a single
+    // distance code)
+    int left = 1;
+    for (unsigned len = 1; len < 16; ++len) {
+        left <<= 1;
+        left -= huffman->counts[len];
+        if (left < 0)
+            return false;
+    }
+
+    unsigned sum = 0;
+    for (unsigned len = 0; len < 16; ++len) {
+        offsets[len] = sum;
+        sum += huffman->counts[len];
+    }
+    for (unsigned i = 0; i < num; ++i)
+        if (lengths[i] != 0)
+            huffman->symbols[offsets[lengths[i]]++] = i;
+    return true;
+}
+
+// Decode one symbol bit by bit, -1 if the input is exhausted, -2 if the code
+// is invalid
+static int decode_symbol(struct inflate_state *state,
+                         const struct inflate_huffman *huffman) {
+    int base = 0, offset = 0;
+    for (unsigned len = 1; len < 16; ++len) {
+        int bit = get_bits(state, 1);
+        if (bit < 0)
+            return -1;
+        offset = 2 * offset + bit;
+        if (offset < huffman->counts[len])
+            return huffman->symbols[base + offset];
+        base += huffman->counts[len];
+        offset -= huffman->counts[len];
+    }
+    return -2;
+}
+
+static void build_fixed_huffman(struct inflate_state *state) {
+    unsigned i = 0;
+    for (; i < 144; ++i)
+        state->lengths[i] = 8;
+    for (; i < 256; ++i)
+        state->lengths[i] = 9;
+    for (; i < 280; ++i)
+        state->lengths[i] = 7;
+    for (; i < 288; ++i)
+        state->lengths[i] = 8;
+    build_huffman(&state->litlen, state->lengths, 288);
+    for (i = 0; i < 30; ++i)
+        state->lengths[i] = 5;
+    build_huffman(&state->dist, state->lengths, 30);
+}
+
+static enum step_result put_byte(struct inflate_state *state, uint8_t byte) {
+    if (state->out_len >= state->out_size)
+        return STEP_OVERFLOW;
+    state->out[state->out_len++] = byte;
+    return STEP_OK;
+}
+
+// Decode one literal or one length/distance pair. All bits are read before
+// any output is written, so the step can be repeated when input runs out.
+static enum step_result step_codes(struct inflate_state *state) {
+    int symbol = decode_symbol(state, &state->litlen);
+    if (symbol == -1)
+        return STEP_NEED_INPUT;
+    if (symbol < 0)
+        return STEP_ERROR;
+    if (symbol < 256)
+        return put_byte(state, symbol);
+    if (symbol == 256) {
+        state->state = state->final_block ? STATE_TRAILER : STATE_BLOCK_HEADER;
+        return STEP_OK;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29)
+        return STEP_ERROR;
+    int extra = get_bits(state, length_extra[symbol]);
+    if (extra < 0)
+        return STEP_NEED_INPUT;
+    size_t length = length_base[symbol] + extra;
+
+    symbol = decode_symbol(state, &state->dist);
+    if (symbol == -1)
+        return STEP_NEED_INPUT;
+    if (symbol < 0 || symbol >= 30)
+        return STEP_ERROR;
+    extra = get_bits(state, dist_extra[symbol]);
+    if (extra < 0)
+        return STEP_NEED_INPUT;
+    size_t dist = dist_base[symbol] + extra;
+
+    if (dist > state->out_len)
+        return STEP_ERROR; // Reaches before the start of the output
+    if (state->out_len + length > state->out_size)
+        return STEP_OVERFLOW;
+    // Byte by byte, the source may overlap with the destination
+    uint8_t *dst = state->out + state->out_len;
+    const uint8_t *src = dst - dist;
+    for (size_t i = 0; i < length; ++i)
+        dst[i] = src[i];
+    state->out_len += length;
+    return STEP_OK;
+}
+
+// Decode one code length symbol of a dynamic block header, including its
+// repeat count
+static enum step_result step_dynamic_lengths(struct inflate_state *state) {
+    unsigned total = state->hlit + state->hdist;
+    int symbol = decode_symbol(state, &state->litlen);
+    if (symbol == -1)
+        return STEP_NEED_INPUT;
+    if (symbol < 0)
+        return STEP_ERROR;
+
+    uint8_t value = 0;
+    int repeat;
+    if (symbol < 16) {
+        value = symbol;
+        repeat = 1;
+    } else if (symbol == 16) {
+        if (state->lengths_index == 0)
+            return STEP_ERROR; // Nothing to repeat
+        value = state->lengths[state->lengths_index - 1];
+        repeat = get_bits(state, 2);
+        if (repeat < 0)
+            return STEP_NEED_INPUT;
+        repeat += 3;
+    } else if (symbol == 17) {
+        repeat = get_bits(state, 3);
+        if (repeat < 0)
+            return STEP_NEED_INPUT;
+        repeat += 3;
+    } else {
+        repeat = get_bits(state, 7);
+        if (repeat < 0)
+            return STEP_NEED_INPUT;
+        repeat += 11;
+    }
+    if (state->lengths_index + repeat > total)
+        return STEP_ERROR;
+    memset(state->lengths + state->lengths_index, value, repeat);
+    state->lengths_index += repeat;
+
+    if (state->lengths_index == total) {
+        if (state->lengths[256] == 0)
+            return STEP_ERROR; // No end of block code
+        if (!build_huffman(&state->litlen, state->lengths, state->hlit) ||
+            !build_huffman(&state->dist, state->lengths + state->hlit,
+                           state->hdist))
+            return STEP_ERROR;
+        state->state = STATE_CODES;
+    }
+    return STEP_OK;
+}
+
+// Read n whole bytes as a little endian number into *value
+static bool get_bytes_le(struct inflate_state *state, unsigned n,
+                         uint32_t *value) {
+    *value = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        int byte = get_bits(state, 8);
+        if (byte < 0)
+            return false;
+        *value |= (uint32_t)byte << (8 * i);
+    }
+    return true;
+}
+
+// After the gzip header fields, move to the next optional one
+static void next_gzip_field(struct inflate_state *state) {
+    unsigned flags = state->gzip_flags;
+    if (flags & GZIP_FLAG_EXTRA) {
+        state->gzip_flags &= ~GZIP_FLAG_EXTRA;
+        state->state = STATE_GZIP_EXTRA_LEN;
+    } else if (flags & GZIP_FLAG_NAME) {
+        state->gzip_flags &= ~GZIP_FLAG_NAME;
+        state->state = STATE_GZIP_NAME;
+    } else if (flags & GZIP_FLAG_COMMENT) {
+        state->gzip_flags &= ~GZIP_FLAG_COMMENT;
+        state->state = STATE_GZIP_COMMENT;
+    } else if (flags & GZIP_FLAG_HCRC) {
+        state->gzip_flags &= ~GZIP_FLAG_HCRC;
+        state->state = STATE_GZIP_HCRC;
+    } else {
+        state->state = STATE_BLOCK_HEADER;
+    }
+}
+
+static enum step_result step(struct inflate_state *state) {
+    uint32_t value;
+    int bits;
+
+    switch (state->state) {
+    case STATE_ZLIB_HEADER:
+        if (!get_bytes_le(state, 2, &value))
+            return STEP_NEED_INPUT;
+        // CMF is the first byte, so the check value is byte swapped here
+        if ((value & 0x0f) != 8 || (value & 0x2000) ||
+            (((value & 0xff) << 8) | (value >> 8)) % 31 != 0)
+            return STEP_ERROR; // Not deflate, or a preset dictionary
+        state->state = STATE_BLOCK_HEADER;
+        return STEP_OK;
+
+    case STATE_GZIP_HEADER:
+        // ID1 ID2 CM FLG MTIME(4) XFL OS
+        if (!get_bytes_le(state, 4, &value))
+            return STEP_NEED_INPUT;
+        if ((value & 0xffffff) != 0x088b1f)
+            return STEP_ERROR;
+        state->gzip_flags = value >> 24;
+        if (!get_bytes_le(state, 4, &value) || !get_bytes_le(state, 2, &value))
+            return STEP_NEED_INPUT;
+        next_gzip_field(state);
+        return STEP_OK;
+
+    case STATE_GZIP_EXTRA_LEN:
+        if (!get_bytes_le(state, 2, &value))
+            return STEP_NEED_INPUT;
+        state->skip_left = value;
+        state->state = STATE_GZIP_SKIP;
+        return STEP_OK;
+
+    case STATE_GZIP_SKIP:
+        if (state->skip_left == 0) {
+            next_gzip_field(state);
+            return STEP_OK;
+        }
+        if (get_bits(state, 8) < 0)
+            return STEP_NEED_INPUT;
+        --state->skip_left;
+        return STEP_OK;
+
+    case STATE_GZIP_NAME:
+    case STATE_GZIP_COMMENT:
+        // Zero terminated strings
+        bits = get_bits(state, 8);
+        if (bits < 0)
+            return STEP_NEED_INPUT;
+        if (bits == 0)
+            next_gzip_field(state);
+        return STEP_OK;
+
+    case STATE_GZIP_HCRC:
+        if (!get_bytes_le(state, 2, &value))
+            return STEP_NEED_INPUT;
+        next_gzip_field(state);
+        return STEP_OK;
+
+    case STATE_BLOCK_HEADER:
+        bits = get_bits(state, 3);
+        if (bits < 0)
+            return STEP_NEED_INPUT;
+        state->final_block = bits & 1;
+        switch (bits >> 1) {
+        case 0:
+            state->state = STATE_STORED_HEADER;
+            return STEP_OK;
+        case 1:
+            build_fixed_huffman(state);
+            state->state = STATE_CODES;
+            return STEP_OK;
+        case 2:
+            state->state = STATE_DYNAMIC_COUNTS;
+            return STEP_OK;
+        default:
+            return STEP_ERROR;
+        }
+
+    case STATE_STORED_HEADER:
+        align_to_byte(state);
+        if (!get_bytes_le(state, 4, &value))
+            return STEP_NEED_INPUT;
+        if ((value & 0xffff) != (~value >> 16))
+            return STEP_ERROR;
+        state->stored_left = value & 0xffff;
+        state->state = STATE_STORED_COPY;
+        return STEP_OK;
+
+    case STATE_STORED_COPY:
+        if (state->stored_left == 0) {
+            state->state =
+                state->final_block ? STATE_TRAILER : STATE_BLOCK_HEADER;
+            return STEP_OK;
+        }
+        bits = get_bits(state, 8);
+        if (bits < 0)
+            return STEP_NEED_INPUT;
+        --state->stored_left;
+        return put_byte(state, bits);
+
+    case STATE_DYNAMIC_COUNTS:
+        bits = get_bits(state, 14);
+        if (bits < 0)
+            return STEP_NEED_INPUT;
+        state->hlit = (bits & 0x1f) + 257;
+        state->hdist = ((bits >> 5) & 0x1f) + 1;
+        state->hclen = (bits >> 10) + 4;
+        if (state->hlit > 286 || state->hdist > 30)
+            return STEP_ERROR;
+        state->lengths_index = 0;
+        memset(state->lengths, 0, 19);
+        state->state = STATE_DYNAMIC_CODE_LENGTHS;
+        return STEP_OK;
+
+    case STATE_DYNAMIC_CODE_LENGTHS:
+        bits = get_bits(state, 3);
+        if (bits < 0)
+            return STEP_NEED_INPUT;
+        state->lengths[code_length_order[state->lengths_index++]] = bits;
+        if (state->lengths_index == state->hclen) {
+            // The code length code is decoded with the litlen table
+            if (!build_huffman(&state->litlen, state->lengths, 19))
+                return STEP_ERROR;
+            state->lengths_index = 0;
+            state->state = STATE_DYNAMIC_LENGTHS;
+        }
+        return STEP_OK;
+
+    case STATE_DYNAMIC_LENGTHS:
+        return step_dynamic_lengths(state);
+
+    case STATE_CODES:
+        return step_codes(state);
+
+    case STATE_TRAILER:
+        // The checksums are not verified, TLS already guarantees integrity
+        align_to_byte(state);
+        if (state->format == INFLATE_FORMAT_ZLIB) {
+            if (!get_bytes_le(state, 4, &value)) // Adler-32
+                return STEP_NEED_INPUT;
+        } else if (state->format == INFLATE_FORMAT_GZIP) {
+            if (!get_bytes_le(state, 4, &value) || // CRC-32
+                !get_bytes_le(state, 4, &value))   // ISIZE
+                return STEP_NEED_INPUT;
+            if (value != (uint32_t)state->out_len)
+                return STEP_ERROR;
+        }
+        state->state = STATE_DONE;
+        return STEP_DONE;
+
+    case STATE_DONE:
+        return STEP_DONE;
+    }
+    return STEP_ERROR;
+}
+
+void inflate_init(struct inflate_state *state, enum inflate_format format,
+                  uint8_t *out, size_t out_size) {
+    memset(state, 0, sizeof(*state));
+    state->format = format;
+    switch (format) {
+    case INFLATE_FORMAT_ZLIB:
+        state->state = STATE_ZLIB_HEADER;
+        break;
+    case INFLATE_FORMAT_GZIP:
+        state->state = STATE_GZIP_HEADER;
+        break;
+    default:
+        state->state = STATE_BLOCK_HEADER;
+        break;
+    }
+    state->out = out;
+    state->out_size = out_size;
+}
+
+enum inflate_status inflate_feed(struct inflate_state *state,
+                                 const uint8_t *in, size_t len) {
+    state->in = in;
+    state->in_len = len;
+    state->in_pos = 0;
+
+    while (true) {
+        // Steps are restartable, on missing input roll back the reader and
+        // retry the same step with the next piece
+        uint32_t bitbuf = state->bitbuf;
+        unsigned bitcnt = state->bitcnt;
+        size_t stash_pos = state->stash_pos;
+        size_t in_pos = state->in_pos;
+        int current_state = state->state;
+
+        switch (step(state)) {
+        case STEP_OK:
+            break;
+        case STEP_DONE:
+            return INFLATE_DONE;
+        case STEP_ERROR:
+            return INFLATE_ERROR;
+        case STEP_OVERFLOW:
+            return INFLATE_OVERFLOW;
+        case STEP_NEED_INPUT: {
+            state->bitbuf = bitbuf;
+            state->bitcnt = bitcnt;
+            state->state = current_state;
+
+            // Keep the unconsumed tail, a single step never spans more
+            // than a few bytes
+            size_t stash_left = state->stash_len - stash_pos;
+            size_t in_left = len - in_pos;
+            assert(stash_left + in_left <= INFLATE_STASH_SIZE);
+            memmove(state->stash, state->stash + stash_pos, stash_left);
+            memcpy(state->stash + stash_left, in + in_pos, in_left);
+            state->stash_len = stash_left + in_left;
+            state->stash_pos = 0;
+            state->in = NULL;
+            state->in_len = 0;
+            state->in_pos = 0;
+            return INFLATE_NEED_INPUT;
+        }
+        }
+    }
+}
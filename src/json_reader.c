@@ -0,0 +1,175 @@
+#include "fixed.h"
+#include "json_reader.h"
+
+#include <string.h>
+
+void json_reader_init(struct json_reader *reader, const char *text) {
+    memset(reader, 0, sizeof(*reader));
+    reader->next = text;
+}
+
+static const char *skip_whitespace(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        ++p;
+    return p;
+}
+
+// Past the closing quote, NULL if there is none
+static const char *skip_string(const char *p) {
+    for (++p; *p != '"'; ++p) {
+        if (*p == '\0')
+            return NULL;
+        if (*p == '\\' && *++p == '\0')
+            return NULL;
+    }
+    return p + 1;
+}
+
+static enum json_reader_event fail(struct json_reader *reader) {
+    reader->failed = true;
+    return JSON_READER_ERROR;
+}
+
+// A scalar or the end of a container completed a value
+static void value_done(struct json_reader *reader) {
+    reader->expect_comma = reader->depth > 0;
+    reader->done = reader->depth == 0;
+}
+
+static enum json_reader_event open_container(struct json_reader *reader,
+                                             bool object) {
+    if (reader->depth == JSON_READER_MAX_DEPTH)
+        return fail(reader);
+    reader->in_object[reader->depth++] = object;
+    reader->expect_comma = false;
+    return object ? JSON_READER_OBJECT : JSON_READER_ARRAY;
+}
+
+static enum json_reader_event close_container(struct json_reader *reader,
+                                              bool object) {
+    if (reader->depth == 0 || reader->in_object[reader->depth - 1] != object)
+        return fail(reader);
+    --reader->depth;
+    value_done(reader);
+    return object ? JSON_READER_OBJECT_END : JSON_READER_ARRAY_END;
+}
+
+static enum json_reader_event scalar(struct json_reader *reader,
+                                     const char *p) {
+    const char *end;
+    enum json_reader_event event;
+    if (*p == '"') {
+        end = skip_string(p);
+        if (end == NULL)
+            return fail(reader);
+        reader->value = p + 1;
+        reader->value_length = end - p - 2;
+        event = JSON_READER_STRING;
+    } else {
+        end = p + strspn(p, (*p == '-' || (*p >= '0' && *p <= '9'))
+                                ? "+-.0123456789eE"
+                                : "abcdefghijklmnopqrstuvwxyz");
+        reader->value = p;
+        reader->value_length = end - p;
+        if (*p == '-' || (*p >= '0' && *p <= '9'))
+            event = JSON_READER_NUMBER;
+        else if (json_reader_value(reader, "true") ||
+                 json_reader_value(reader, "false") ||
+                 json_reader_value(reader, "null"))
+            event = JSON_READER_LITERAL;
+        else
+            return fail(reader);
+    }
+    reader->next = end;
+    value_done(reader);
+    return event;
+}
+
+enum json_reader_event json_reader_next(struct json_reader *reader) {
+    if (reader->failed)
+        return JSON_READER_ERROR;
+    if (reader->done)
+        return JSON_READER_DONE;
+
+    const char *p = skip_whitespace(reader->next);
+    reader->key = NULL;
+    reader->value = NULL;
+    reader->value_length = 0;
+    if (*p == '}' || *p == ']') {
+        reader->next = p + 1;
+        return close_container(reader, *p == '}');
+    }
+    if (reader->expect_comma) {
+        if (*p != ',')
+            return fail(reader);
+        p = skip_whitespace(p + 1);
+    }
+    if (reader->depth > 0 && reader->in_object[reader->depth - 1]) {
+        if (*p != '"')
+            return fail(reader);
+        const char *end = skip_string(p);
+        if (end == NULL)
+            return fail(reader);
+        reader->key = p + 1;
+        reader->key_length = end - p - 2;
+        p = skip_whitespace(end);
+        if (*p != ':')
+            return fail(reader);
+        p = skip_whitespace(p + 1);
+    }
+
+    if (*p == '{' || *p == '[') {
+        reader->next = p + 1;
+        return open_container(reader, *p == '{');
+    }
+    return scalar(reader, p);
+}
+
+bool json_reader_skip(struct json_reader *reader) {
+    unsigned depth = reader->depth;
+    while (reader->depth >= depth) {
+        if (json_reader_next(reader) == JSON_READER_ERROR)
+            return false;
+    }
+    return true;
+}
+
+static bool span_equals(const char *span, size_t length, const char *text) {
+    return span != NULL && strlen(text) == length &&
+           memcmp(span, text, length) == 0;
+}
+
+bool json_reader_key(const struct json_reader *reader, const char *key) {
+    return span_equals(reader->key, reader->key_length, key);
+}
+
+bool json_reader_value(const struct json_reader *reader, const char *value) {
+    return span_equals(reader->value, reader->value_length, value);
+}
+
+bool json_reader_fixed(const struct json_reader *reader, unsigned decimals,
+                       int32_t *value) {
+    return reader->value != NULL &&
+           fixed_parse(reader->value, reader->value_length, decimals, value);
+}
+
+bool json_reader_integer(const struct json_reader *reader, int64_t *value) {
+    const char *p = reader->value;
+    const char *end = p + reader->value_length;
+    if (p == NULL)
+        return false;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    if (p == end)
+        return false;
+
+    int64_t result = 0;
+    for (; p < end; ++p) {
+        if (*p < '0' || *p > '9' || result > (INT64_MAX - 9) / 10)
+            return false;
+        result = result * 10 + (*p - '0');
+    }
+    *value = negative ? -result : result;
+    return true;
+}
@@ -1,12 +1,21 @@
-#include "hardware/rtc.h"
-
 #include "DEV_Config.h"
 #include "LCD_Driver.h"
 #include "LCD_GUI.h"
 #include "LCD_Touch.h"
 
+#include "assets.h"
+#include "backlight.h"
+#include "memstat.h"
 #include "network.h"
+#include "power.h"
+#include "resolver.h"
 #include "rtc.h"
+#include "sched.h"
+#include "settings.h"
+#include "snapshot.h"
+#include "sprites.h"
+#include "timebase.h"
+#include "trace.h"
 #include "tram.h"
 #include "weather.h"
 
@@ -14,6 +23,27 @@
 
 #define LEN(array) (sizeof array) / (sizeof array[0])
 
+#define RENDER_INTERVAL_MS 1000
+#define RENDER_WEATHER_INTERVAL_MS 60000
+#define HOUSEKEEPING_INTERVAL_MS 100
+#define TOUCH_DEBOUNCE_MS 300
+
+// The diagnostics page is toggled by touching the screen
+static bool show_diagnostics;
+static bool page_changed;
+
+static struct sched_task *render_task;
+static struct sched_task *update_task;
+static struct connection_state *weather_connection;
+static struct connection_state *tram_connection;
+static bool updating;
+static absolute_time_t last_update;
+
+static void render_title(void) {
+    GUI_DisString_EN(20, 20, "SOS home assistant", &Font24, LCD_BACKGROUND,
+                     RED);
+}
+
 static void lcd_init(void) {
     log_debug("Initializing LCD");
     DEV_GPIO_Init();
@@ -23,74 +53,182 @@ static void lcd_init(void) {
     gpio_set_function(LCD_MISO_PIN, GPIO_FUNC_SPI);
 
     LCD_SCAN_DIR lcd_scan_dir = SCAN_DIR_DFT;
-    LCD_Init(lcd_scan_dir, 800);
+    // Dark until the first screen is drawn, then faded in
+    LCD_Init(lcd_scan_dir, 0);
     TP_Init(lcd_scan_dir);
     GUI_Clear(WHITE);
-    GUI_DisString_EN(20, 20, "SOS home assistant", &Font24, LCD_BACKGROUND,
-                     RED);
+    render_title();
+    backlight_init();
 }
 
-static bool timer_callback(repeating_timer_t *rt) {
-    void (*f)(void) = rt->user_data;
-    f();
-    return true; // keep repeating
+static void touch_callback(uint gpio, uint32_t events) {
+    // Handled by the render task
+    sched_signal(render_task, SCHED_EVENT_TOUCH);
+}
+
+static void handle_touch(void) {
+    static absolute_time_t last_touch;
+    absolute_time_t now = get_absolute_time();
+    if (absolute_time_diff_us(last_touch, now) < TOUCH_DEBOUNCE_MS * 1000)
+        return;
+    last_touch = now;
+    // Waking up from the dimmed or dark screen redraws the same page
+    if (!power_wake())
+        show_diagnostics = !show_diagnostics;
+    page_changed = true;
 }
 
 static void render_time_and_tram(void) {
+    if (!power_refresh_due())
+        return;
+    if (page_changed) {
+        page_changed = false;
+        GUI_Clear(WHITE);
+        sprites_invalidate();
+        weather_invalidate();
+        if (!show_diagnostics) {
+            render_title();
+            render_weather();
+        }
+    }
+    if (show_diagnostics) {
+        trace_render();
+        memstat_render();
+        power_render();
+        return;
+    }
     render_time();
     render_tram();
 }
 
+// Every second and right after a touch
+static void render_task_run(uint32_t events) {
+    if (events & SCHED_EVENT_TOUCH)
+        handle_touch();
+    render_time_and_tram();
+}
+
+static void render_weather_page(uint32_t events) {
+    if (!show_diagnostics && power_display_on())
+        render_weather();
+    snapshot_flush();
+}
+
+// Single character commands over USB stdio
+static void handle_usb_command(void) {
+    switch (getchar_timeout_us(0)) {
+    case 'h':
+        trace_dump_histograms();
+        break;
+    case 't':
+        trace_dump_chrome();
+        break;
+    case 'm':
+        memstat_dump();
+        break;
+    case 'c':
+        settings_console();
+        break;
+    case 'p':
+        power_dump();
+        break;
+    case 's':
+        sched_dump();
+        break;
+    }
+}
+
+// Fetch and parse both, waiting for the network runs the render tasks
+static void update_task_run(uint32_t events) {
+    // Callbacks of a finished query also signal the task
+    if (!(events & SCHED_EVENT_UPDATE))
+        return;
+    power_network_begin();
+    if (query_connection(weather_connection)) {
+        update_weather(weather_connection->http_response);
+    }
+    if (query_connection(tram_connection)) {
+        update_tram(tram_connection->http_response);
+    }
+    power_network_end();
+    snapshot_save();
+    memstat_sample();
+    last_update = get_absolute_time();
+    updating = false;
+}
+
+// Print the deferred log records and start the next update, whose interval
+// depends on whether anybody is watching
+static void housekeeping_task_run(uint32_t events) {
+    handle_usb_command();
+    log_drain();
+    power_tick();
+    if (!updating && absolute_time_diff_us(last_update, get_absolute_time()) >=
+                         power_update_interval_ms() * 1000ll) {
+        updating = true;
+        sched_signal(update_task, SCHED_EVENT_UPDATE);
+    }
+}
+
 void main(void) {
+    memstat_init();
+    sched_init();
     stdio_usb_init();
     stdio_set_translate_crlf(&stdio_usb, true);
 
+    settings_init();
     init_cyw43();
     lcd_init();
-    rtc_init();
+    // Drawing works without the card, only the images are missing
+    assets_init();
+
+    if (!settings_complete()) {
+        GUI_DisString_EN(20, 140, "Configure over USB serial", &Font24,
+                         LCD_BACKGROUND, BLACK);
+        while (true) {
+            log_drain();
+            settings_console();
+        }
+    }
 
-    connect_to_wifi(WIFI_SSID, WIFI_PASSWORD);
-    set_rtc();
+    init_tram();
+    init_weather();
+    // Show the last known weather while connecting
+    if (snapshot_restore())
+        render_weather();
+
+    const struct settings *settings = settings_get();
+    connect_to_wifi(settings->wifi_ssid, settings->wifi_password);
+    power_init();
+    resolver_init();
+    timebase_init();
+    snapshot_restore_departures();
+    render_time();
+    render_tram();
 
-    struct connection_state *weather_connection =
+    weather_connection =
         init_connection(HTTPS_WEATHER_HOSTNAME, WEATHER_TLS_ROOT_CERT,
-                        LEN(WEATHER_TLS_ROOT_CERT), HTTPS_WEATHER_REQUEST);
-    struct connection_state *tram_connection =
+                        LEN(WEATHER_TLS_ROOT_CERT), weather_request());
+    tram_connection =
         init_connection(HTTPS_TRAM_HOSTNAME, TRAM_TLS_ROOT_CERT,
-                        LEN(TRAM_TLS_ROOT_CERT), HTTPS_TRAM_REQUEST);
+                        LEN(TRAM_TLS_ROOT_CERT), tram_request());
 
-    init_tram();
-    init_weather();
-
-    // Refresh time and trams every second
-    repeating_timer_t timer_time_and_tram;
-    if (!add_repeating_timer_ms(1000, timer_callback, render_time_and_tram,
-                                &timer_time_and_tram)) {
-        log_fatal("Failed to add refresh timer");
-        return;
-    }
+    // Drawing preempts the rest at the points where a fetch waits
+    render_task = sched_add("render", SCHED_HIGH, RENDER_INTERVAL_MS,
+                            render_task_run);
+    sched_add("weather", SCHED_HIGH, RENDER_WEATHER_INTERVAL_MS,
+              render_weather_page);
+    sched_add("housekeeping", SCHED_NORMAL, HOUSEKEEPING_INTERVAL_MS,
+              housekeeping_task_run);
+    update_task = sched_add("update", SCHED_LOW, 0, update_task_run);
 
-    // Refresh weather every minute
-    repeating_timer_t timer_weather;
-    if (!add_repeating_timer_ms(60000, timer_callback, render_weather,
-                                &timer_weather)) {
-        log_fatal("Failed to add refresh timer");
-        return;
-    }
+    gpio_set_irq_enabled_with_callback(TP_IRQ_PIN, GPIO_IRQ_EDGE_FALL, true,
+                                       touch_callback);
 
     // mbedtls_debug_set_threshold(5);
 
-    // We update every 10 seconds
-    while (true) {
-        if (query_connection(weather_connection)) {
-            update_weather(weather_connection->http_response);
-        }
-        if (query_connection(tram_connection)) {
-            update_tram(tram_connection->http_response);
-        }
-
-        sleep_ms(10000);
-    }
-
-    return;
+    // The first update right away
+    updating = true;
+    sched_signal(update_task, SCHED_EVENT_UPDATE);
+    sched_run();
 }
@@ -0,0 +1,149 @@
+#include "hardware/sync.h"
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+
+#include "lwip/stats.h"
+
+#include "DEV_Config.h"
+#include "LCD_Driver.h"
+#include "LCD_GUI.h"
+
+#include "memstat.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MAX_MEMSTAT_LINE_STRING_LENGTH 48
+
+// Provided by the pico-sdk linker script
+extern uint32_t __StackBottom, __StackTop;
+extern uint32_t __StackOneBottom, __StackOneTop;
+extern uint32_t __StackLimit;
+
+struct memstat_state {
+    size_t heap_peak;
+    size_t tls_current;
+    size_t tls_peak;
+    size_t tls_allocations;
+    size_t tls_failures;
+};
+static struct memstat_state state;
+
+static void paint(uint32_t *bottom, uint32_t *top) {
+    for (uint32_t *word = bottom; word < top; ++word)
+        *word = MEMSTAT_STACK_PAINT;
+}
+
+// Bytes used so far, the stack grows down from top
+static size_t stack_used(const uint32_t *bottom, const uint32_t *top) {
+    const uint32_t *word = bottom;
+    while (word < top && *word == MEMSTAT_STACK_PAINT)
+        ++word;
+    return (top - word) * sizeof(uint32_t);
+}
+
+void memstat_init(void) {
+    // Core 0 is running on its stack, keep clear of the live part of it
+    uint32_t marker;
+    paint(&__StackBottom,
+          (uint32_t *)((uintptr_t)&marker - MEMSTAT_STACK_PAINT_MARGIN));
+    paint(&__StackOneBottom, &__StackOneTop);
+}
+
+void memstat_sample(void) {
+    struct mallinfo info = mallinfo();
+    uint32_t irq = save_and_disable_interrupts();
+    if ((size_t)info.uordblks > state.heap_peak)
+        state.heap_peak = info.uordblks;
+    restore_interrupts(irq);
+}
+
+void memstat_tls_allocated(size_t bytes) {
+    uint32_t irq = save_and_disable_interrupts();
+    ++state.tls_allocations;
+    state.tls_current += bytes;
+    if (state.tls_current > state.tls_peak)
+        state.tls_peak = state.tls_current;
+    restore_interrupts(irq);
+}
+
+void memstat_tls_failed(void) {
+    uint32_t irq = save_and_disable_interrupts();
+    ++state.tls_failures;
+    restore_interrupts(irq);
+}
+
+void memstat_tls_freed(size_t bytes) {
+    uint32_t irq = save_and_disable_interrupts();
+    state.tls_current -= bytes;
+    restore_interrupts(irq);
+}
+
+void memstat_get(struct memstat *stats) {
+    stats->stack_size[0] = (&__StackTop - &__StackBottom) * sizeof(uint32_t);
+    stats->stack_used[0] = stack_used(&__StackBottom, &__StackTop);
+    stats->stack_size[1] =
+        (&__StackOneTop - &__StackOneBottom) * sizeof(uint32_t);
+    stats->stack_used[1] = stack_used(&__StackOneBottom, &__StackOneTop);
+
+    memstat_sample();
+    struct mallinfo info = mallinfo();
+    stats->heap_arena = info.arena;
+    stats->heap_current = info.uordblks;
+    // Free chunks inside the heap are not reported by newlib, the top chunk
+    // plus what sbrk can still give is the block a large malloc would get
+    stats->heap_free_top =
+        (uintptr_t)&__StackLimit - (uintptr_t)sbrk(0) + info.keepcost;
+
+    cyw43_arch_lwip_begin();
+    stats->lwip_used = lwip_stats.mem.used;
+    stats->lwip_peak = lwip_stats.mem.max;
+    stats->lwip_size = lwip_stats.mem.avail;
+    stats->lwip_failures = lwip_stats.mem.err;
+    cyw43_arch_lwip_end();
+
+    uint32_t irq = save_and_disable_interrupts();
+    stats->heap_peak = state.heap_peak;
+    stats->tls_current = state.tls_current;
+    stats->tls_peak = state.tls_peak;
+    stats->tls_allocations = state.tls_allocations;
+    stats->tls_failures = state.tls_failures;
+    restore_interrupts(irq);
+}
+
+void memstat_dump(void) {
+    struct memstat stats;
+    memstat_get(&stats);
+    printf("mem stack0=%u/%u stack1=%u/%u heap=%u peak=%u arena=%u "
+           "free_top=%u lwip=%u peak=%u size=%u err=%u tls=%u peak=%u "
+           "n=%u err=%u\n",
+           (unsigned)stats.stack_used[0], (unsigned)stats.stack_size[0],
+           (unsigned)stats.stack_used[1], (unsigned)stats.stack_size[1],
+           (unsigned)stats.heap_current, (unsigned)stats.heap_peak,
+           (unsigned)stats.heap_arena, (unsigned)stats.heap_free_top,
+           (unsigned)stats.lwip_used, (unsigned)stats.lwip_peak,
+           (unsigned)stats.lwip_size, (unsigned)stats.lwip_failures,
+           (unsigned)stats.tls_current, (unsigned)stats.tls_peak,
+           (unsigned)stats.tls_allocations, (unsigned)stats.tls_failures);
+}
+
+void memstat_render(void) {
+    struct memstat stats;
+    memstat_get(&stats);
+    char line[MAX_MEMSTAT_LINE_STRING_LENGTH];
+    // In KB, fixed width so the lines overwrite the previous values
+    snprintf(line, sizeof(line), "stack %3u/%3u  heap %3u pk %3u fr %3u",
+             (unsigned)stats.stack_used[0] / 1024,
+             (unsigned)stats.stack_size[0] / 1024,
+             (unsigned)stats.heap_current / 1024,
+             (unsigned)stats.heap_peak / 1024,
+             (unsigned)stats.heap_free_top / 1024);
+    GUI_DisString_EN(20, 260, line, &Font16, LCD_BACKGROUND, BLACK);
+    snprintf(line, sizeof(line), "lwip %4u/%4uB pk %4u  tls %3u pk %3u",
+             (unsigned)stats.lwip_used, (unsigned)stats.lwip_size,
+             (unsigned)stats.lwip_peak, (unsigned)stats.tls_current / 1024,
+             (unsigned)stats.tls_peak / 1024);
+    GUI_DisString_EN(20, 280, line, &Font16, LCD_BACKGROUND, BLACK);
+}
@@ -1,25 +1,400 @@
+// The per-pbuf traces run in the lwIP receive interrupt, so they are only
+// compiled in with NETWORK_LOG_TRACE. This only ever raises the threshold of
+// the build.
+#if !defined(LOG_COMPILE_LEVEL) && !defined(NETWORK_LOG_TRACE)
+#define LOG_COMPILE_LEVEL                                                      \
+    (LOG_DEFAULT_COMPILE_LEVEL > LOG_LEVEL_DEBUG ? LOG_DEFAULT_COMPILE_LEVEL   \
+                                                 : LOG_LEVEL_DEBUG)
+#endif
+
 #include "pico/cyw43_arch.h"
 
 #include "lwip/altcp_tls.h"
-#include "lwip/dns.h"
 #include "lwip/prot/iana.h" // HTTPS port number
+#include "mbedtls/platform.h"
 
 #include "log.h"
+#include "memstat.h"
 #include "network.h"
+#include "replay.h"
+#include "resolver.h"
+#include "sched.h"
+#include "trace.h"
+
+#include <ctype.h>
+#include <strings.h>
+
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_NO_CONTENT 204
+#define HTTP_STATUS_NOT_MODIFIED 304
+
+// Connections live for the whole run, so they are never freed. mbedTLS
+// allocates from the arena of the connection being queried, also from the
+// lwIP callbacks which run meanwhile, and frees into whichever arena holds
+// the block. All mbedTLS calls happen under the lwIP lock, so the arenas
+// need no locking of their own.
+struct network_state {
+    struct connection_state connections[HTTPS_MAX_CONNECTIONS];
+    unsigned connection_count;
+    struct arena *volatile tls_arena;
+};
+static struct network_state state;
+
+static void *tls_calloc(size_t n, size_t size) {
+    size_t bytes = n * size;
+    struct arena *arena = state.tls_arena;
+    void *ptr = (arena && !(n && bytes / n != size))
+                    ? arena_alloc(arena, bytes)
+                    : NULL;
+    if (!ptr) {
+        memstat_tls_failed();
+        return NULL;
+    }
+    memset(ptr, 0, bytes);
+    memstat_tls_allocated(arena_block_size(ptr));
+    return ptr;
+}
+
+static void tls_free(void *ptr) {
+    if (!ptr)
+        return;
+    for (unsigned i = 0; i < state.connection_count; ++i) {
+        struct arena *arena = &state.connections[i].tls_arena;
+        if (arena_contains(arena, ptr)) {
+            memstat_tls_freed(arena_block_size(ptr));
+            arena_free(arena, ptr);
+            return;
+        }
+    }
+    assert(!"mbedTLS block outside of the TLS arenas");
+}
+
+// Once the connection and its config are freed, so should be all of its
+// mbedTLS blocks. Start the next connection from one contiguous free block.
+static void reset_tls_arena(struct connection_state *connection) {
+    struct arena *arena = &connection->tls_arena;
+    cyw43_arch_lwip_begin();
+    size_t used = arena->used;
+    if (used == 0)
+        arena_reset(arena);
+    cyw43_arch_lwip_end();
+    if (used != 0)
+        log_warn("%u bytes left allocated in the TLS arena of %s",
+                 (unsigned)used, connection->hostname);
+    else
+        log_debug("TLS arena of %s peaked at %u of %u bytes",
+                  connection->hostname, (unsigned)arena->peak,
+                  (unsigned)arena->size);
+}
+
+// Parse one header line, CRLF already stripped
+static void parse_header_line(struct connection_state *connection,
+                              char *line) {
+    // The status line comes first
+    if (connection->http_status == 0) {
+        const char *status = strchr(line, ' ');
+        connection->http_status = status ? strtoul(status, NULL, 10) : 0;
+        // Only a full response carries validators for the next request, a 304
+        // keeps the ones we already have
+        if (connection->http_status == HTTP_STATUS_OK) {
+            connection->etag[0] = '\0';
+            connection->last_modified[0] = '\0';
+        }
+        return;
+    }
+
+    char *value = strchr(line, ':');
+    if (value == NULL)
+        return;
+    *value++ = '\0';
+    while (*value == ' ')
+        ++value;
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+        connection->http_content_length = strtol(value, NULL, 10);
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        connection->http_chunked = strstr(value, "chunked") != NULL;
+    } else if (strcasecmp(line, "Content-Encoding") == 0) {
+        if (strcasecmp(value, "gzip") == 0)
+            connection->content_encoding = HTTP_ENCODING_GZIP;
+        else if (strcasecmp(value, "deflate") == 0)
+            connection->content_encoding = HTTP_ENCODING_DEFLATE;
+        else if (strcasecmp(value, "identity") != 0)
+            log_warn("Unsupported Content-Encoding %s", value);
+    } else if (connection->http_status == HTTP_STATUS_OK) {
+        char *validator = NULL;
+        if (strcasecmp(line, "ETag") == 0)
+            validator = connection->etag;
+        else if (strcasecmp(line, "Last-Modified") == 0)
+            validator = connection->last_modified;
+        if (validator && strlen(value) < HTTPS_VALIDATOR_MAX_SIZE)
+            strcpy(validator, value);
+    }
+}
 
-// DNS response callback
-static void callback_gethostbyname(const char *name, const ip_addr_t *resolved,
-                                   void *ipaddr) {
-    if (resolved)
-        *(ip_addr_t *)ipaddr = *resolved; // Successful resolution
+// Header is complete, set up body decoding
+static void end_of_header(struct connection_state *connection) {
+    unsigned status = connection->http_status;
+    if (status == HTTP_STATUS_NOT_MODIFIED || status == HTTP_STATUS_NO_CONTENT)
+        connection->transfer_state = HTTP_TRANSFER_DONE; // Never has a body
+    else if (connection->http_chunked)
+        connection->transfer_state = HTTP_TRANSFER_CHUNK_SIZE;
     else
-        ((ip_addr_t *)ipaddr)->addr = IPADDR_NONE; // Failed resolution
+        connection->transfer_state = HTTP_TRANSFER_BODY;
+
+    // Keep one byte for the terminating zero
+    uint8_t *body = (uint8_t *)connection->http_response;
+    if (connection->content_encoding == HTTP_ENCODING_GZIP)
+        inflate_init(&connection->inflater, INFLATE_FORMAT_GZIP, body,
+                     HTTPS_RESPONSE_MAX_SIZE - 1);
+    else if (connection->content_encoding == HTTP_ENCODING_DEFLATE)
+        inflate_init(&connection->inflater, INFLATE_FORMAT_ZLIB, body,
+                     HTTPS_RESPONSE_MAX_SIZE - 1);
+}
+
+// Consume header bytes, returns how many bytes of data belong to the header
+static size_t consume_header(struct connection_state *connection,
+                             const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && connection->transfer_state == HTTP_TRANSFER_HEADER) {
+        char c = data[i++];
+        unsigned *line_len = &connection->http_header_line_len;
+        if (c == '\r')
+            continue;
+        if (c != '\n') {
+            // Lines which do not fit are skipped as a whole
+            if (*line_len < HTTPS_HEADER_LINE_MAX_SIZE - 1)
+                connection->http_header_line[*line_len] = c;
+            if (*line_len < HTTPS_HEADER_LINE_MAX_SIZE)
+                ++*line_len;
+            continue;
+        }
+
+        if (*line_len == 0) {
+            end_of_header(connection);
+        } else if (*line_len < HTTPS_HEADER_LINE_MAX_SIZE) {
+            connection->http_header_line[*line_len] = '\0';
+            parse_header_line(connection, connection->http_header_line);
+        } else {
+            log_warn("Skipping too long HTTP header line");
+        }
+        *line_len = 0;
+    }
+    return i;
+}
+
+// Append body data, decompressing it if needed
+static bool store_body(struct connection_state *connection, const char *data,
+                       size_t len) {
+    if (connection->content_encoding == HTTP_ENCODING_IDENTITY) {
+        // Keep one byte for the terminating zero
+        if (connection->http_response_offset + len >= HTTPS_RESPONSE_MAX_SIZE) {
+            log_error("HTTP response does not fit the buffer");
+            return false;
+        }
+        char *body = connection->http_response;
+        memcpy(body + connection->http_response_offset, data, len);
+        connection->http_response_offset += len;
+        body[connection->http_response_offset] = '\0';
+        // Counted only while storing, to find the end of a body without
+        // Content-Length without rescanning it on every pbuf
+        for (size_t i = 0; i < len; ++i) {
+            if (data[i] == '{')
+                ++connection->braces_open;
+            else if (data[i] == '}')
+                ++connection->braces_closed;
+        }
+        return true;
+    }
+
+    if (connection->inflate_done)
+        return len == 0;
+    enum inflate_status status =
+        inflate_feed(&connection->inflater, (const uint8_t *)data, len);
+    connection->http_response_offset = connection->inflater.out_len;
+    connection->http_response[connection->http_response_offset] = '\0';
+    switch (status) {
+    case INFLATE_DONE:
+        connection->inflate_done = true;
+        return true;
+    case INFLATE_NEED_INPUT:
+        return true;
+    case INFLATE_OVERFLOW:
+        log_error("Decompressed HTTP response does not fit the buffer");
+        return false;
+    default:
+        log_error("Corrupted compressed HTTP response");
+        return false;
+    }
+}
+
+// Strip the chunked transfer coding
+static bool consume_chunked(struct connection_state *connection,
+                            const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && connection->transfer_state != HTTP_TRANSFER_DONE) {
+        char c = data[i];
+        switch (connection->transfer_state) {
+        case HTTP_TRANSFER_CHUNK_SIZE:
+            ++i;
+            if (c == '\n') {
+                connection->chunk_extension = false;
+                connection->trailer_line_len = 0;
+                connection->transfer_state = connection->chunk_left
+                                                 ? HTTP_TRANSFER_CHUNK_DATA
+                                                 : HTTP_TRANSFER_TRAILER;
+            } else if (c == ';') {
+                connection->chunk_extension = true;
+            } else if (!connection->chunk_extension && c != '\r') {
+                if (!isxdigit((unsigned char)c) ||
+                    connection->chunk_left >= HTTPS_RESPONSE_MAX_SIZE * 16) {
+                    log_error("Invalid HTTP chunk size");
+                    return false;
+                }
+                connection->chunk_left =
+                    16 * connection->chunk_left +
+                    (isdigit((unsigned char)c) ? c - '0'
+                                               : (tolower(c) - 'a' + 10));
+            }
+            break;
+        case HTTP_TRANSFER_CHUNK_DATA: {
+            size_t n = len - i;
+            if (n > connection->chunk_left)
+                n = connection->chunk_left;
+            if (!store_body(connection, data + i, n))
+                return false;
+            i += n;
+            connection->chunk_left -= n;
+            if (connection->chunk_left == 0)
+                connection->transfer_state = HTTP_TRANSFER_CHUNK_DATA_END;
+            break;
+        }
+        case HTTP_TRANSFER_CHUNK_DATA_END:
+            ++i;
+            if (c == '\n')
+                connection->transfer_state = HTTP_TRANSFER_CHUNK_SIZE;
+            break;
+        case HTTP_TRANSFER_TRAILER:
+            // Trailer fields are ignored, the empty line ends the message
+            ++i;
+            if (c == '\n') {
+                if (connection->trailer_line_len == 0)
+                    connection->transfer_state = HTTP_TRANSFER_DONE;
+                connection->trailer_line_len = 0;
+            } else if (c != '\r') {
+                ++connection->trailer_line_len;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Feed received bytes through header parsing, transfer and content decoding
+static bool consume_response(struct connection_state *connection,
+                             const char *data, size_t len) {
+    if (connection->transfer_state == HTTP_TRANSFER_HEADER) {
+        size_t n = consume_header(connection, data, len);
+        data += n;
+        len -= n;
+    }
+    if (len == 0)
+        return true;
+
+    switch (connection->transfer_state) {
+    case HTTP_TRANSFER_BODY:
+        connection->body_received += len;
+        return store_body(connection, data, len);
+    case HTTP_TRANSFER_DONE:
+        log_warn("Ignoring %u bytes after the HTTP response", (unsigned)len);
+        return true;
+    default:
+        return consume_chunked(connection, data, len);
+    }
+}
+
+// ERR_INPROGRESS until the whole response is received, then ERR_OK or ERR_VAL
+// if the body turned out incomplete
+static lwip_err_t response_status(const struct connection_state *connection) {
+    switch (connection->transfer_state) {
+    case HTTP_TRANSFER_DONE:
+        break;
+    case HTTP_TRANSFER_BODY:
+        if (connection->http_content_length >= 0) {
+            if (connection->body_received < connection->http_content_length)
+                return ERR_INPROGRESS;
+        } else if (connection->content_encoding != HTTP_ENCODING_IDENTITY) {
+            if (!connection->inflate_done)
+                return ERR_INPROGRESS;
+        } else {
+            // If the number of { and } are the same in the body, this is the
+            // last chunk
+            if (connection->braces_open == 0 ||
+                connection->braces_open != connection->braces_closed)
+                return ERR_INPROGRESS;
+        }
+        break;
+    default:
+        return ERR_INPROGRESS;
+    }
+
+    if (connection->content_encoding != HTTP_ENCODING_IDENTITY &&
+        connection->http_status == HTTP_STATUS_OK &&
+        !connection->inflate_done) {
+        log_error("Compressed HTTP response ended prematurely");
+        return ERR_VAL;
+    }
+    return ERR_OK;
+}
+
+// Fill http_request with the request head, cache validators and final CRLF
+static void build_request(struct connection_state *connection) {
+    char *request = connection->http_request;
+    int len = snprintf(request, HTTPS_REQUEST_MAX_SIZE, "%s",
+                       connection->request);
+    assert(len < HTTPS_REQUEST_MAX_SIZE);
+    if (connection->etag[0] != '\0') {
+        len += snprintf(request + len, HTTPS_REQUEST_MAX_SIZE - len,
+                        "If-None-Match: %s\r\n", connection->etag);
+        assert(len < HTTPS_REQUEST_MAX_SIZE);
+    }
+    if (connection->last_modified[0] != '\0') {
+        len += snprintf(request + len, HTTPS_REQUEST_MAX_SIZE - len,
+                        "If-Modified-Since: %s\r\n",
+                        connection->last_modified);
+        assert(len < HTTPS_REQUEST_MAX_SIZE);
+    }
+    len += snprintf(request + len, HTTPS_REQUEST_MAX_SIZE - len,
+                    "Accept-Encoding: gzip, deflate\r\n\r\n");
+    assert(len < HTTPS_REQUEST_MAX_SIZE);
+}
+
+// Close the connection, unless lwIP already dropped it on an error, and free
+// its config, so that its TLS arena is empty again
+static void close_connection(struct connection_state *connection) {
+    cyw43_arch_lwip_begin();
+    if (connection->pcb)
+        altcp_close(connection->pcb);
+    if (connection->config)
+        altcp_tls_free_config(connection->config);
+    cyw43_arch_lwip_end();
+    connection->pcb = NULL;
+    connection->config = NULL;
+    reset_tls_arena(connection);
 }
 
 // TCP + TLS connection error callback
 static void callback_altcp_err(void *arg, lwip_err_t err) {
+    struct connection_state *connection = (struct connection_state *)arg;
     // Print error code
     log_error("Connection error [lwip_err_t err == %d]", err);
+    // lwIP has already freed the pcb, the config is left to the next query,
+    // it cannot be freed from a callback
+    connection->pcb = NULL;
+    connection->received_err = err;
+    sched_signal(connection->task, SCHED_EVENT_NETWORK);
 }
 
 // TCP + TLS connection idle callback
@@ -32,53 +407,59 @@ static lwip_err_t callback_altcp_poll(void *arg, struct altcp_pcb *pcb) {
 static lwip_err_t callback_altcp_sent(void *arg, struct altcp_pcb *pcb,
                                       u16_t len) {
     struct connection_state *connection = (struct connection_state *)arg;
+    connection->trace_sent_us = trace_now();
     connection->send_acknowledged_bytes = len;
+    sched_signal(connection->task, SCHED_EVENT_NETWORK);
     return ERR_OK;
 }
 
 // TCP + TLS data reception callback
+//
+// Hands every pbuf of the chain as one contiguous slice straight to the
+// response decoder, the chain is released only after all of it is consumed.
 static lwip_err_t callback_altcp_recv(void *arg, struct altcp_pcb *pcb,
                                       struct pbuf *buf, lwip_err_t err) {
     struct connection_state *connection = (struct connection_state *)arg;
-    struct pbuf *head = buf;
-
-    log_trace("Received HTTP response:");
-    if (err == ERR_OK) {
-        if (head == NULL || head->tot_len == 0)
-            return ERR_OK;
-
-        assert(connection->http_response_offset + head->tot_len <
-               HTTPS_RESPONSE_MAX_SIZE);
-        while (buf) {
-            for (size_t i = 0; i < buf->len; ++i) {
-                putchar(((char *)buf->payload)[i]);
-                connection
-                    ->http_response[connection->http_response_offset + i] =
-                    ((char *)buf->payload)[i];
-            }
-            connection->http_response_offset += buf->len;
-            buf = buf->next;
+
+    if (err != ERR_OK) {
+        if (buf)
+            pbuf_free(buf);
+        connection->received_err = err;
+        sched_signal(connection->task, SCHED_EVENT_NETWORK);
+        return ERR_OK;
+    }
+    if (buf == NULL) {
+        // Usually the keep-alive timeout of an idle connection, the next
+        // query reconnects instead of writing into it
+        connection->remote_closed = true;
+        if (connection->received_err == ERR_INPROGRESS) {
+            connection->received_err = ERR_CLSD;
+            sched_signal(connection->task, SCHED_EVENT_NETWORK);
         }
+        return ERR_OK;
+    }
 
-        // Advertise data reception
-        altcp_recved(pcb, head->tot_len);
+    log_trace("Received %u bytes of HTTP response", buf->tot_len);
+    if (connection->trace_first_byte_us == 0)
+        connection->trace_first_byte_us = trace_now();
+    bool consumed = true;
+    for (const struct pbuf *slice = buf; slice && consumed;
+         slice = slice->next) {
+        replay_capture(slice->payload, slice->len);
+        consumed = consume_response(connection, slice->payload, slice->len);
+    }
 
-        // Free buf
-        pbuf_free(head); // Free entire pbuf chain
+    // Advertise data reception and free the entire pbuf chain
+    altcp_recved(pcb, buf->tot_len);
+    pbuf_free(buf);
 
-        // If the number of { and } are the same in the response, this is
-        // the last chunk
-        size_t left = 0, right = 0;
-        for (size_t i = 0; i < connection->http_response_offset; ++i) {
-            if (connection->http_response[i] == '{')
-                ++left;
-            if (connection->http_response[i] == '}')
-                ++right;
-        }
-        if (left == right)
-            connection->received_err = err;
-    } else {
-        connection->received_err = err;
+    if (!consumed)
+        connection->received_err = ERR_VAL;
+    else
+        connection->received_err = response_status(connection);
+    if (connection->received_err != ERR_INPROGRESS) {
+        connection->trace_last_byte_us = trace_now();
+        sched_signal(connection->task, SCHED_EVENT_NETWORK);
     }
     return ERR_OK;
 }
@@ -87,44 +468,25 @@ static lwip_err_t callback_altcp_recv(void *arg, struct altcp_pcb *pcb,
 static lwip_err_t callback_altcp_connect(void *arg, struct altcp_pcb *pcb,
                                          lwip_err_t err) {
     struct connection_state *connection = (struct connection_state *)arg;
+    connection->trace_connected_us = trace_now();
     connection->connected = true;
+    sched_signal(connection->task, SCHED_EVENT_NETWORK);
     return ERR_OK;
 }
 
-// Resolve hostname
-static void resolve_hostname(ip_addr_t *ipaddr, const char *hostname) {
-    log_debug("Resolving %s", hostname);
-    ipaddr->addr = IPADDR_ANY;
-
-    // Attempt resolution
-    cyw43_arch_lwip_begin();
-    lwip_err_t lwip_err =
-        dns_gethostbyname(hostname, ipaddr, callback_gethostbyname, ipaddr);
-    cyw43_arch_lwip_end();
-    if (lwip_err == ERR_INPROGRESS) {
-
-        // Await resolution
-        //
-        //  IP address will be made available shortly (by callback) upon
-        //  DNS query response.
-        //
-        while (ipaddr->addr == IPADDR_ANY)
-            sleep_ms(HTTPS_RESOLVE_POLL_INTERVAL_MS);
-        if (ipaddr->addr != IPADDR_NONE)
-            lwip_err = ERR_OK;
-        else
-            log_fatal("Failed to resolve %s", hostname);
-    }
-
-    // Convert to ip_addr_t
-    cyw43_arch_lwip_begin();
-    char *char_ipaddr = ipaddr_ntoa(ipaddr);
-    cyw43_arch_lwip_end();
-    log_info("Resolved %s (%s)", hostname, char_ipaddr);
-}
-
 // Establish TCP + TLS connection with server
 static bool connect_to_host(struct connection_state *connection) {
+    // Left by an idle connection which lwIP dropped on an error
+    if (connection->config)
+        close_connection(connection);
+
+    // Cached by the resolver, so this normally does not wait for the network
+    uint32_t resolve_start_us = trace_now();
+    bool resolved = resolver_resolve(connection->hostname, &connection->ipaddr);
+    trace_record(TRACE_DNS, resolve_start_us, trace_now());
+    if (!resolved)
+        return false;
+
     log_debug("Connecting to port %d", LWIP_IANA_PORT_HTTPS);
     cyw43_arch_lwip_begin();
 
@@ -144,6 +506,8 @@ static bool connect_to_host(struct connection_state *connection) {
 
     connection->config = config;
     connection->connected = false;
+    connection->remote_closed = false;
+    connection->received_err = ERR_INPROGRESS;
     cyw43_arch_lwip_begin();
     altcp_arg(connection->pcb, (void *)connection);
     cyw43_arch_lwip_end();
@@ -170,6 +534,7 @@ static bool connect_to_host(struct connection_state *connection) {
     cyw43_arch_lwip_end();
 
     // Send connection request (SYN)
+    uint32_t connect_start_us = trace_now();
     cyw43_arch_lwip_begin();
     lwip_err_t lwip_err =
         altcp_connect(connection->pcb, &connection->ipaddr,
@@ -185,13 +550,53 @@ static bool connect_to_host(struct connection_state *connection) {
         //  Sucessful connection will be confirmed shortly in
         //  callback_altcp_connect.
         //
-        while (!(connection->connected))
-            sleep_ms(HTTPS_ALTCP_CONNECT_POLL_INTERVAL_MS);
-        log_info("HTTP SYN-ACK packet received successfully");
+        //  The TLS layer only reports the end of the handshake, so the end
+        //  of the TCP handshake is found by polling the inner TCP state.
+        //
+        uint32_t established_us = 0;
+        while (!(connection->connected) &&
+               connection->received_err == ERR_INPROGRESS) {
+            if (established_us == 0) {
+                cyw43_arch_lwip_begin();
+                if (connection->pcb &&
+                    altcp_dbg_get_tcp_state(connection->pcb) == ESTABLISHED)
+                    established_us = trace_now();
+                cyw43_arch_lwip_end();
+                sched_wait(SCHED_EVENT_NETWORK,
+                           HTTPS_TCP_CONNECT_POLL_INTERVAL_MS);
+            } else {
+                sched_wait(SCHED_EVENT_NETWORK,
+                           HTTPS_ALTCP_CONNECT_POLL_INTERVAL_MS);
+            }
+        }
+        if (connection->connected) {
+            if (established_us == 0)
+                established_us = connection->trace_connected_us;
+            trace_record(TRACE_TCP_CONNECT, connect_start_us, established_us);
+            trace_record(TRACE_TLS_HANDSHAKE, established_us,
+                         connection->trace_connected_us);
+            log_info("HTTP SYN-ACK packet received successfully");
+        } else {
+            lwip_err = connection->received_err;
+            log_warn("Connecting to %s failed", connection->hostname);
+        }
     } else {
         log_warn("HTTP SYN packet sending failed");
     }
 
+    if (lwip_err != ERR_OK) {
+        cyw43_arch_lwip_begin();
+        if (connection->pcb)
+            altcp_abort(connection->pcb);
+        altcp_tls_free_config(config);
+        cyw43_arch_lwip_end();
+        connection->pcb = NULL;
+        connection->config = NULL;
+        reset_tls_arena(connection);
+        // Try another A record next time
+        resolver_report_failure(connection->hostname, &connection->ipaddr);
+    }
+
     // Return
     return !((bool)lwip_err);
 }
@@ -200,8 +605,9 @@ static bool connect_to_host(struct connection_state *connection) {
 static bool send_request(struct connection_state *connection) {
     // Write to send buffer
     cyw43_arch_lwip_begin();
-    lwip_err_t lwip_err = altcp_write(connection->pcb, connection->request,
-                                      strlen(connection->request), 0);
+    lwip_err_t lwip_err =
+        altcp_write(connection->pcb, connection->http_request,
+                    strlen(connection->http_request), 0);
     cyw43_arch_lwip_end();
 
     // Written to send buffer
@@ -220,10 +626,11 @@ static bool send_request(struct connection_state *connection) {
             for (; connection->send_acknowledged_bytes == 0 &&
                    shots < HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_SHOTS;
                  ++shots)
-                sleep_ms(HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_INTERVAL_MS);
+                sched_wait(SCHED_EVENT_NETWORK,
+                           HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_INTERVAL_MS);
             if (shots == HTTPS_HTTP_SEND_ACKNOWLEDGE_POLL_SHOTS ||
                 connection->send_acknowledged_bytes !=
-                    strlen(connection->request))
+                    strlen(connection->http_request))
                 lwip_err = -1;
         }
     }
@@ -235,13 +642,13 @@ static bool send_request(struct connection_state *connection) {
 // Initialise Pico W wireless hardware
 void init_cyw43(void) {
     log_debug("Initializing CYW43");
+    mbedtls_platform_set_calloc_free(tls_calloc, tls_free);
     cyw43_arch_init_with_country(CYW43_COUNTRY_CZECH_REPUBLIC);
 }
 
 // Connect to wireless network
 void connect_to_wifi(const char *ssid, const char *passwd) {
-    log_debug("Connecting to wireless network %s with password %s", ssid,
-              passwd);
+    log_debug("Connecting to wireless network %s", ssid);
     cyw43_arch_lwip_begin();
     cyw43_arch_enable_sta_mode();
     cyw43_arch_wifi_connect_timeout_ms(ssid, passwd, CYW43_AUTH_WPA2_AES_PSK,
@@ -251,53 +658,163 @@ void connect_to_wifi(const char *ssid, const char *passwd) {
 
 struct connection_state *init_connection(const char *hostname, const char *cert,
                                          size_t cert_len, const char *request) {
-    // These are big structs, so rather allocate on heap
+    // These are big structs with their TLS arenas, allocated statically so
+    // that their memory is accounted for at link time
+    assert(state.connection_count < HTTPS_MAX_CONNECTIONS);
     struct connection_state *connection =
-        malloc(sizeof(struct connection_state));
+        &state.connections[state.connection_count++];
+    arena_init(&connection->tls_arena, connection->tls_arena_buffer,
+               sizeof(connection->tls_arena_buffer));
     connection->hostname = hostname;
     connection->cert = cert;
     connection->cert_len = cert_len;
     connection->request = request;
     connection->pcb = NULL;
+    connection->config = NULL;
+    connection->task = NULL;
+    connection->etag[0] = '\0';
+    connection->last_modified[0] = '\0';
 
-    resolve_hostname(&connection->ipaddr, hostname);
+    // Start resolving in the background, the first query picks it up
+    cyw43_arch_lwip_begin();
+    resolver_lookup(hostname, NULL, NULL);
+    cyw43_arch_lwip_end();
     return connection;
 }
 
-bool query_connection(struct connection_state *connection) {
+// Also the number of its replay fixture
+static unsigned connection_index(const struct connection_state *connection) {
+    return connection - state.connections;
+}
+
+// Prepare decoding of the next response
+static void reset_response(struct connection_state *connection) {
+    connection->received_err = ERR_INPROGRESS;
+    connection->http_response_offset = 0;
+    connection->http_header_line_len = 0;
+    connection->http_status = 0;
+    connection->http_content_length = -1;
+    connection->http_chunked = false;
+    connection->transfer_state = HTTP_TRANSFER_HEADER;
+    connection->body_received = 0;
+    connection->chunk_left = 0;
+    connection->chunk_extension = false;
+    connection->content_encoding = HTTP_ENCODING_IDENTITY;
+    connection->inflate_done = false;
+    connection->braces_open = 0;
+    connection->braces_closed = 0;
+    connection->http_response[0] = '\0';
+    connection->trace_first_byte_us = 0;
+    connection->trace_last_byte_us = 0;
+}
+
+// Whether a complete response carries a new body
+static bool response_ok(const struct connection_state *connection) {
+    if (connection->http_status == HTTP_STATUS_NOT_MODIFIED) {
+        log_info("%s not modified", connection->hostname);
+        return false;
+    }
+    if (connection->http_status != HTTP_STATUS_OK) {
+        log_warn("Unexpected HTTP status %u from %s", connection->http_status,
+                 connection->hostname);
+        return false;
+    }
+    return true;
+}
+
+static bool query(struct connection_state *connection) {
+    // The waits below yield to the other tasks
+    connection->task = sched_current();
+    if (connection->pcb && connection->remote_closed) {
+        log_debug("%s closed the idle connection", connection->hostname);
+        close_connection(connection);
+    }
     if (!connection->pcb) {
         // Establish new TCP + TLS connection with server
         while (!connect_to_host(connection)) {
-            sleep_ms(HTTPS_HTTP_RESPONSE_POLL_INTERVAL_MS);
+            sched_sleep_ms(HTTPS_HTTP_RESPONSE_POLL_INTERVAL_MS);
         }
     }
 
-    connection->received_err = ERR_INPROGRESS;
-    connection->http_response_offset = 0;
-    memset(connection->http_response, '\0', HTTPS_RESPONSE_MAX_SIZE);
+    reset_response(connection);
+    build_request(connection);
+    replay_capture_begin();
+    uint32_t send_start_us = trace_now();
     bool send_success = send_request(connection);
     if (!send_success) {
         log_warn("HTTP request sending failed");
     } else {
+        // Acknowledgement time from the callback, the wait above polls
+        uint32_t sent_us = connection->trace_sent_us;
+        trace_record(TRACE_REQUEST_SEND, send_start_us, sent_us);
         // Await HTTP response
         log_debug("Awaiting HTTP response");
         while (connection->received_err == ERR_INPROGRESS) {
-            sleep_ms(HTTPS_HTTP_RESPONSE_POLL_INTERVAL_MS);
+            sched_wait(SCHED_EVENT_NETWORK,
+                       HTTPS_HTTP_RESPONSE_POLL_INTERVAL_MS);
         }
         log_info("Got HTTP response");
+        if (connection->trace_first_byte_us && connection->trace_last_byte_us) {
+            trace_record(TRACE_FIRST_BYTE, sent_us,
+                         connection->trace_first_byte_us);
+            trace_record(TRACE_LAST_BYTE, connection->trace_first_byte_us,
+                         connection->trace_last_byte_us);
+        }
     }
+    replay_capture_end(connection_index(connection),
+                       connection->received_err == ERR_OK);
 
     if (connection->received_err == ERR_OK) {
-        return true;
+        // Keep the connection open, the server is fine
+        return response_ok(connection);
     } else {
         log_warn("Received HTTP response status is not OK. Closing HTTP "
                  "connection");
-        // Close connection
-        cyw43_arch_lwip_begin();
-        altcp_tls_free_config(connection->config);
-        altcp_close(connection->pcb);
-        cyw43_arch_lwip_end();
-        connection->pcb = NULL;
+        close_connection(connection);
+        // Transport errors may mean the host moved, the HTTP errors do not
+        if (connection->received_err != ERR_VAL)
+            resolver_report_failure(connection->hostname, &connection->ipaddr);
+        return false;
+    }
+}
+
+// Receives played data as the receive callback does
+static bool feed_response(void *arg, const char *data, size_t length) {
+    struct connection_state *connection = (struct connection_state *)arg;
+    if (connection->trace_first_byte_us == 0)
+        connection->trace_first_byte_us = trace_now();
+    if (!consume_response(connection, data, length))
+        connection->received_err = ERR_VAL;
+    else
+        connection->received_err = response_status(connection);
+    if (connection->received_err == ERR_INPROGRESS)
+        return true;
+    connection->trace_last_byte_us = trace_now();
+    return false;
+}
+
+// The next response of the fixture instead of the network, see replay.h
+static bool replay_query(struct connection_state *connection) {
+    reset_response(connection);
+    uint32_t start_us = trace_now();
+    if (!replay_play(connection_index(connection), feed_response,
+                     connection))
+        return false;
+    if (connection->received_err != ERR_OK) {
+        log_warn("Played response of %s is incomplete", connection->hostname);
         return false;
     }
+    trace_record(TRACE_FIRST_BYTE, start_us, connection->trace_first_byte_us);
+    trace_record(TRACE_LAST_BYTE, connection->trace_first_byte_us,
+                 connection->trace_last_byte_us);
+    return response_ok(connection);
+}
+
+bool query_connection(struct connection_state *connection) {
+    if (REPLAY_MODE == REPLAY_PLAY)
+        return replay_query(connection);
+    state.tls_arena = &connection->tls_arena;
+    bool updated = query(connection);
+    state.tls_arena = NULL;
+    return updated;
 }
@@ -0,0 +1,278 @@
+#include "hardware/sync.h"
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include "log.h"
+#include "ntp.h"
+#include "resolver.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NTP_MSG_LEN 48
+#define NTP_PORT 123
+#define NTP_DELTA 2208988800ll // Seconds between 1 Jan 1900 and 1 Jan 1970
+#define NTP_LI_VN_MODE_CLIENT 0x23 // No leap warning, version 4, client
+#define NTP_MODE_MASK 0x07
+#define NTP_MODE_SERVER 4
+#define NTP_LI_UNSYNCHRONIZED 0xc0
+#define NTP_MAX_STRATUM 15
+#define NTP_OFFSET_ORIGIN 24
+#define NTP_OFFSET_RECEIVE 32
+#define NTP_OFFSET_TRANSMIT 40
+
+// UTC = utc_ref_us + elapsed, corrected by frequency_ppb and by up to
+// NTP_SLEW_RATE_PPM of the elapsed time towards slew_us
+struct ntp_clock {
+    uint64_t mono_ref_us; // time_us_64() at utc_ref_us
+    int64_t utc_ref_us;
+    int32_t frequency_ppb;
+    int64_t slew_us; // Offset still to be slewed in
+};
+
+struct ntp_sample {
+    int64_t offset_us;
+    int64_t delay_us;
+    uint64_t mono_us; // When received
+    int64_t utc_us;   // Clock reading when received
+};
+
+struct ntp_state {
+    struct udp_pcb *pcb;
+    async_at_time_worker_t worker;
+    struct ntp_clock clock;
+    atomic_bool synchronized;
+    uint64_t last_update_us; // time_us_64() of the last applied sample
+
+    // Burst in progress
+    ip_addr_t server;
+    bool have_server;
+    unsigned sent;
+    bool waiting;
+    uint64_t request_mono_us;
+    uint8_t request_timestamp[8];
+    struct ntp_sample best;
+    unsigned samples;
+};
+static struct ntp_state state;
+
+static int64_t clock_at(const struct ntp_clock *clock, uint64_t mono_us,
+                        int64_t *slewed_us) {
+    int64_t elapsed = mono_us - clock->mono_ref_us;
+    int64_t slew = elapsed * NTP_SLEW_RATE_PPM / 1000000;
+    if (slew > llabs(clock->slew_us))
+        slew = llabs(clock->slew_us);
+    if (clock->slew_us < 0)
+        slew = -slew;
+    if (slewed_us)
+        *slewed_us = slew;
+    return clock->utc_ref_us + elapsed +
+           elapsed * clock->frequency_ppb / 1000000000 + slew;
+}
+
+static int64_t now_us(void) {
+    uint32_t irq = save_and_disable_interrupts();
+    int64_t utc_us = clock_at(&state.clock, time_us_64(), NULL);
+    restore_interrupts(irq);
+    return utc_us;
+}
+
+// NTP era 0 ends in 2036, seconds below 2^31 are taken to be from era 1
+static int64_t ntp_to_utc_us(const uint8_t *timestamp) {
+    uint32_t seconds = timestamp[0] << 24 | timestamp[1] << 16 |
+                       timestamp[2] << 8 | timestamp[3];
+    uint32_t fraction = timestamp[4] << 24 | timestamp[5] << 16 |
+                        timestamp[6] << 8 | timestamp[7];
+    int64_t era_seconds = seconds < 0x80000000u ? seconds + (1ll << 32)
+                                                : (int64_t)seconds;
+    return (era_seconds - NTP_DELTA) * 1000000 +
+           (int64_t)(((uint64_t)fraction * 1000000) >> 32);
+}
+
+static void utc_us_to_ntp(int64_t utc_us, uint8_t *timestamp) {
+    uint32_t seconds = utc_us / 1000000 + NTP_DELTA;
+    uint32_t fraction = ((uint64_t)(utc_us % 1000000) << 32) / 1000000;
+    for (int i = 0; i < 4; ++i) {
+        timestamp[i] = seconds >> (24 - 8 * i);
+        timestamp[4 + i] = fraction >> (24 - 8 * i);
+    }
+}
+
+static void schedule(uint32_t ms) {
+    async_context_t *context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &state.worker);
+    async_context_add_at_time_worker_in_ms(context, &state.worker, ms);
+}
+
+// Discipline the clock with the best sample of a burst
+static void apply_sample(const struct ntp_sample *sample) {
+    uint64_t mono_us = time_us_64();
+    uint32_t irq = save_and_disable_interrupts();
+    struct ntp_clock *clock = &state.clock;
+
+    // Fold the correction so far into the reference point
+    int64_t slewed;
+    int64_t utc_us = clock_at(clock, mono_us, &slewed);
+    clock->slew_us -= slewed;
+    // The sample was taken a while ago, carry it over to now
+    int64_t offset =
+        sample->utc_us + sample->offset_us + (mono_us - sample->mono_us) -
+        utc_us;
+    int64_t interval = mono_us - state.last_update_us;
+
+    bool step = !state.synchronized || llabs(offset) > NTP_STEP_THRESHOLD_US;
+    if (step) {
+        utc_us += offset;
+        clock->slew_us = 0;
+    } else {
+        // What the pending slew does not explain drifted since the last sync
+        if (interval >= NTP_MIN_FREQUENCY_INTERVAL_S * 1000000ll) {
+            int64_t frequency = clock->frequency_ppb +
+                                (offset - clock->slew_us) * 1000000000 /
+                                    interval;
+            if (frequency > NTP_MAX_FREQUENCY_PPB)
+                frequency = NTP_MAX_FREQUENCY_PPB;
+            if (frequency < -NTP_MAX_FREQUENCY_PPB)
+                frequency = -NTP_MAX_FREQUENCY_PPB;
+            clock->frequency_ppb = frequency;
+        }
+        clock->slew_us = offset;
+    }
+    clock->mono_ref_us = mono_us;
+    clock->utc_ref_us = utc_us;
+    state.last_update_us = mono_us;
+    int32_t frequency_ppb = clock->frequency_ppb;
+    restore_interrupts(irq);
+
+    state.synchronized = true;
+    log_info("NTP %s %lld us, delay %lld us, frequency %ld ppb",
+             step ? "stepped" : "slewing", (long long)offset,
+             (long long)sample->delay_us, (long)frequency_ppb);
+}
+
+static void send_request(void) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    if (!p)
+        return;
+    uint8_t *req = (uint8_t *)p->payload;
+    memset(req, 0, NTP_MSG_LEN);
+    req[0] = NTP_LI_VN_MODE_CLIENT;
+    // The server echoes it back as the origin timestamp
+    state.request_mono_us = time_us_64();
+    utc_us_to_ntp(now_us(), state.request_timestamp);
+    memcpy(req + NTP_OFFSET_TRANSMIT, state.request_timestamp,
+           sizeof(state.request_timestamp));
+    udp_sendto(state.pcb, p, &state.server, NTP_PORT);
+    pbuf_free(p);
+    state.waiting = true;
+    ++state.sent;
+}
+
+static void end_burst(void) {
+    if (state.samples) {
+        apply_sample(&state.best);
+        schedule(NTP_POLL_INTERVAL_S * 1000);
+    } else {
+        log_warn("No NTP response from %s", ipaddr_ntoa(&state.server));
+        // Try another A record next time
+        resolver_report_failure(NTP_SERVER, &state.server);
+        schedule(NTP_RETRY_INTERVAL_S * 1000);
+    }
+    state.have_server = false;
+    state.sent = 0;
+    state.samples = 0;
+}
+
+// The whole burst goes to one server, picked by the resolver
+static void ntp_dns_found(const char *hostname, const ip_addr_t *ipaddr,
+                          void *arg) {
+    if (ipaddr) {
+        state.server = *ipaddr;
+        state.have_server = true;
+        schedule(0);
+    } else {
+        log_error("NTP DNS request failed");
+        schedule(NTP_RETRY_INTERVAL_S * 1000);
+    }
+}
+
+// NTP data received
+static void ntp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                     const ip_addr_t *addr, u16_t port) {
+    uint64_t mono_us = time_us_64();
+    int64_t t4 = now_us();
+    uint8_t msg[NTP_MSG_LEN];
+    size_t len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+    pbuf_free(p);
+
+    // Only the answer to the outstanding request counts, the origin timestamp
+    // ties them together
+    if (!state.waiting || !ip_addr_cmp(addr, &state.server) ||
+        port != NTP_PORT || len != NTP_MSG_LEN ||
+        memcmp(msg + NTP_OFFSET_ORIGIN, state.request_timestamp,
+               sizeof(state.request_timestamp)) != 0)
+        return;
+    state.waiting = false;
+    uint8_t stratum = msg[1];
+    if ((msg[0] & NTP_MODE_MASK) != NTP_MODE_SERVER ||
+        (msg[0] & NTP_LI_UNSYNCHRONIZED) == NTP_LI_UNSYNCHRONIZED ||
+        stratum == 0 || stratum > NTP_MAX_STRATUM) {
+        log_warn("Invalid NTP response, stratum %u", stratum);
+        schedule(NTP_SAMPLE_SPACING_MS);
+        return;
+    }
+
+    int64_t t1 = clock_at(&state.clock, state.request_mono_us, NULL);
+    int64_t t2 = ntp_to_utc_us(msg + NTP_OFFSET_RECEIVE);
+    int64_t t3 = ntp_to_utc_us(msg + NTP_OFFSET_TRANSMIT);
+    struct ntp_sample sample = {
+        .offset_us = ((t2 - t1) + (t3 - t4)) / 2,
+        .delay_us = (t4 - t1) - (t3 - t2),
+        .mono_us = mono_us,
+        .utc_us = t4,
+    };
+    log_debug("NTP sample offset %lld us, delay %lld us",
+              (long long)sample.offset_us, (long long)sample.delay_us);
+    // The shortest round trip has the least asymmetry in it
+    if (state.samples == 0 || sample.delay_us < state.best.delay_us)
+        state.best = sample;
+    ++state.samples;
+    schedule(state.sent < NTP_BURST_SAMPLES ? NTP_SAMPLE_SPACING_MS : 0);
+}
+
+static void ntp_tick(async_context_t *context,
+                     async_at_time_worker_t *worker) {
+    if (!state.have_server) {
+        // The callback runs right away if the address is cached
+        resolver_lookup(NTP_SERVER, ntp_dns_found, NULL);
+        return;
+    }
+    if (state.waiting) {
+        log_debug("NTP request timed out");
+        state.waiting = false;
+    }
+    if (state.sent < NTP_BURST_SAMPLES) {
+        send_request();
+        schedule(NTP_RESPONSE_TIMEOUT_MS);
+    } else {
+        end_burst();
+    }
+}
+
+void ntp_init(void) {
+    cyw43_arch_lwip_begin();
+    state.pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    assert(state.pcb);
+    udp_recv(state.pcb, ntp_recv, NULL);
+    state.worker.do_work = ntp_tick;
+    schedule(0);
+    cyw43_arch_lwip_end();
+}
+
+bool ntp_synchronized(void) { return state.synchronized; }
+
+int64_t ntp_time_us(void) { return state.synchronized ? now_us() : 0; }
@@ -0,0 +1,202 @@
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+#include "DEV_Config.h"
+#include "LCD_Driver.h"
+#include "LCD_GUI.h"
+
+#include "backlight.h"
+#include "log.h"
+#include "power.h"
+#include "sched.h"
+#include "timebase.h"
+
+#include <stdio.h>
+
+#define MAX_POWER_LINE_STRING_LENGTH 48
+
+struct power_state {
+    critical_section_t cs;
+    enum power_mode mode;
+    bool radio_active;
+    uint64_t last_touch_us;
+    uint64_t last_refresh_us;
+    // Accumulated since start_us up to accounted_us
+    uint64_t start_us;
+    uint64_t accounted_us;
+    uint64_t radio_active_us;
+};
+static struct power_state state;
+
+static const char *const mode_names[] = {"active", "idle", "dark"};
+
+// Integrate the current state up to now, with the lock held
+static void account(uint64_t now) {
+    if (state.radio_active)
+        state.radio_active_us += now - state.accounted_us;
+    state.accounted_us = now;
+}
+
+static const uint16_t backlight_scales[] = {
+    [POWER_ACTIVE] = POWER_BACKLIGHT_ACTIVE,
+    [POWER_IDLE] = POWER_BACKLIGHT_IDLE,
+    [POWER_DARK] = POWER_BACKLIGHT_DARK,
+};
+
+static void set_radio(bool active) {
+    cyw43_arch_lwip_begin();
+    int err = cyw43_wifi_pm(&cyw43_state, active ? CYW43_PERFORMANCE_PM
+                                                 : CYW43_AGGRESSIVE_PM);
+    cyw43_arch_lwip_end();
+    if (err != 0)
+        log_warn("Failed to set the Wi-Fi power mode: %d", err);
+
+    critical_section_enter_blocking(&state.cs);
+    account(timebase_now_us());
+    state.radio_active = active;
+    critical_section_exit(&state.cs);
+}
+
+void power_init(void) {
+    critical_section_init(&state.cs);
+    uint64_t now = timebase_now_us();
+    state.start_us = now;
+    state.accounted_us = now;
+    state.last_touch_us = now;
+    state.mode = POWER_ACTIVE;
+    set_radio(false);
+}
+
+static bool night(void) {
+    struct timebase_local local;
+    timebase_local(&local);
+    int hour = local.tm.tm_hour;
+    if (POWER_NIGHT_START_HOUR <= POWER_NIGHT_END_HOUR)
+        return hour >= POWER_NIGHT_START_HOUR && hour < POWER_NIGHT_END_HOUR;
+    return hour >= POWER_NIGHT_START_HOUR || hour < POWER_NIGHT_END_HOUR;
+}
+
+void power_tick(void) {
+    // Outside the lock, it takes the time zone table
+    bool dark = night();
+
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    enum power_mode mode = state.mode;
+    if (mode == POWER_ACTIVE &&
+        now - state.last_touch_us >= POWER_IDLE_TIMEOUT_S * 1000000ull)
+        mode = POWER_IDLE;
+    // Only a touch makes the display active again
+    if (mode != POWER_ACTIVE)
+        mode = dark ? POWER_DARK : POWER_IDLE;
+    enum power_mode previous = state.mode;
+    state.mode = mode;
+    critical_section_exit(&state.cs);
+
+    if (mode != previous)
+        log_info("Display %s", mode_names[mode]);
+    // Also undoes a dimming that raced with a wake
+    backlight_tick(backlight_scales[state.mode]);
+}
+
+bool power_wake(void) {
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    state.last_touch_us = now;
+    bool woken = state.mode != POWER_ACTIVE;
+    state.mode = POWER_ACTIVE;
+    critical_section_exit(&state.cs);
+    // Outside the lock, the backlight has its own
+    if (woken)
+        backlight_set_scale(POWER_BACKLIGHT_ACTIVE);
+    return woken;
+}
+
+bool power_refresh_due(void) {
+    critical_section_enter_blocking(&state.cs);
+    uint64_t now = timebase_now_us();
+    bool due;
+    switch (state.mode) {
+    case POWER_ACTIVE:
+        due = true;
+        break;
+    case POWER_IDLE:
+        due = now - state.last_refresh_us >= POWER_IDLE_REFRESH_S * 1000000ull;
+        break;
+    default:
+        due = false;
+        break;
+    }
+    if (due)
+        state.last_refresh_us = now;
+    critical_section_exit(&state.cs);
+    return due;
+}
+
+bool power_display_on(void) { return state.mode != POWER_DARK; }
+
+uint32_t power_update_interval_ms(void) {
+    switch (state.mode) {
+    case POWER_ACTIVE:
+        return POWER_UPDATE_INTERVAL_MS;
+    case POWER_IDLE:
+        return POWER_IDLE_UPDATE_INTERVAL_MS;
+    default:
+        return POWER_DARK_UPDATE_INTERVAL_MS;
+    }
+}
+
+void power_network_begin(void) { set_radio(true); }
+
+void power_network_end(void) { set_radio(false); }
+
+static uint16_t permille(uint64_t part, uint64_t whole) {
+    if (whole == 0)
+        return 0;
+    uint64_t value = part * 1000 / whole;
+    return value > 1000 ? 1000 : value;
+}
+
+void power_get(struct power_report *report) {
+    critical_section_enter_blocking(&state.cs);
+    account(timebase_now_us());
+    uint64_t elapsed = state.accounted_us - state.start_us;
+    report->mode = state.mode;
+    report->elapsed_s = elapsed / 1000000;
+    report->busy = permille(sched_busy_us(), elapsed);
+    report->radio = permille(state.radio_active_us, elapsed);
+    critical_section_exit(&state.cs);
+    report->backlight = backlight_average();
+
+    // mA times permille is uA
+    uint64_t current_ua =
+        POWER_CURRENT_BASE_MA * 1000ull +
+        POWER_CURRENT_BUSY_MA * report->busy +
+        POWER_CURRENT_RADIO_ACTIVE_MA * report->radio +
+        POWER_CURRENT_RADIO_SAVE_MA * (1000ull - report->radio) +
+        POWER_CURRENT_BACKLIGHT_MA * report->backlight;
+    report->energy_mwh = current_ua * POWER_SUPPLY_MV / 1000000;
+}
+
+void power_dump(void) {
+    struct power_report report;
+    power_get(&report);
+    printf("power mode=%s up=%lus busy=%u.%u%% radio=%u.%u%% "
+           "backlight=%u.%u%% energy=%lumWh/h\n",
+           mode_names[report.mode], (unsigned long)report.elapsed_s,
+           report.busy / 10, report.busy % 10, report.radio / 10,
+           report.radio % 10, report.backlight / 10, report.backlight % 10,
+           (unsigned long)report.energy_mwh);
+}
+
+void power_render(void) {
+    struct power_report report;
+    power_get(&report);
+    char line[MAX_POWER_LINE_STRING_LENGTH];
+    // Fixed width so the line overwrites the previous values
+    snprintf(line, sizeof(line), "busy %2u.%u%% wifi %2u.%u%% %4lumWh/h",
+             report.busy / 10, report.busy % 10, report.radio / 10,
+             report.radio % 10, (unsigned long)report.energy_mwh);
+    GUI_DisString_EN(20, 300, line, &Font16, LCD_BACKGROUND, BLACK);
+}
@@ -0,0 +1,191 @@
+#include "pico/stdlib.h"
+
+#include "ff.h"
+
+#include "log.h"
+#include "replay.h"
+#include "sched.h"
+#include "storage.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct replay_state {
+#if REPLAY_MODE == REPLAY_RECORD
+    // Segments as they go into the file, written from the receive callback
+    uint8_t capture[REPLAY_CAPTURE_SIZE];
+    volatile size_t captured;
+    volatile uint16_t segment_count;
+    volatile bool capturing;
+    volatile bool overflow;
+    uint32_t capture_start_us;
+#endif
+    uint32_t next_offset[REPLAY_MAX_FIXTURES]; // Of the response played next
+    char data[REPLAY_READ_SIZE];
+};
+static struct replay_state state;
+
+static void file_name(char *name, unsigned fixture) {
+    snprintf(name, REPLAY_FILE_NAME_SIZE, REPLAY_FILE_FORMAT, fixture);
+}
+
+#if REPLAY_MODE == REPLAY_RECORD
+
+void replay_capture_begin(void) {
+    state.capturing = false;
+    state.captured = 0;
+    state.segment_count = 0;
+    state.overflow = false;
+    state.capture_start_us = time_us_32();
+    state.capturing = true;
+}
+
+void replay_capture(const void *data, size_t length) {
+    if (!state.capturing || state.overflow)
+        return;
+    struct replay_segment segment = {
+        .offset_us = time_us_32() - state.capture_start_us,
+        .length = length,
+    };
+    size_t captured = state.captured;
+    if (captured + sizeof(segment) + length > REPLAY_CAPTURE_SIZE) {
+        state.overflow = true;
+        return;
+    }
+    memcpy(state.capture + captured, &segment, sizeof(segment));
+    memcpy(state.capture + captured + sizeof(segment), data, length);
+    state.captured = captured + sizeof(segment) + length;
+    ++state.segment_count;
+}
+
+void replay_capture_end(unsigned fixture, bool complete) {
+    // The receive callback runs on the same core, never in the middle of this
+    state.capturing = false;
+    if (!complete)
+        return;
+    if (state.overflow) {
+        log_warn("Response too large to record");
+        return;
+    }
+    if (fixture >= REPLAY_MAX_FIXTURES || !storage_mount())
+        return;
+
+    char name[REPLAY_FILE_NAME_SIZE];
+    file_name(name, fixture);
+    FIL file;
+    FRESULT result = f_open(&file, name, FA_WRITE | FA_OPEN_ALWAYS);
+    if (result != FR_OK) {
+        log_error("Failed to open %s: %d", name, result);
+        return;
+    }
+    if (f_size(&file) + sizeof(struct replay_response) + state.captured >
+        REPLAY_MAX_FILE_SIZE) {
+        f_close(&file);
+        log_debug("%s is full", name);
+        return;
+    }
+
+    struct replay_response response = {
+        .magic = REPLAY_MAGIC,
+        .version = REPLAY_VERSION,
+        .segment_count = state.segment_count,
+        .size = state.captured,
+    };
+    UINT written = 0;
+    UINT written_segments = 0;
+    result = f_lseek(&file, f_size(&file));
+    if (result == FR_OK)
+        result = f_write(&file, &response, sizeof(response), &written);
+    if (result == FR_OK)
+        result = f_write(&file, state.capture, state.captured,
+                         &written_segments);
+    FRESULT closed = f_close(&file);
+    if (result != FR_OK || closed != FR_OK || written != sizeof(response) ||
+        written_segments != state.captured) {
+        log_error("Failed to write %s: %d", name, result);
+        return;
+    }
+    log_debug("Recorded %u bytes in %u segments to %s",
+              (unsigned)state.captured, state.segment_count, name);
+}
+
+#endif
+
+// Read the header of the next response, from the start again after the last
+static bool next_response(FIL *file, unsigned fixture,
+                          struct replay_response *response) {
+    for (unsigned attempt = 0; attempt < 2; ++attempt) {
+        UINT read = 0;
+        FRESULT result = f_lseek(file, state.next_offset[fixture]);
+        if (result == FR_OK)
+            result = f_read(file, response, sizeof(*response), &read);
+        if (result != FR_OK)
+            return false;
+        if (read == sizeof(*response)) {
+            if (response->magic != REPLAY_MAGIC ||
+                response->version != REPLAY_VERSION) {
+                log_error("Invalid response in fixture %u", fixture);
+                return false;
+            }
+            state.next_offset[fixture] += sizeof(*response) + response->size;
+            return true;
+        }
+        if (state.next_offset[fixture] == 0)
+            return false;
+        state.next_offset[fixture] = 0;
+    }
+    return false;
+}
+
+// Wait until the time of the segment since the start
+static void pace(uint64_t start_us, uint32_t offset_us) {
+    if (!REPLAY_PACED)
+        return;
+    uint64_t due = start_us + offset_us;
+    uint64_t now = time_us_64();
+    // Other tasks run meanwhile, as while waiting for the network
+    if (due > now)
+        sched_sleep_ms((due - now + 999) / 1000);
+}
+
+bool replay_play(unsigned fixture, replay_feed_t feed, void *arg) {
+    if (fixture >= REPLAY_MAX_FIXTURES || !storage_mount())
+        return false;
+    char name[REPLAY_FILE_NAME_SIZE];
+    file_name(name, fixture);
+    FIL file;
+    if (f_open(&file, name, FA_READ) != FR_OK) {
+        log_warn("No fixture %s", name);
+        return false;
+    }
+    struct replay_response response;
+    if (!next_response(&file, fixture, &response)) {
+        f_close(&file);
+        log_warn("No response in %s", name);
+        return false;
+    }
+
+    uint64_t start_us = time_us_64();
+    bool feeding = true;
+    for (unsigned i = 0; i < response.segment_count && feeding; ++i) {
+        struct replay_segment segment;
+        UINT read;
+        if (f_read(&file, &segment, sizeof(segment), &read) != FR_OK ||
+            read != sizeof(segment))
+            break;
+        pace(start_us, segment.offset_us);
+        // Longer segments are fed in pieces, the decoder keeps its state
+        for (uint32_t left = segment.length; left > 0 && feeding;) {
+            UINT size = MIN(left, sizeof(state.data));
+            if (f_read(&file, state.data, size, &read) != FR_OK ||
+                read != size) {
+                feeding = false;
+                break;
+            }
+            feeding = feed(arg, state.data, size);
+            left -= size;
+        }
+    }
+    f_close(&file);
+    return true;
+}
@@ -0,0 +1,442 @@
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include "log.h"
+#include "resolver.h"
+#include "sched.h"
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define DNS_PORT 53
+#define DNS_MSG_MAX_LEN 512 // Plain UDP DNS, no EDNS
+#define DNS_NAME_MAX_LEN 256
+#define DNS_HEADER_LEN 12
+#define DNS_FLAG_RESPONSE 0x8000
+#define DNS_FLAG_RECURSION_DESIRED 0x0100
+#define DNS_RCODE_MASK 0x000f
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+
+struct resolver_waiter {
+    resolver_callback_fn callback;
+    void *arg;
+};
+
+struct resolver_entry {
+    const char *hostname; // NULL if the entry is free
+    ip_addr_t addresses[RESOLVER_MAX_ADDRESSES];
+    unsigned address_count; // 0 until resolved for the first time
+    unsigned current;       // Address handed out by lookups
+    absolute_time_t expires;
+    absolute_time_t last_used;
+
+    // Query in flight
+    bool pending;
+    uint16_t query_id;
+    unsigned attempts;
+    absolute_time_t deadline;
+    struct resolver_waiter waiters[RESOLVER_MAX_WAITERS];
+    unsigned waiter_count;
+
+    char restored_hostname[RESOLVER_HOSTNAME_LENGTH]; // Hostname points here
+};
+
+struct resolver_state {
+    struct udp_pcb *pcb;
+    async_at_time_worker_t worker;
+    struct resolver_entry entries[RESOLVER_MAX_HOSTS];
+};
+static struct resolver_state state;
+
+// Encode hostname as a sequence of labels, returns the length or 0 if invalid
+static size_t encode_name(uint8_t *out, size_t n, const char *hostname) {
+    size_t pos = 0;
+    while (*hostname) {
+        const char *dot = strchr(hostname, '.');
+        size_t label = dot ? (size_t)(dot - hostname) : strlen(hostname);
+        if (label == 0 || label > 63 || pos + label + 2 > n)
+            return 0;
+        out[pos++] = label;
+        memcpy(out + pos, hostname, label);
+        pos += label;
+        hostname += label + (dot ? 1 : 0);
+    }
+    out[pos++] = 0;
+    return pos;
+}
+
+// Returns the position after the name at pos, or 0 if malformed
+static size_t skip_name(const uint8_t *msg, size_t len, size_t pos) {
+    while (pos < len) {
+        uint8_t label = msg[pos];
+        if ((label & 0xc0) == 0xc0)
+            return pos + 2 <= len ? pos + 2 : 0; // Compression pointer
+        if (label == 0)
+            return pos + 1;
+        pos += label + 1;
+    }
+    return 0;
+}
+
+static uint16_t read_u16(const uint8_t *p) { return p[0] << 8 | p[1]; }
+
+static uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static struct resolver_entry *find_entry(const char *hostname) {
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i)
+        if (state.entries[i].hostname &&
+            strcmp(state.entries[i].hostname, hostname) == 0)
+            return &state.entries[i];
+    return NULL;
+}
+
+// Find the entry for hostname, reusing the least recently used one if needed
+static struct resolver_entry *get_entry(const char *hostname) {
+    struct resolver_entry *entry = find_entry(hostname);
+    if (entry)
+        return entry;
+
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i) {
+        struct resolver_entry *candidate = &state.entries[i];
+        if (candidate->pending)
+            continue;
+        if (!candidate->hostname) {
+            entry = candidate;
+            break;
+        }
+        if (!entry || absolute_time_diff_us(candidate->last_used,
+                                            entry->last_used) > 0)
+            entry = candidate;
+    }
+    if (!entry)
+        return NULL;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->hostname = hostname;
+    return entry;
+}
+
+// Complete all waiters, with the current address or NULL if there is none
+static void notify_waiters(struct resolver_entry *entry) {
+    const ip_addr_t *ipaddr =
+        entry->address_count ? &entry->addresses[entry->current] : NULL;
+    // Callbacks may start new lookups, so detach the waiters first
+    unsigned count = entry->waiter_count;
+    struct resolver_waiter waiters[RESOLVER_MAX_WAITERS];
+    memcpy(waiters, entry->waiters, sizeof(waiters));
+    entry->waiter_count = 0;
+    for (unsigned i = 0; i < count; ++i)
+        waiters[i].callback(entry->hostname, ipaddr, waiters[i].arg);
+}
+
+// Send a query, each attempt goes to the next configured DNS server
+static void send_query(struct resolver_entry *entry) {
+    const ip_addr_t *server = NULL;
+    for (unsigned i = 0; i < DNS_MAX_SERVERS && !server; ++i) {
+        const ip_addr_t *candidate =
+            dns_getserver((entry->attempts + i) % DNS_MAX_SERVERS);
+        if (!ip_addr_isany(candidate))
+            server = candidate;
+    }
+
+    entry->pending = true;
+    ++entry->attempts;
+    entry->deadline = make_timeout_time_ms(RESOLVER_QUERY_TIMEOUT_MS);
+    if (!server) {
+        log_warn("No DNS server to resolve %s", entry->hostname);
+        return;
+    }
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, DNS_MSG_MAX_LEN, PBUF_RAM);
+    if (!p) {
+        log_warn("Failed to allocate DNS query");
+        return;
+    }
+    uint8_t *msg = (uint8_t *)p->payload;
+    entry->query_id = LWIP_RAND();
+    memset(msg, 0, DNS_HEADER_LEN);
+    msg[0] = entry->query_id >> 8;
+    msg[1] = entry->query_id;
+    msg[2] = DNS_FLAG_RECURSION_DESIRED >> 8;
+    msg[5] = 1; // One question
+    size_t len = encode_name(msg + DNS_HEADER_LEN,
+                             DNS_MSG_MAX_LEN - DNS_HEADER_LEN - 4,
+                             entry->hostname);
+    assert(len);
+    len += DNS_HEADER_LEN;
+    msg[len++] = 0;
+    msg[len++] = DNS_TYPE_A;
+    msg[len++] = 0;
+    msg[len++] = DNS_CLASS_IN;
+    pbuf_realloc(p, len);
+
+    log_debug("Resolving %s", entry->hostname);
+    udp_sendto(state.pcb, p, server, DNS_PORT);
+    pbuf_free(p);
+}
+
+// Query gave up, keep serving the old addresses if there are any
+static void query_failed(struct resolver_entry *entry) {
+    entry->pending = false;
+    entry->attempts = 0;
+    if (entry->address_count) {
+        log_warn("Failed to refresh %s, keeping the old addresses",
+                 entry->hostname);
+        entry->expires = make_timeout_time_ms(RESOLVER_RETRY_BACKOFF_S * 1000);
+    } else {
+        log_error("Failed to resolve %s", entry->hostname);
+    }
+    notify_waiters(entry);
+}
+
+// Parse the answer section, returns false if the response is unusable
+static bool parse_response(struct resolver_entry *entry, const uint8_t *msg,
+                           size_t len) {
+    uint16_t flags = read_u16(msg + 2);
+    if (!(flags & DNS_FLAG_RESPONSE) || (flags & DNS_RCODE_MASK) != 0 ||
+        read_u16(msg + 4) != 1)
+        return false;
+
+    // The question has to be ours
+    uint8_t name[DNS_NAME_MAX_LEN];
+    size_t name_len = encode_name(name, sizeof(name), entry->hostname);
+    assert(name_len);
+    size_t pos = DNS_HEADER_LEN;
+    if (pos + name_len + 4 > len)
+        return false;
+    for (size_t i = 0; i < name_len; ++i)
+        if (tolower(msg[pos + i]) != tolower(name[i]))
+            return false;
+    pos += name_len + 4;
+
+    // Parsed aside, the cached addresses are served until this succeeds
+    ip_addr_t addresses[RESOLVER_MAX_ADDRESSES];
+    unsigned count = 0;
+    uint32_t ttl = RESOLVER_MAX_TTL_S;
+    for (unsigned answers = read_u16(msg + 6); answers > 0; --answers) {
+        pos = skip_name(msg, len, pos);
+        if (pos == 0 || pos + 10 > len)
+            return false;
+        uint16_t type = read_u16(msg + pos);
+        uint16_t class = read_u16(msg + pos + 2);
+        uint32_t record_ttl = read_u32(msg + pos + 4);
+        uint16_t rdlength = read_u16(msg + pos + 8);
+        pos += 10;
+        if (pos + rdlength > len)
+            return false;
+        // CNAME records are followed by the A records of their target
+        if (type == DNS_TYPE_A && class == DNS_CLASS_IN && rdlength == 4 &&
+            count < RESOLVER_MAX_ADDRESSES) {
+            const uint8_t *a = msg + pos;
+            IP_ADDR4(&addresses[count], a[0], a[1], a[2], a[3]);
+            ++count;
+            if (record_ttl < ttl)
+                ttl = record_ttl;
+        }
+        pos += rdlength;
+    }
+    if (count == 0)
+        return false;
+
+    if (ttl < RESOLVER_MIN_TTL_S)
+        ttl = RESOLVER_MIN_TTL_S;
+    memcpy(entry->addresses, addresses, count * sizeof(addresses[0]));
+    entry->address_count = count;
+    entry->current = 0;
+    entry->expires = make_timeout_time_ms(ttl * 1000);
+    log_info("Resolved %s (%s, %u addresses, TTL %u s)", entry->hostname,
+             ipaddr_ntoa(&entry->addresses[0]), count, (unsigned)ttl);
+    return true;
+}
+
+// DNS response received
+static void resolver_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                          const ip_addr_t *addr, u16_t port) {
+    uint8_t msg[DNS_MSG_MAX_LEN];
+    size_t len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+    pbuf_free(p);
+    if (port != DNS_PORT || len < DNS_HEADER_LEN)
+        return;
+
+    uint16_t id = read_u16(msg);
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i) {
+        struct resolver_entry *entry = &state.entries[i];
+        if (!entry->pending || entry->query_id != id)
+            continue;
+        if (!parse_response(entry, msg, len)) {
+            // Let the timeout retry with the next server
+            log_warn("Invalid DNS response for %s", entry->hostname);
+            return;
+        }
+        entry->pending = false;
+        entry->attempts = 0;
+        notify_waiters(entry);
+        return;
+    }
+}
+
+// Periodic retries of lost queries and refreshes ahead of expiry
+static void resolver_tick(async_context_t *context,
+                          async_at_time_worker_t *worker) {
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i) {
+        struct resolver_entry *entry = &state.entries[i];
+        if (!entry->hostname)
+            continue;
+        if (entry->pending) {
+            if (!time_reached(entry->deadline))
+                continue;
+            if (entry->attempts < RESOLVER_QUERY_RETRIES)
+                send_query(entry);
+            else
+                query_failed(entry);
+        } else if (entry->address_count &&
+                   absolute_time_diff_us(get_absolute_time(),
+                                         entry->expires) <
+                       RESOLVER_REFRESH_MARGIN_S * 1000000ll) {
+            send_query(entry);
+        }
+    }
+    async_context_add_at_time_worker_in_ms(context, worker, RESOLVER_TICK_MS);
+}
+
+void resolver_init(void) {
+    cyw43_arch_lwip_begin();
+    state.pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    assert(state.pcb);
+    udp_recv(state.pcb, resolver_recv, NULL);
+    state.worker.do_work = resolver_tick;
+    async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(),
+                                           &state.worker, RESOLVER_TICK_MS);
+    cyw43_arch_lwip_end();
+}
+
+void resolver_lookup(const char *hostname, resolver_callback_fn callback,
+                     void *arg) {
+    struct resolver_entry *entry = get_entry(hostname);
+    if (!entry) {
+        log_error("Resolver cache is full, cannot resolve %s", hostname);
+        if (callback)
+            callback(hostname, NULL, arg);
+        return;
+    }
+    entry->last_used = get_absolute_time();
+
+    // Stale addresses are served while the refresh is in flight
+    if (entry->address_count) {
+        if (callback)
+            callback(hostname, &entry->addresses[entry->current], arg);
+        return;
+    }
+
+    if (callback) {
+        if (entry->waiter_count == RESOLVER_MAX_WAITERS) {
+            log_error("Too many lookups of %s in flight", hostname);
+            callback(hostname, NULL, arg);
+            return;
+        }
+        entry->waiters[entry->waiter_count++] =
+            (struct resolver_waiter){callback, arg};
+    }
+    if (!entry->pending)
+        send_query(entry);
+}
+
+struct blocking_lookup {
+    ip_addr_t ipaddr;
+    bool found;
+    atomic_bool done;
+};
+
+static void blocking_lookup_found(const char *hostname,
+                                  const ip_addr_t *ipaddr, void *arg) {
+    struct blocking_lookup *lookup = (struct blocking_lookup *)arg;
+    if (ipaddr) {
+        lookup->ipaddr = *ipaddr;
+        lookup->found = true;
+    }
+    lookup->done = true;
+}
+
+bool resolver_resolve(const char *hostname, ip_addr_t *ipaddr) {
+    struct blocking_lookup lookup = {.found = false, .done = false};
+    cyw43_arch_lwip_begin();
+    resolver_lookup(hostname, blocking_lookup_found, &lookup);
+    cyw43_arch_lwip_end();
+
+    // Waiters are always completed, at the latest once all retries time out
+    while (!lookup.done)
+        sched_sleep_ms(RESOLVER_POLL_INTERVAL_MS);
+    if (lookup.found)
+        *ipaddr = lookup.ipaddr;
+    return lookup.found;
+}
+
+void resolver_report_failure(const char *hostname, const ip_addr_t *ipaddr) {
+    cyw43_arch_lwip_begin();
+    struct resolver_entry *entry = find_entry(hostname);
+    if (entry && entry->address_count &&
+        ip_addr_cmp(ipaddr, &entry->addresses[entry->current])) {
+        entry->current = (entry->current + 1) % entry->address_count;
+        log_info("Failing over %s to %s", hostname,
+                 ipaddr_ntoa(&entry->addresses[entry->current]));
+        // All addresses failed, the records are probably outdated
+        if (entry->current == 0 && !entry->pending)
+            send_query(entry);
+    }
+    cyw43_arch_lwip_end();
+}
+
+void resolver_save(struct resolver_snapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    cyw43_arch_lwip_begin();
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i) {
+        const struct resolver_entry *entry = &state.entries[i];
+        struct resolver_snapshot_host *host = &snapshot->hosts[i];
+        if (!entry->hostname || !entry->address_count ||
+            strlen(entry->hostname) >= sizeof(host->hostname))
+            continue;
+        strcpy(host->hostname, entry->hostname);
+        for (unsigned j = 0; j < entry->address_count; ++j) {
+            const ip_addr_t *address = &entry->addresses[j];
+            host->addresses[j] = ip4_addr_get_u32(ip_2_ip4(address));
+        }
+        host->address_count = entry->address_count;
+    }
+    cyw43_arch_lwip_end();
+}
+
+void resolver_restore(const struct resolver_snapshot *snapshot) {
+    cyw43_arch_lwip_begin();
+    for (size_t i = 0; i < RESOLVER_MAX_HOSTS; ++i) {
+        const struct resolver_snapshot_host *host = &snapshot->hosts[i];
+        if (host->hostname[0] == '\0' || host->address_count == 0 ||
+            host->address_count > RESOLVER_MAX_ADDRESSES ||
+            !memchr(host->hostname, '\0', sizeof(host->hostname)))
+            continue;
+        struct resolver_entry *entry = get_entry(host->hostname);
+        if (!entry || entry->address_count)
+            continue;
+
+        // The snapshot does not outlive this call
+        strcpy(entry->restored_hostname, host->hostname);
+        entry->hostname = entry->restored_hostname;
+        for (unsigned j = 0; j < host->address_count; ++j)
+            ip_addr_set_ip4_u32(&entry->addresses[j], host->addresses[j]);
+        entry->address_count = host->address_count;
+        entry->current = 0;
+        // Already due, the first tick refreshes it
+        entry->expires = get_absolute_time();
+        entry->last_used = get_absolute_time();
+        log_info("Restored %s (%s)", entry->hostname,
+                 ipaddr_ntoa(&entry->addresses[0]));
+    }
+    cyw43_arch_lwip_end();
+}
@@ -0,0 +1,219 @@
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+#include "log.h"
+#include "sched.h"
+
+#include <stdio.h>
+
+struct sched_task {
+    const char *name;
+    enum sched_priority priority;
+    uint32_t period_us;
+    sched_run_t run;
+    uint64_t deadline_us; // Of the next period, 0 without one
+    uint32_t events;      // Pending, under the lock
+    uint64_t signalled_us; // Of the first pending event
+    bool running; // Also while nested tasks run on top of it
+    uint32_t runs;
+    uint64_t run_us;
+    uint32_t max_run_us;
+    uint32_t max_latency_us;
+};
+
+struct sched_state {
+    critical_section_t cs;
+    struct sched_task tasks[SCHED_MAX_TASKS];
+    unsigned task_count;
+    struct sched_task *current;
+    // Time of the nested tasks and of waiting within the current task
+    uint64_t nested_us;
+    uint64_t busy_us;
+};
+static struct sched_state state;
+
+static const char *const priority_names[] = {"low", "normal", "high"};
+
+void sched_init(void) { critical_section_init(&state.cs); }
+
+struct sched_task *sched_add(const char *name, enum sched_priority priority,
+                             uint32_t period_ms, sched_run_t run) {
+    assert(state.task_count < SCHED_MAX_TASKS);
+    struct sched_task *task = &state.tasks[state.task_count++];
+    task->name = name;
+    task->priority = priority;
+    task->period_us = period_ms * 1000;
+    task->run = run;
+    return task;
+}
+
+void sched_signal(struct sched_task *task, uint32_t events) {
+    if (task == NULL)
+        return;
+    critical_section_enter_blocking(&state.cs);
+    if (task->events == 0)
+        task->signalled_us = time_us_64();
+    task->events |= events;
+    critical_section_exit(&state.cs);
+    // Wakes the core if it is just going to sleep
+    __sev();
+}
+
+struct sched_task *sched_current(void) { return state.current; }
+
+// When the task became ready, UINT64_MAX if it is not
+static uint64_t ready_since(const struct sched_task *task, uint64_t now) {
+    uint64_t since = UINT64_MAX;
+    if (task->events != 0)
+        since = task->signalled_us;
+    if (task->deadline_us != 0 && task->deadline_us <= now)
+        since = MIN(since, task->deadline_us);
+    return since;
+}
+
+// The ready task of at least the priority to run next, NULL if there is none
+static struct sched_task *pick(unsigned min_priority) {
+    uint64_t now = time_us_64();
+    struct sched_task *best = NULL;
+    uint64_t best_since = UINT64_MAX;
+    critical_section_enter_blocking(&state.cs);
+    for (unsigned i = 0; i < state.task_count; ++i) {
+        struct sched_task *task = &state.tasks[i];
+        if (task->running || task->priority < min_priority)
+            continue;
+        uint64_t since = ready_since(task, now);
+        if (since == UINT64_MAX)
+            continue;
+        if (best == NULL || task->priority > best->priority ||
+            (task->priority == best->priority && since < best_since)) {
+            best = task;
+            best_since = since;
+        }
+    }
+    critical_section_exit(&state.cs);
+    return best;
+}
+
+static void dispatch(struct sched_task *task) {
+    critical_section_enter_blocking(&state.cs);
+    uint64_t start = time_us_64();
+    uint64_t ready = ready_since(task, start);
+    uint32_t events = task->events;
+    task->events = 0;
+    critical_section_exit(&state.cs);
+    if (task->deadline_us != 0 && task->deadline_us <= start) {
+        events |= SCHED_EVENT_TIMER;
+        // Missed periods are dropped, not run in a burst
+        task->deadline_us += task->period_us;
+        if (task->deadline_us <= start)
+            task->deadline_us = start + task->period_us;
+    }
+
+    struct sched_task *parent = state.current;
+    uint64_t parent_nested_us = state.nested_us;
+    state.current = task;
+    state.nested_us = 0;
+    task->running = true;
+    task->run(events);
+    task->running = false;
+    uint64_t total = time_us_64() - start;
+    uint64_t own = total - state.nested_us;
+    state.current = parent;
+    state.nested_us = parent_nested_us + total;
+
+    ++task->runs;
+    task->run_us += own;
+    state.busy_us += own;
+    task->max_run_us = MAX(task->max_run_us, own);
+    task->max_latency_us = MAX(task->max_latency_us, start - ready);
+}
+
+// Sleep until an interrupt or the next period of a task of at least the
+// priority, but not past until
+static void idle(unsigned min_priority, uint64_t until) {
+    uint64_t wake = until;
+    for (unsigned i = 0; i < state.task_count; ++i) {
+        const struct sched_task *task = &state.tasks[i];
+        if (!task->running && task->priority >= min_priority &&
+            task->deadline_us != 0)
+            wake = MIN(wake, task->deadline_us);
+    }
+    uint64_t start = time_us_64();
+    if (wake > start)
+        best_effort_wfe_or_timeout(from_us_since_boot(wake));
+    state.nested_us += time_us_64() - start;
+}
+
+void sched_run(void) {
+    uint64_t now = time_us_64();
+    for (unsigned i = 0; i < state.task_count; ++i) {
+        struct sched_task *task = &state.tasks[i];
+        if (task->period_us != 0)
+            task->deadline_us = now + task->period_us;
+    }
+    log_info("Scheduling %u tasks", state.task_count);
+    while (true) {
+        struct sched_task *task = pick(SCHED_LOW);
+        if (task)
+            dispatch(task);
+        else
+            idle(SCHED_LOW, UINT64_MAX);
+    }
+}
+
+uint32_t sched_wait(uint32_t events, uint32_t timeout_ms) {
+    struct sched_task *task = state.current;
+    if (task == NULL) {
+        sleep_ms(timeout_ms);
+        return 0;
+    }
+    uint64_t until = time_us_64() + timeout_ms * 1000ull;
+    while (true) {
+        critical_section_enter_blocking(&state.cs);
+        uint32_t signalled = task->events & events;
+        task->events &= ~signalled;
+        critical_section_exit(&state.cs);
+        if (signalled != 0)
+            return signalled;
+        if (time_us_64() >= until)
+            return 0;
+        struct sched_task *other = pick(task->priority + 1);
+        if (other)
+            dispatch(other);
+        else
+            idle(task->priority + 1, until);
+    }
+}
+
+uint64_t sched_busy_us(void) { return state.busy_us; }
+
+unsigned sched_get(struct sched_stats *stats, unsigned max) {
+    for (unsigned i = 0; i < state.task_count && i < max; ++i) {
+        const struct sched_task *task = &state.tasks[i];
+        stats[i] = (struct sched_stats){
+            .name = task->name,
+            .priority = task->priority,
+            .runs = task->runs,
+            .run_us = task->run_us,
+            .max_run_us = task->max_run_us,
+            .max_latency_us = task->max_latency_us,
+        };
+    }
+    return state.task_count;
+}
+
+void sched_dump(void) {
+    struct sched_stats stats[SCHED_MAX_TASKS];
+    unsigned count = sched_get(stats, SCHED_MAX_TASKS);
+    for (unsigned i = 0; i < count; ++i) {
+        const struct sched_stats *task = &stats[i];
+        printf("task %s priority=%s runs=%lu total=%lums mean=%luus "
+               "max=%luus latency_max=%luus\n",
+               task->name, priority_names[task->priority],
+               (unsigned long)task->runs,
+               (unsigned long)(task->run_us / 1000),
+               (unsigned long)(task->runs ? task->run_us / task->runs : 0),
+               (unsigned long)task->max_run_us,
+               (unsigned long)task->max_latency_us);
+    }
+}
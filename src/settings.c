@@ -0,0 +1,347 @@
+#include "hardware/flash.h"
+#include "hardware/watchdog.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+#include "crc32.h"
+#include "log.h"
+#include "sched.h"
+#include "settings.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FLASH_OFFSET                                                           \
+    (PICO_FLASH_SIZE_BYTES - SETTINGS_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+#define SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / SETTINGS_SLOT_SIZE)
+#define SLOT_COUNT (SETTINGS_FLASH_SECTORS * SLOTS_PER_SECTOR)
+// Programmed at once, the rest of the slot stays erased
+#define RECORD_FLASH_SIZE                                                      \
+    ((sizeof(struct settings_record) + FLASH_PAGE_SIZE - 1) /                  \
+     FLASH_PAGE_SIZE * FLASH_PAGE_SIZE)
+
+#ifndef WIFI_SSID
+#define WIFI_SSID ""
+#endif
+#ifndef WIFI_PASSWORD
+#define WIFI_PASSWORD ""
+#endif
+#ifndef GOLEMIO_API_KEY
+#define GOLEMIO_API_KEY ""
+#endif
+
+static_assert(FLASH_SECTOR_SIZE % SETTINGS_SLOT_SIZE == 0,
+              "Slots fill the sectors");
+
+// End of the program in flash, from the linker script
+extern char __flash_binary_end;
+
+// Used until the first save
+static const struct settings defaults = {
+    .wifi_ssid = WIFI_SSID,
+    .wifi_password = WIFI_PASSWORD,
+    .golemio_api_key = GOLEMIO_API_KEY,
+    .tram_stop = "U876Z1P",
+    .locations = {{"Praha", "50.07", "14.42"}},
+    .tram_lines = {"14", "18", "24"},
+};
+
+struct settings_state {
+    const struct settings *current;
+    int slot; // Of the current record, negative for the defaults
+    uint32_t sequence;
+    struct settings edited;
+    // Programming reads from RAM, never from the flash being written
+    uint8_t buffer[RECORD_FLASH_SIZE] __attribute__((aligned(4)));
+};
+static struct settings_state state;
+
+static const struct settings_record *slot_record(unsigned slot) {
+    return (const struct settings_record *)(XIP_BASE + FLASH_OFFSET +
+                                            slot * SETTINGS_SLOT_SIZE);
+}
+
+static bool slot_valid(unsigned slot) {
+    const struct settings_record *record = slot_record(slot);
+    return record->magic == SETTINGS_MAGIC &&
+           record->version == SETTINGS_VERSION &&
+           record->size == sizeof(record->settings) &&
+           crc32(0, &record->settings, sizeof(record->settings)) ==
+               record->crc;
+}
+
+static bool slot_erased(unsigned slot) {
+    const uint32_t *words = (const uint32_t *)slot_record(slot);
+    for (size_t i = 0; i < SETTINGS_SLOT_SIZE / sizeof(*words); ++i) {
+        if (words[i] != 0xffffffff)
+            return false;
+    }
+    return true;
+}
+
+void settings_init(void) {
+    assert((uintptr_t)&__flash_binary_end - XIP_BASE <= FLASH_OFFSET);
+    state.current = &defaults;
+    state.slot = -1;
+    for (unsigned slot = 0; slot < SLOT_COUNT; ++slot) {
+        if (!slot_valid(slot))
+            continue;
+        const struct settings_record *record = slot_record(slot);
+        if (state.slot >= 0 &&
+            (int32_t)(record->sequence - state.sequence) <= 0)
+            continue;
+        state.current = &record->settings;
+        state.slot = slot;
+        state.sequence = record->sequence;
+    }
+    if (state.slot < 0)
+        log_info("No saved settings, using the defaults");
+    else
+        log_info("Loaded settings %lu from slot %d",
+                 (unsigned long)state.sequence, state.slot);
+}
+
+const struct settings *settings_get(void) { return state.current; }
+
+bool settings_complete(void) {
+    const struct settings *settings = state.current;
+    return settings->wifi_ssid[0] != '\0' &&
+           settings->golemio_api_key[0] != '\0' &&
+           settings->tram_stop[0] != '\0' &&
+           settings->locations[0].latitude[0] != '\0';
+}
+
+struct flash_write {
+    uint32_t offset;
+    bool erase; // The whole sector first
+};
+
+// Runs with the flash out of execute-in-place, see flash_safe_execute
+static void __not_in_flash_func(write_flash)(void *param) {
+    const struct flash_write *write = param;
+    if (write->erase)
+        flash_range_erase(write->offset, FLASH_SECTOR_SIZE);
+    flash_range_program(write->offset, state.buffer, sizeof(state.buffer));
+}
+
+// The next slot after the current record that is still erased, a slot left
+// half written by a power loss is skipped. Entering a sector erases it.
+static bool save(const struct settings *settings) {
+    unsigned slot = state.slot < 0 ? 0 : (state.slot + 1) % SLOT_COUNT;
+    while (slot % SLOTS_PER_SECTOR != 0 && !slot_erased(slot))
+        slot = (slot + 1) % SLOT_COUNT;
+
+    struct settings_record *record = (struct settings_record *)state.buffer;
+    memset(state.buffer, 0xff, sizeof(state.buffer));
+    record->magic = SETTINGS_MAGIC;
+    record->sequence = state.sequence + 1;
+    record->version = SETTINGS_VERSION;
+    record->size = sizeof(*settings);
+    record->crc = crc32(0, settings, sizeof(*settings));
+    record->settings = *settings;
+
+    struct flash_write write = {
+        .offset = FLASH_OFFSET + slot * SETTINGS_SLOT_SIZE,
+        .erase = slot % SLOTS_PER_SECTOR == 0 && !slot_erased(slot),
+    };
+    int result = flash_safe_execute(write_flash, &write, UINT32_MAX);
+    if (result != PICO_OK) {
+        log_error("Failed to write the settings: %d", result);
+        return false;
+    }
+    if (!slot_valid(slot)) {
+        log_error("Settings in slot %u do not verify", slot);
+        return false;
+    }
+    state.current = &slot_record(slot)->settings;
+    state.slot = slot;
+    state.sequence = record->sequence;
+    return true;
+}
+
+// Only the fields a user sets, the lines are handled apart
+struct field {
+    const char *key;
+    size_t offset;
+    size_t size;
+    bool secret; // Not echoed back
+};
+
+#define FIELD(key, member, secret)                                             \
+    {key, offsetof(struct settings, member),                                   \
+     sizeof(((struct settings *)0)->member), secret}
+
+static const struct field fields[] = {
+    FIELD("ssid", wifi_ssid, false),
+    FIELD("password", wifi_password, true),
+    FIELD("api_key", golemio_api_key, true),
+    FIELD("stop", tram_stop, false),
+};
+
+static void show(const struct settings *settings) {
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        const char *value = (const char *)settings + fields[i].offset;
+        if (fields[i].secret && value[0] != '\0')
+            value = "(set)";
+        printf("%s=%s\n", fields[i].key, value);
+    }
+    for (size_t i = 0; i < WEATHER_MAX_LOCATIONS; ++i) {
+        const struct settings_location *location = &settings->locations[i];
+        printf("location%u=", (unsigned)i + 1);
+        if (location->latitude[0] != '\0')
+            printf("%s %s %s", location->name, location->latitude,
+                   location->longitude);
+        printf("\n");
+    }
+    printf("lines=");
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i) {
+        if (settings->tram_lines[i][0] != '\0')
+            printf("%s%s", i > 0 ? "," : "", settings->tram_lines[i]);
+    }
+    printf("\n");
+}
+
+// A comma separated list of route short names
+static bool set_lines(struct settings *settings, const char *value) {
+    char lines[TRAM_MAX_LINES][TRAM_LINE_NAME_SIZE] = {0};
+    for (size_t i = 0; *value != '\0'; ++i) {
+        size_t length = strcspn(value, ",");
+        if (i == TRAM_MAX_LINES || length == 0 ||
+            length >= TRAM_LINE_NAME_SIZE)
+            return false;
+        memcpy(lines[i], value, length);
+        value += length;
+        if (*value == ',')
+            ++value;
+    }
+    memcpy(settings->tram_lines, lines, sizeof(lines));
+    return true;
+}
+
+// These go into a query string unescaped
+static bool valid_value(const char *key, const char *value) {
+    const char *allowed = NULL;
+    if (strcmp(key, "coordinate") == 0)
+        allowed = "-.0123456789";
+    else if (strcmp(key, "stop") == 0)
+        allowed = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                  "0123456789";
+    return allowed == NULL || strspn(value, allowed) == strlen(value);
+}
+
+static bool copy_coordinate(char *coordinate, const char *value) {
+    if (value == NULL || strlen(value) >= SETTINGS_COORDINATE_SIZE ||
+        !valid_value("coordinate", value))
+        return false;
+    strcpy(coordinate, value);
+    return true;
+}
+
+// "<name> <latitude> <longitude>", or nothing to remove the location
+static bool set_location(struct settings_location *location, char *value) {
+    struct settings_location parsed = {0};
+    char *name = strtok(value, " ");
+    if (name != NULL) {
+        char *latitude = strtok(NULL, " ");
+        char *longitude = strtok(NULL, " ");
+        if (strtok(NULL, " ") != NULL || strlen(name) >= sizeof(parsed.name) ||
+            !copy_coordinate(parsed.latitude, latitude) ||
+            !copy_coordinate(parsed.longitude, longitude))
+            return false;
+        strcpy(parsed.name, name);
+    }
+    *location = parsed;
+    return true;
+}
+
+static bool set(struct settings *settings, const char *key, char *value) {
+    if (strcmp(key, "lines") == 0)
+        return set_lines(settings, value);
+    // location1 to location<WEATHER_MAX_LOCATIONS>
+    if (strncmp(key, "location", 8) == 0 && key[8] >= '1' &&
+        key[8] < '1' + WEATHER_MAX_LOCATIONS && key[9] == '\0')
+        return set_location(&settings->locations[key[8] - '1'], value);
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (strcmp(key, fields[i].key) != 0)
+            continue;
+        if (strlen(value) >= fields[i].size || !valid_value(key, value))
+            return false;
+        char *field = (char *)settings + fields[i].offset;
+        memset(field, 0, fields[i].size);
+        strcpy(field, value);
+        return true;
+    }
+    return false;
+}
+
+// The display keeps being redrawn while waiting for the user
+static int read_char(absolute_time_t deadline) {
+    int c;
+    while ((c = getchar_timeout_us(0)) == PICO_ERROR_TIMEOUT &&
+           !time_reached(deadline))
+        sched_sleep_ms(SETTINGS_CONSOLE_POLL_MS);
+    return c;
+}
+
+// Echoed as typed, false on timeout
+static bool read_line(char *line, size_t size) {
+    size_t length = 0;
+    while (true) {
+        int c = read_char(make_timeout_time_ms(SETTINGS_CONSOLE_TIMEOUT_MS));
+        if (c == PICO_ERROR_TIMEOUT)
+            return false;
+        if (c == '\r' || c == '\n') {
+            putchar('\n');
+            line[length] = '\0';
+            return true;
+        }
+        if ((c == '\b' || c == 0x7f) && length > 0) {
+            --length;
+            printf("\b \b");
+        } else if (isprint(c) && length + 1 < size) {
+            line[length++] = c;
+            putchar(c);
+        }
+    }
+}
+
+void settings_console(void) {
+    static char line[SETTINGS_LINE_MAX_SIZE];
+    state.edited = *state.current;
+    printf("Settings: show, set <key> <value>, save, exit\n");
+    while (true) {
+        printf("> ");
+        if (!read_line(line, sizeof(line))) {
+            printf("\nTimed out, changes discarded\n");
+            return;
+        }
+        char *command = strtok(line, " ");
+        if (command == NULL) {
+            continue;
+        } else if (strcmp(command, "show") == 0) {
+            show(&state.edited);
+        } else if (strcmp(command, "set") == 0) {
+            char *key = strtok(NULL, " ");
+            char *value = strtok(NULL, "");
+            char empty[] = "";
+            if (key == NULL || !set(&state.edited, key, value ? value : empty))
+                printf("Invalid setting\n");
+        } else if (strcmp(command, "save") == 0) {
+            if (!save(&state.edited)) {
+                printf("Failed to save\n");
+                continue;
+            }
+            // Everything built from the settings is built again
+            printf("Saved, restarting\n");
+            stdio_flush();
+            watchdog_reboot(0, 0, 0);
+            while (true)
+                tight_loop_contents();
+        } else if (strcmp(command, "exit") == 0) {
+            return;
+        } else {
+            printf("Unknown command %s\n", command);
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#include "ff.h"
+
+#include "crc32.h"
+#include "log.h"
+#include "snapshot.h"
+#include "storage.h"
+#include "timebase.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+static const char *const file_names[] = SNAPSHOT_FILE_NAMES;
+
+struct snapshot_state {
+    struct snapshot_record record; // Loaded, then the one to be written
+    bool loaded;
+    unsigned next_file;    // Written next, the older one
+    volatile bool pending; // record is waiting for snapshot_flush
+    uint64_t next_save_us;
+};
+static struct snapshot_state state;
+
+static uint32_t record_crc(struct snapshot_record *record) {
+    uint32_t saved = record->crc;
+    record->crc = 0;
+    uint32_t crc = crc32(0, record, sizeof(*record));
+    record->crc = saved;
+    return crc;
+}
+
+static bool read_record(const char *name, struct snapshot_record *record) {
+    FIL file;
+    if (f_open(&file, name, FA_READ) != FR_OK)
+        return false;
+    UINT read;
+    FRESULT result = f_read(&file, record, sizeof(*record), &read);
+    f_close(&file);
+    if (result != FR_OK || read != sizeof(*record))
+        return false;
+    // Another layout is not worth converting, it is rewritten soon
+    return record->magic == SNAPSHOT_MAGIC &&
+           record->version == SNAPSHOT_VERSION &&
+           record->size == sizeof(*record) && record_crc(record) == record->crc;
+}
+
+bool snapshot_restore(void) {
+    if (!storage_mount())
+        return false;
+
+    static struct snapshot_record candidate;
+    for (unsigned i = 0; i < 2; ++i) {
+        if (!read_record(file_names[i], &candidate)) {
+            log_debug("No valid snapshot in %s", file_names[i]);
+            continue;
+        }
+        if (state.loaded &&
+            (int32_t)(candidate.sequence - state.record.sequence) <= 0)
+            continue;
+        state.record = candidate;
+        state.loaded = true;
+        state.next_file = i ^ 1;
+    }
+    if (!state.loaded)
+        return false;
+
+    log_info("Restoring the state saved at %lld",
+             (long long)state.record.saved_utc);
+    weather_restore(&state.record.weather);
+    resolver_restore(&state.record.resolver);
+    return true;
+}
+
+void snapshot_restore_departures(void) {
+    if (state.loaded)
+        tram_restore(&state.record.tram);
+}
+
+void snapshot_save(void) {
+    uint64_t now = timebase_now_us();
+    if (state.pending || now < state.next_save_us)
+        return;
+    state.next_save_us = now + SNAPSHOT_INTERVAL_S * 1000000ull;
+
+    struct snapshot_record *record = &state.record;
+    uint32_t sequence = state.loaded ? record->sequence + 1 : 0;
+    memset(record, 0, sizeof(*record));
+    record->magic = SNAPSHOT_MAGIC;
+    record->version = SNAPSHOT_VERSION;
+    record->size = sizeof(*record);
+    record->sequence = sequence;
+    record->saved_utc = timebase_utc_us() / 1000000;
+    weather_save(&record->weather);
+    tram_save(&record->tram);
+    resolver_save(&record->resolver);
+    record->crc = record_crc(record);
+    state.loaded = true;
+    state.pending = true;
+}
+
+static void write_record(void) {
+    const char *name = file_names[state.next_file];
+    FIL file;
+    FRESULT result = f_open(&file, name, FA_WRITE | FA_CREATE_ALWAYS);
+    if (result != FR_OK) {
+        log_error("Failed to open %s: %d", name, result);
+        return;
+    }
+    UINT written;
+    result = f_write(&file, &state.record, sizeof(state.record), &written);
+    FRESULT closed = f_close(&file);
+    if (result != FR_OK || closed != FR_OK ||
+        written != sizeof(state.record)) {
+        log_error("Failed to write %s: %d", name, result);
+        return;
+    }
+    state.next_file ^= 1;
+    log_debug("Saved snapshot %lu to %s",
+              (unsigned long)state.record.sequence, name);
+}
+
+void snapshot_flush(void) {
+    if (!state.pending)
+        return;
+    if (storage_mount())
+        write_record();
+    // Only now the main loop may capture the next one into the record
+    state.pending = false;
+}
@@ -0,0 +1,97 @@
+#include "assets.h"
+#include "log.h"
+#include "sprites.h"
+
+#include <stddef.h>
+
+struct sprites_tile {
+    const struct asset *asset; // NULL while the slot is empty
+    uint32_t last_used;
+    uint16_t pixels[SPRITES_TILE_MAX_PIXELS]; // Big-endian RGB565
+};
+
+// A sprite currently on the screen
+struct sprites_placement {
+    const struct asset *asset;
+    uint16_t x;
+    uint16_t y;
+};
+
+struct sprites_state {
+    struct sprites_tile tiles[SPRITES_CACHE_SLOTS];
+    uint32_t clock;
+    struct sprites_placement placements[SPRITES_MAX_PLACEMENTS];
+    unsigned placement_count;
+    uint32_t hits;
+    uint32_t misses;
+};
+static struct sprites_state state;
+
+static struct sprites_placement *find_placement(uint16_t x, uint16_t y) {
+    for (unsigned i = 0; i < state.placement_count; ++i) {
+        if (state.placements[i].x == x && state.placements[i].y == y)
+            return &state.placements[i];
+    }
+    return NULL;
+}
+
+static void place(const struct asset *asset, uint16_t x, uint16_t y) {
+    struct sprites_placement *placement = find_placement(x, y);
+    if (placement == NULL) {
+        if (state.placement_count == SPRITES_MAX_PLACEMENTS)
+            return; // Not remembered, it is drawn again next time
+        placement = &state.placements[state.placement_count++];
+        placement->x = x;
+        placement->y = y;
+    }
+    placement->asset = asset;
+}
+
+static struct sprites_tile *load(const struct asset *asset) {
+    struct sprites_tile *victim = &state.tiles[0];
+    for (unsigned i = 0; i < SPRITES_CACHE_SLOTS; ++i) {
+        struct sprites_tile *tile = &state.tiles[i];
+        if (tile->asset == asset) {
+            ++state.hits;
+            tile->last_used = ++state.clock;
+            return tile;
+        }
+        if (tile->asset == NULL ||
+            (victim->asset != NULL && tile->last_used < victim->last_used))
+            victim = tile;
+    }
+
+    ++state.misses;
+    victim->asset = NULL;
+    if (!assets_decode(asset, victim->pixels, sizeof(victim->pixels)))
+        return NULL;
+    victim->asset = asset;
+    victim->last_used = ++state.clock;
+    log_debug("Loaded sprite %s, %lu hits, %lu misses", asset->name,
+              (unsigned long)state.hits, (unsigned long)state.misses);
+    return victim;
+}
+
+bool sprites_draw(const char *name, uint16_t x, uint16_t y) {
+    const struct asset *asset = assets_find(name);
+    if (asset == NULL) {
+        log_debug("No sprite %s", name);
+        return false;
+    }
+    if ((uint32_t)asset->width * asset->height > SPRITES_TILE_MAX_PIXELS) {
+        log_error("Sprite %s is too large", name);
+        return false;
+    }
+    struct sprites_placement *placement = find_placement(x, y);
+    if (placement != NULL && placement->asset == asset)
+        return true;
+
+    struct sprites_tile *tile = load(asset);
+    if (tile == NULL)
+        return false;
+    assets_blit(x, y, asset->width, asset->height, tile->pixels);
+    place(asset, x, y);
+    return true;
+}
+
+void sprites_invalidate(void) { state.placement_count = 0; }
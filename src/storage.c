@@ -0,0 +1,26 @@
+#include "ff.h"
+
+#include "log.h"
+#include "storage.h"
+
+struct storage_state {
+    FATFS fs;
+    bool tried;
+    bool mounted;
+};
+static struct storage_state state;
+
+bool storage_mount(void) {
+    if (state.tried)
+        return state.mounted;
+    state.tried = true;
+
+    FRESULT result = f_mount(&state.fs, "", 1);
+    if (result != FR_OK) {
+        log_warn("Failed to mount the SD card: %d", result);
+        return false;
+    }
+    state.mounted = true;
+    log_debug("Mounted the SD card");
+    return true;
+}
@@ -0,0 +1,64 @@
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#include "log.h"
+#include "ntp.h"
+#include "timebase.h"
+#include "tz.h"
+
+struct timebase_state {
+    // Local time of the second currently cached
+    struct timebase_local local;
+    bool local_valid;
+};
+static struct timebase_state state;
+
+void timebase_init(void) {
+    ntp_init();
+    while (!ntp_synchronized())
+        sleep_ms(TIMEBASE_SYNC_POLL_INTERVAL_MS);
+
+    struct timebase_local local;
+    timebase_local(&local);
+    log_info("Got NTP time: %02d/%02d/%04d %02d:%02d:%02d %s",
+             local.tm.tm_mday, local.tm.tm_mon + 1, local.tm.tm_year + 1900,
+             local.tm.tm_hour, local.tm.tm_min, local.tm.tm_sec,
+             local.abbreviation);
+}
+
+int64_t timebase_utc_us(void) { return ntp_time_us(); }
+
+uint64_t timebase_deadline_us(int64_t utc) {
+    uint64_t now_us = timebase_now_us();
+    int64_t remaining_us = utc * 1000000 - timebase_utc_us();
+    // Before boot the sum would wrap around to the far future
+    if (remaining_us < -(int64_t)now_us)
+        return now_us;
+    return now_us + remaining_us;
+}
+
+int64_t timebase_deadline_utc(uint64_t deadline_us) {
+    int64_t remaining_us = (int64_t)(deadline_us - timebase_now_us());
+    return (timebase_utc_us() + remaining_us) / 1000000;
+}
+
+void timebase_local(struct timebase_local *local) {
+    int64_t utc = timebase_utc_us() / 1000000;
+
+    uint32_t irq = save_and_disable_interrupts();
+    if (state.local_valid && state.local.utc == utc) {
+        *local = state.local;
+        restore_interrupts(irq);
+        return;
+    }
+    restore_interrupts(irq);
+
+    local->utc = utc;
+    tz_localtime(utc, &local->tm);
+    local->abbreviation = tz_abbreviation(utc);
+
+    irq = save_and_disable_interrupts();
+    state.local = *local;
+    state.local_valid = true;
+    restore_interrupts(irq);
+}
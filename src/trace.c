@@ -0,0 +1,191 @@
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#include "DEV_Config.h"
+#include "LCD_Driver.h"
+#include "LCD_GUI.h"
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_DIAGNOSTICS_LINE_STRING_LENGTH 48
+
+struct trace_event {
+    uint32_t start_us;
+    uint32_t duration_us;
+    uint8_t stage;
+};
+
+struct trace_histogram {
+    uint32_t count;
+    uint64_t sum_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint16_t buckets[TRACE_HISTOGRAM_BUCKETS]; // Saturating
+};
+
+struct trace_state {
+    struct trace_event events[TRACE_RING_SIZE];
+    uint32_t events_written;
+    struct trace_histogram histograms[TRACE_STAGE_COUNT];
+};
+static struct trace_state state;
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+    [TRACE_DNS] = "dns",
+    [TRACE_TCP_CONNECT] = "tcp_connect",
+    [TRACE_TLS_HANDSHAKE] = "tls_handshake",
+    [TRACE_REQUEST_SEND] = "request_send",
+    [TRACE_FIRST_BYTE] = "first_byte",
+    [TRACE_LAST_BYTE] = "last_byte",
+    [TRACE_JSON_PARSE] = "json_parse",
+    [TRACE_STATE_UPDATE] = "state_update",
+    [TRACE_RENDER_TIME] = "render_time",
+    [TRACE_RENDER_TRAM] = "render_tram",
+    [TRACE_RENDER_WEATHER] = "render_weather",
+};
+
+// Chrome trace rows: network, parsing, rendering
+static unsigned stage_thread(enum trace_stage stage) {
+    if (stage <= TRACE_LAST_BYTE)
+        return 1;
+    if (stage <= TRACE_STATE_UPDATE)
+        return 2;
+    return 3;
+}
+
+// Values below 2^SUB_BITS are exact, above that every power of two is split
+// into 2^SUB_BITS linear buckets
+static unsigned bucket_index(uint32_t value) {
+    if (value < (1u << TRACE_HISTOGRAM_SUB_BITS))
+        return value;
+    unsigned exponent = 31 - __builtin_clz(value);
+    unsigned sub = (value >> (exponent - TRACE_HISTOGRAM_SUB_BITS)) &
+                   ((1u << TRACE_HISTOGRAM_SUB_BITS) - 1);
+    return (exponent - TRACE_HISTOGRAM_SUB_BITS + 1)
+               << TRACE_HISTOGRAM_SUB_BITS |
+           sub;
+}
+
+static uint32_t bucket_lower_bound(unsigned index) {
+    if (index < (1u << TRACE_HISTOGRAM_SUB_BITS))
+        return index;
+    unsigned exponent =
+        (index >> TRACE_HISTOGRAM_SUB_BITS) + TRACE_HISTOGRAM_SUB_BITS - 1;
+    unsigned sub = index & ((1u << TRACE_HISTOGRAM_SUB_BITS) - 1);
+    return 1u << exponent | sub << (exponent - TRACE_HISTOGRAM_SUB_BITS);
+}
+
+// Lower bound of the bucket holding the given percentile
+static uint32_t percentile(const struct trace_histogram *histogram,
+                           unsigned percent) {
+    uint32_t rank = (uint64_t)histogram->count * percent / 100;
+    uint32_t seen = 0;
+    for (unsigned i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return bucket_lower_bound(i);
+    }
+    return histogram->max_us;
+}
+
+void trace_record(enum trace_stage stage, uint32_t start_us, uint32_t end_us) {
+    uint32_t duration = end_us - start_us;
+    uint32_t irq = save_and_disable_interrupts();
+
+    struct trace_event *event =
+        &state.events[state.events_written++ % TRACE_RING_SIZE];
+    event->start_us = start_us;
+    event->duration_us = duration;
+    event->stage = stage;
+
+    struct trace_histogram *histogram = &state.histograms[stage];
+    if (histogram->count == 0 || duration < histogram->min_us)
+        histogram->min_us = duration;
+    if (duration > histogram->max_us)
+        histogram->max_us = duration;
+    ++histogram->count;
+    histogram->sum_us += duration;
+    uint16_t *bucket = &histogram->buckets[bucket_index(duration)];
+    if (*bucket != UINT16_MAX)
+        ++*bucket;
+
+    restore_interrupts(irq);
+}
+
+static void copy_histogram(struct trace_histogram *out,
+                           enum trace_stage stage) {
+    uint32_t irq = save_and_disable_interrupts();
+    *out = state.histograms[stage];
+    restore_interrupts(irq);
+}
+
+void trace_dump_histograms(void) {
+    // One line per stage, e.g.
+    // trace dns n=12 min=3 p50=4 p90=6 p99=1024 max=1187 mean=95 b=8:10,40:2
+    for (unsigned stage = 0; stage < TRACE_STAGE_COUNT; ++stage) {
+        struct trace_histogram histogram;
+        copy_histogram(&histogram, stage);
+        if (histogram.count == 0)
+            continue;
+        printf("trace %s n=%lu min=%lu p50=%lu p90=%lu p99=%lu max=%lu "
+               "mean=%lu b=",
+               stage_names[stage], (unsigned long)histogram.count,
+               (unsigned long)histogram.min_us,
+               (unsigned long)percentile(&histogram, 50),
+               (unsigned long)percentile(&histogram, 90),
+               (unsigned long)percentile(&histogram, 99),
+               (unsigned long)histogram.max_us,
+               (unsigned long)(histogram.sum_us / histogram.count));
+        const char *separator = "";
+        for (unsigned i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+            if (histogram.buckets[i] == 0)
+                continue;
+            printf("%s%u:%u", separator, i, histogram.buckets[i]);
+            separator = ",";
+        }
+        printf("\n");
+    }
+}
+
+void trace_dump_chrome(void) {
+    uint32_t irq = save_and_disable_interrupts();
+    uint32_t end = state.events_written;
+    restore_interrupts(irq);
+    uint32_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+    printf("{\"traceEvents\":[\n");
+    for (uint32_t i = begin; i < end; ++i) {
+        irq = save_and_disable_interrupts();
+        struct trace_event event = state.events[i % TRACE_RING_SIZE];
+        restore_interrupts(irq);
+        printf("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+               "\"pid\":1,\"tid\":%u}%s\n",
+               stage_names[event.stage], (unsigned long)event.start_us,
+               (unsigned long)event.duration_us, stage_thread(event.stage),
+               i + 1 < end ? "," : "");
+    }
+    printf("]}\n");
+}
+
+void trace_render(void) {
+    // Fixed width lines, so they overwrite the previous values
+    char header[MAX_DIAGNOSTICS_LINE_STRING_LENGTH];
+    snprintf(header, sizeof(header), "%-14s %4s %6s %6s %6s", "stage", "n",
+             "p50ms", "p90ms", "maxms");
+    GUI_DisString_EN(20, 10, header, &Font16, LCD_BACKGROUND, BLACK);
+    for (unsigned stage = 0; stage < TRACE_STAGE_COUNT; ++stage) {
+        struct trace_histogram histogram;
+        copy_histogram(&histogram, stage);
+        char line[MAX_DIAGNOSTICS_LINE_STRING_LENGTH];
+        snprintf(line, sizeof(line), "%-14s %4lu %6lu %6lu %6lu",
+                 stage_names[stage], (unsigned long)histogram.count,
+                 (unsigned long)percentile(&histogram, 50) / 1000,
+                 (unsigned long)percentile(&histogram, 90) / 1000,
+                 (unsigned long)histogram.max_us / 1000);
+        GUI_DisString_EN(20, 30 + 20 * stage, line, &Font16, LCD_BACKGROUND,
+                         BLUE);
+    }
+}
@@ -1,86 +1,107 @@
-#include "hardware/rtc.h"
 #include "pico/stdlib.h"
-#include "pico/sync.h"
-#include "pico/util/datetime.h"
 
 #include "DEV_Config.h"
 #include "LCD_Driver.h"
 #include "LCD_GUI.h"
 #include "LCD_Touch.h"
 
+#include "doublebuf.h"
+#include "log.h"
 #include "network.h"
+#include "settings.h"
 #include "tiny-json.h"
+#include "timebase.h"
+#include "trace.h"
 #include "tram.h"
+#include "tz.h"
 
 #include <string.h>
 
 #define MAX_TRAM_LINE_STRING_LENGTH 40
 
-#define MAX_RECORDS_PER_LINE 4
+// What the display shows, double-buffered, see doublebuf.h
+struct tram_model {
+    // Predicted departures as monotonic deadlines, see timebase.h, 0 if
+    // there are fewer
+    uint64_t departures[TRAM_MAX_LINES][TRAM_MAX_RECORDS_PER_LINE];
+    bool stale; // Restored from the last run, not updated yet
+};
+
 struct tram_state {
-    critical_section_t cs;
-    struct tm tram14[MAX_RECORDS_PER_LINE];
-    struct tm tram18[MAX_RECORDS_PER_LINE];
-    struct tm tram24[MAX_RECORDS_PER_LINE];
+    const char *lines[TRAM_MAX_LINES]; // From the settings, empty if unused
+    struct doublebuf buffer;
+    struct tram_model models[2];
+    char request[HTTPS_TRAM_REQUEST_MAX_SIZE];
 };
 static struct tram_state state;
 
-static void fill_string_arrivals(char *str, size_t n, struct tm *current_tm,
-                                 struct tm *trams) {
+static void fill_string_arrivals(char *str, size_t n, uint64_t now_us,
+                                 const uint64_t *trams) {
     size_t ind = 0;
-    for (size_t i = 0; i < MAX_RECORDS_PER_LINE && trams[i].tm_year != 0; ++i) {
-        struct tm diff_tm = {
-            .tm_year = trams[i].tm_year - current_tm->tm_year,
-            .tm_mon = trams[i].tm_mon - current_tm->tm_mon,
-            .tm_mday = trams[i].tm_mday - current_tm->tm_mday,
-            .tm_wday = trams[i].tm_wday - current_tm->tm_wday,
-            .tm_hour = trams[i].tm_hour - current_tm->tm_hour,
-            .tm_min = trams[i].tm_min - current_tm->tm_min,
-            .tm_sec = trams[i].tm_sec - current_tm->tm_sec,
-        };
-        mktime(&diff_tm);
-
-        // If the tram has already arrived, mktime will convert the negative
-        // difference into large minutes
-        if (diff_tm.tm_min >= 15)
+    for (size_t i = 0; i < TRAM_MAX_RECORDS_PER_LINE && trams[i] != 0;
+         ++i) {
+        // Already departed
+        if (trams[i] < now_us)
+            continue;
+        uint64_t diff = (trams[i] - now_us) / 1000000;
+        if (diff >= 15 * 60)
             break;
 
-        if (i != 0)
+        if (ind != 0)
             ind += snprintf(str + ind, n - ind, ", ");
-        if (diff_tm.tm_min != 0)
-            ind += snprintf(str + ind, n - ind, "%dm", diff_tm.tm_min);
-        ind += snprintf(str + ind, n - ind, "%ds", diff_tm.tm_sec);
+        if (diff >= 60)
+            ind += snprintf(str + ind, n - ind, "%dm", (int)(diff / 60));
+        ind += snprintf(str + ind, n - ind, "%ds", (int)(diff % 60));
     }
 }
 
-void init_tram(void) { critical_section_init(&state.cs); }
+void init_tram(void) {
+    const struct settings *settings = settings_get();
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i)
+        state.lines[i] = settings->tram_lines[i];
+    int length = snprintf(state.request, sizeof(state.request),
+                          HTTPS_TRAM_REQUEST_FORMAT, settings->tram_stop,
+                          settings->golemio_api_key);
+    assert(length > 0 && length < sizeof(state.request));
+}
+
+const char *tram_request(void) { return state.request; }
+
+// Index of a tracked line, negative if it is not tracked
+static int find_line(const char *name) {
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i) {
+        if (state.lines[i][0] != '\0' && strcmp(state.lines[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
 
-void update_tram(const char *http_response) {
-    const char *json_start = strchr(http_response, '{'); // First occurence of {
+void update_tram(char *http_response) {
+    char *json_start = strchr(http_response, '{'); // First occurence of {
     assert(json_start != NULL);
-    const char *json_end = strrchr(http_response, '}'); // Last occurence of }
+    char *json_end = strrchr(json_start, '}'); // Last occurence of }
     assert(json_end != NULL);
 
-    // Create null-terminated string with just JSON
-    char json_response_str[HTTPS_RESPONSE_MAX_SIZE];
-    memset(json_response_str, '\0', sizeof(json_response_str));
-    memcpy(json_response_str, json_start, json_end - json_start + 1);
-
-    json_t pool[MAX_JSON_FIELDS];
-    const json_t *json = json_create(json_response_str, pool, MAX_JSON_FIELDS);
+    // Parse the JSON in place, the response buffer is rewritten by the next
+    // query anyway. The pool is static to keep it off the stack.
+    json_end[1] = '\0';
+    static json_t pool[MAX_JSON_FIELDS];
+    uint32_t parse_start_us = trace_now();
+    const json_t *json = json_create(json_start, pool, MAX_JSON_FIELDS);
+    trace_record(TRACE_JSON_PARSE, parse_start_us, trace_now());
     assert(json);
+    TRACE_SCOPE(TRACE_STATE_UPDATE);
 
     const json_t *departures_field = json_getProperty(json, "departures");
     assert(json_getType(departures_field) == JSON_ARRAY);
 
-    size_t tram14_index = 0;
-    size_t tram18_index = 0;
-    size_t tram24_index = 0;
+    size_t counts[TRAM_MAX_LINES] = {0};
 
-    critical_section_enter_blocking(&state.cs);
-    memset(state.tram14, 0, sizeof(state.tram14));
-    memset(state.tram18, 0, sizeof(state.tram18));
-    memset(state.tram24, 0, sizeof(state.tram24));
+    // Filled in private, the renderers keep the published one meanwhile
+    struct tram_model *model =
+        doublebuf_begin(&state.buffer, state.models, sizeof(state.models[0]));
+    memset(model->departures, 0, sizeof(model->departures));
+    model->stale = false;
 
     for (const json_t *departure_field = json_getChild(departures_field);
          departure_field != NULL;
@@ -98,58 +119,86 @@ void update_tram(const char *http_response) {
         const json_t *predicted_field =
             json_getProperty(arrival_field, "predicted");
         assert(json_getType(predicted_field) == JSON_TEXT);
-        char *predicted = (char *)json_getValue(predicted_field);
-
-        struct tm tm;
-        memset(&tm, 0, sizeof(tm));
-        for (size_t i = 0; i < strlen(predicted); ++i)
-            if (predicted[i] == 'T')
-                predicted[i] = ' ';
-        strptime(predicted, "%Y-%m-%d %T+01:00", &tm);
+        const char *predicted = json_getValue(predicted_field);
 
-        if (strcmp(short_name, "14") == 0) {
-            state.tram14[tram14_index++] = tm;
-        }
-        if (strcmp(short_name, "18") == 0) {
-            state.tram18[tram18_index++] = tm;
-        }
-        if (strcmp(short_name, "24") == 0) {
-            state.tram24[tram24_index++] = tm;
+        // Carries its own UTC offset, which changes with DST
+        int64_t utc;
+        if (!tz_parse_iso8601(predicted, &utc)) {
+            log_warn("Invalid departure time %s", predicted);
+            continue;
         }
+
+        // Already departed, would only take the place of a later one
+        if (utc * 1000000 <= timebase_utc_us())
+            continue;
+
+        int line = find_line(short_name);
+        if (line >= 0 && counts[line] < TRAM_MAX_RECORDS_PER_LINE)
+            model->departures[line][counts[line]++] = timebase_deadline_us(utc);
     }
-    critical_section_exit(&state.cs);
+    doublebuf_publish(&state.buffer);
 }
 
 void render_tram(void) {
-    datetime_t t;
-    rtc_get_datetime(&t);
-    struct tm current_tm = {.tm_year = t.year,
-                            .tm_mon = t.month,
-                            .tm_mday = t.day,
-                            .tm_wday = t.dotw,
-                            .tm_hour = t.hour,
-                            .tm_min = t.min,
-                            .tm_sec = t.sec};
-
-    critical_section_enter_blocking(&state.cs);
+    TRACE_SCOPE(TRACE_RENDER_TRAM);
+    uint64_t now_us = timebase_now_us();
+
+    // Static to keep it off the stack, only the render task draws
+    static struct tram_model model;
+    doublebuf_read(&state.buffer, &model, state.models, sizeof(model));
+    COLOR color = model.stale ? GRAY : BLACK;
     GUI_DrawRectangle(20, 140, 480, 200 + 24, WHITE, DRAW_FULL, DOT_PIXEL_DFT);
-    {
-        char outp_str[MAX_TRAM_LINE_STRING_LENGTH] = "14: ";
-        fill_string_arrivals(outp_str + 4, MAX_TRAM_LINE_STRING_LENGTH - 4,
-                             &current_tm, state.tram14);
-        GUI_DisString_EN(20, 140, outp_str, &Font24, LCD_BACKGROUND, BLACK);
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i) {
+        if (state.lines[i][0] == '\0')
+            continue;
+        char outp_str[MAX_TRAM_LINE_STRING_LENGTH];
+        int prefix = snprintf(outp_str, sizeof(outp_str), "%s: ",
+                              state.lines[i]);
+        fill_string_arrivals(outp_str + prefix,
+                             MAX_TRAM_LINE_STRING_LENGTH - prefix, now_us,
+                             model.departures[i]);
+        GUI_DisString_EN(20, 140 + 30 * i, outp_str, &Font24, LCD_BACKGROUND,
+                         color);
     }
-    {
-        char outp_str[MAX_TRAM_LINE_STRING_LENGTH] = "18: ";
-        fill_string_arrivals(outp_str + 4, MAX_TRAM_LINE_STRING_LENGTH - 4,
-                             &current_tm, state.tram18);
-        GUI_DisString_EN(20, 170, outp_str, &Font24, LCD_BACKGROUND, BLACK);
+}
+
+static void save_line(int64_t *out, const uint64_t *trams) {
+    for (size_t i = 0; i < TRAM_MAX_RECORDS_PER_LINE; ++i)
+        out[i] = trams[i] != 0 ? timebase_deadline_utc(trams[i]) : 0;
+}
+
+// Departures in the past are dropped, they have no monotonic deadline
+static void restore_line(uint64_t *trams, const int64_t *in, int64_t now) {
+    size_t count = 0;
+    memset(trams, 0, TRAM_MAX_RECORDS_PER_LINE * sizeof(trams[0]));
+    for (size_t i = 0; i < TRAM_MAX_RECORDS_PER_LINE && in[i] != 0; ++i) {
+        if (in[i] > now)
+            trams[count++] = timebase_deadline_us(in[i]);
     }
-    {
-        char outp_str[MAX_TRAM_LINE_STRING_LENGTH] = "24: ";
-        fill_string_arrivals(outp_str + 4, MAX_TRAM_LINE_STRING_LENGTH - 4,
-                             &current_tm, state.tram24);
-        GUI_DisString_EN(20, 200, outp_str, &Font24, LCD_BACKGROUND, BLACK);
+}
+
+void tram_save(struct tram_snapshot *snapshot) {
+    static struct tram_model model;
+    doublebuf_read(&state.buffer, &model, state.models, sizeof(model));
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i) {
+        strncpy(snapshot->lines[i], state.lines[i], TRAM_LINE_NAME_SIZE - 1);
+        save_line(snapshot->departures[i], model.departures[i]);
+    }
+}
+
+void tram_restore(const struct tram_snapshot *snapshot) {
+    int64_t now = timebase_utc_us() / 1000000;
+    struct tram_model *model =
+        doublebuf_begin(&state.buffer, state.models, sizeof(state.models[0]));
+    for (size_t i = 0; i < TRAM_MAX_LINES; ++i) {
+        if (snapshot->lines[i][0] == '\0' ||
+            !memchr(snapshot->lines[i], '\0', TRAM_LINE_NAME_SIZE))
+            continue;
+        int line = find_line(snapshot->lines[i]);
+        if (line >= 0)
+            restore_line(model->departures[line], snapshot->departures[i],
+                         now);
     }
-    critical_section_exit(&state.cs);
+    model->stale = true;
+    doublebuf_publish(&state.buffer);
 }
@@ -0,0 +1,155 @@
+#include "tz.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+#define SECONDS_PER_DAY 86400
+
+// Last transition at or before utc, or -1 if before all of them
+static long find_transition(int64_t utc) {
+    long low = 0;
+    long high = tz_transition_count;
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (tz_transitions[middle].utc <= utc)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low - 1;
+}
+
+int32_t tz_offset(int64_t utc) {
+    long i = find_transition(utc);
+    return i < 0 ? tz_initial_offset : tz_transitions[i].offset;
+}
+
+const char *tz_abbreviation(int64_t utc) {
+    long i = find_transition(utc);
+    return i < 0 ? tz_initial_abbreviation : tz_transitions[i].abbreviation;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, month 1 to 12
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned year_of_era = year - era * 400;
+    unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                           day - 1;
+    unsigned day_of_era =
+        year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+void tz_utc_to_tm(int64_t utc, int32_t offset, struct tm *tm) {
+    int64_t local = utc + offset;
+    int64_t days = local / SECONDS_PER_DAY;
+    int64_t seconds = local % SECONDS_PER_DAY;
+    if (seconds < 0) {
+        seconds += SECONDS_PER_DAY;
+        --days;
+    }
+    tm->tm_hour = seconds / 3600;
+    tm->tm_min = seconds / 60 % 60;
+    tm->tm_sec = seconds % 60;
+    // 1970-01-01 was a Thursday
+    tm->tm_wday = (days % 7 + 11) % 7;
+
+    // Inverse of days_from_civil, with years starting in March
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned day_of_era = z - era * 146097;
+    unsigned year_of_era = (day_of_era - day_of_era / 1460 +
+                            day_of_era / 36524 - day_of_era / 146096) /
+                           365;
+    unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 -
+                                         year_of_era / 100);
+    unsigned mp = (5 * day_of_year + 2) / 153;
+    unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = year_of_era + era * 400 + (month <= 2);
+    tm->tm_mday = day_of_year - (153 * mp + 2) / 5 + 1;
+    tm->tm_mon = month - 1;
+    tm->tm_year = year - 1900;
+    tm->tm_yday = days - days_from_civil(year, 1, 1);
+    tm->tm_isdst = 0;
+}
+
+int64_t tz_tm_to_utc(const struct tm *tm, int32_t offset) {
+    // Months out of range are normalised, the rest simply adds up
+    int64_t year = tm->tm_year + 1900 + tm->tm_mon / 12;
+    int month = tm->tm_mon % 12;
+    if (month < 0) {
+        month += 12;
+        --year;
+    }
+    int64_t days = days_from_civil(year, month + 1, 1) + tm->tm_mday - 1;
+    return days * SECONDS_PER_DAY + tm->tm_hour * 3600 + tm->tm_min * 60 +
+           tm->tm_sec - offset;
+}
+
+void tz_localtime(int64_t utc, struct tm *tm) {
+    tz_utc_to_tm(utc, tz_offset(utc), tm);
+}
+
+int64_t tz_local_to_utc(const struct tm *tm) {
+    int64_t local = tz_tm_to_utc(tm, 0);
+    // Offsets in effect a day around cover both sides of any transition
+    int32_t before = tz_offset(local - SECONDS_PER_DAY);
+    int32_t after = tz_offset(local + SECONDS_PER_DAY);
+    if (tz_offset(local - before) == before)
+        return local - before;
+    if (tz_offset(local - after) == after)
+        return local - after;
+    // In the gap, the earlier offset moves it forward
+    return local - before;
+}
+
+static bool parse_number(const char **str, unsigned digits, int *value) {
+    *value = 0;
+    for (unsigned i = 0; i < digits; ++i, ++*str) {
+        if (!isdigit((unsigned char)**str))
+            return false;
+        *value = *value * 10 + (**str - '0');
+    }
+    return true;
+}
+
+static bool expect(const char **str, char c) {
+    if (**str != c)
+        return false;
+    ++*str;
+    return true;
+}
+
+bool tz_parse_iso8601(const char *str, int64_t *utc) {
+    struct tm tm = {0};
+    int year, month, offset_hours, offset_minutes;
+    if (!parse_number(&str, 4, &year) || !expect(&str, '-') ||
+        !parse_number(&str, 2, &month) || !expect(&str, '-') ||
+        !parse_number(&str, 2, &tm.tm_mday) ||
+        !(expect(&str, 'T') || expect(&str, ' ')) ||
+        !parse_number(&str, 2, &tm.tm_hour) || !expect(&str, ':') ||
+        !parse_number(&str, 2, &tm.tm_min) || !expect(&str, ':') ||
+        !parse_number(&str, 2, &tm.tm_sec))
+        return false;
+    // Fractions of a second are dropped
+    if (expect(&str, '.'))
+        while (isdigit((unsigned char)*str))
+            ++str;
+
+    int32_t offset = 0;
+    if (!expect(&str, 'Z')) {
+        int sign = *str == '-' ? -1 : 1;
+        if (!(expect(&str, '+') || expect(&str, '-')) ||
+            !parse_number(&str, 2, &offset_hours) || !expect(&str, ':') ||
+            !parse_number(&str, 2, &offset_minutes))
+            return false;
+        offset = sign * (offset_hours * 3600 + offset_minutes * 60);
+    }
+    if (month < 1 || month > 12)
+        return false;
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    *utc = tz_tm_to_utc(&tm, offset);
+    return true;
+}
@@ -1,90 +1,502 @@
-#include "pico/sync.h"
+#include "pico/stdlib.h"
 
 #include "DEV_Config.h"
 #include "LCD_Driver.h"
 #include "LCD_GUI.h"
 #include "LCD_Touch.h"
 
+#include "chart.h"
+#include "doublebuf.h"
+#include "fixed.h"
+#include "json_reader.h"
+#include "log.h"
 #include "network.h"
-#include "tiny-json.h"
+#include "settings.h"
+#include "sprites.h"
+#include "timebase.h"
+#include "trace.h"
 #include "weather.h"
 
 #include <string.h>
 
 #define MAX_WEATHER_LINE_STRING_LENGTH 40
 
+struct weather_forecast {
+    int64_t start; // UTC epoch second of the first hour
+    unsigned hours; // 0 until the first update
+    // Tenths, CHART_MISSING where the response has null
+    int16_t temperature[WEATHER_FORECAST_HOURS]; // Of a degree C
+    int16_t precipitation[WEATHER_FORECAST_HOURS]; // Of a mm
+};
+
+// Parsed outside of the model, then copied in
+struct weather_update {
+    int32_t current_temp; // Tenths of a degree C
+    int32_t max_daily_temp;
+    int32_t current_precipitation; // Tenths of a mm
+    int32_t precipitation_sum;
+    int weather_code;
+    int is_day;
+    int64_t sunrise; // UTC epoch seconds, 0 if missing
+    int64_t sunset;
+    bool current; // The first location had current values
+    unsigned location_count;
+    struct weather_forecast forecasts[WEATHER_MAX_LOCATIONS];
+};
+
+// What the display shows, double-buffered, see doublebuf.h
+struct weather_model {
+    int32_t current_temp; // Tenths of a degree C
+    int32_t max_daily_temp;
+    int32_t current_precipitation; // Tenths of a mm
+    int32_t precipitation_sum;
+    int weather_code; // WMO code, negative until the first update
+    bool is_day;
+    int64_t sunrise; // UTC epoch seconds, 0 until the first update
+    int64_t sunset;
+    bool stale; // Restored from the last run, not updated yet
+    struct weather_forecast forecasts[WEATHER_MAX_LOCATIONS];
+};
+
 struct weather_state {
-    critical_section_t cs;
-    double current_temp;
-    double max_daily_temp;
-    double current_precipitation;
-    double precipitation_sum;
+    struct doublebuf buffer;
+    struct weather_model models[2];
+    const char *names[WEATHER_MAX_LOCATIONS]; // From the settings
+    unsigned location_count;
+    unsigned shown_location; // Next in the charts
+    // Only touched from the render context
+    struct chart temperature_chart;
+    struct chart precipitation_chart;
+    const char *drawn_name;
+    char request[HTTPS_WEATHER_REQUEST_MAX_SIZE];
 };
 static struct weather_state state;
 
-void init_weather(void) { critical_section_init(&state.cs); }
-
-void update_weather(const char *http_response) {
-    const char *json_start = strchr(http_response, '{'); // First occurence of {
-    assert(json_start != NULL);
-    const char *json_end = strrchr(http_response, '}'); // Last occurence of }
-    assert(json_end != NULL);
-
-    // Create null-terminated string with just JSON
-    char json_response_str[HTTPS_RESPONSE_MAX_SIZE];
-    memset(json_response_str, '\0', sizeof(json_response_str));
-    memcpy(json_response_str, json_start, json_end - json_start + 1);
-
-    json_t pool[MAX_JSON_FIELDS];
-    const json_t *json = json_create(json_response_str, pool, MAX_JSON_FIELDS);
-    assert(json);
-
-    const json_t *current_weather_field = json_getProperty(json, "current");
-    assert(json_getType(current_weather_field) == JSON_OBJ);
-    const json_t *temperature_field =
-        json_getProperty(current_weather_field, "temperature_2m");
-    assert(json_getType(temperature_field) == JSON_REAL);
-    const json_t *precipitation_field =
-        json_getProperty(current_weather_field, "precipitation");
-    assert(json_getType(precipitation_field) == JSON_REAL);
-    const json_t *daily_field = json_getProperty(json, "daily");
-    assert(json_getType(daily_field) == JSON_OBJ);
-    const json_t *temperature_max_arr_field =
-        json_getProperty(daily_field, "temperature_2m_max");
-    assert(json_getType(temperature_max_arr_field) == JSON_ARRAY);
-    const json_t *precipitation_sum_arr_field =
-        json_getProperty(daily_field, "precipitation_sum");
-    assert(json_getType(precipitation_sum_arr_field) == JSON_ARRAY);
-    const json_t *temperature_max_field =
-        json_getChild(temperature_max_arr_field);
-    assert(json_getType(temperature_max_field) == JSON_REAL);
-    const json_t *precipitation_sum_field =
-        json_getChild(precipitation_sum_arr_field);
-    assert(json_getType(precipitation_sum_field) == JSON_REAL);
-
-    critical_section_enter_blocking(&state.cs);
-    state.current_temp = json_getReal(temperature_field);
-    state.max_daily_temp = json_getReal(temperature_max_field);
-    state.current_precipitation = json_getReal(precipitation_field);
-    state.precipitation_sum = json_getReal(precipitation_sum_field);
-    critical_section_exit(&state.cs);
+static_assert(WEATHER_FORECAST_HOURS <= CHART_MAX_COLUMNS,
+              "An hour per column");
+
+void init_weather(void) {
+    state.models[0].weather_code = -1;
+    state.models[1].weather_code = -1;
+    state.temperature_chart = (struct chart){
+        .x = WEATHER_CHART_X,
+        .y = WEATHER_TEMPERATURE_CHART_Y,
+        .height = WEATHER_TEMPERATURE_CHART_HEIGHT,
+        .column_width = WEATHER_CHART_COLUMN_WIDTH,
+        .style = CHART_LINE,
+        .color = RED,
+        .background = WHITE,
+    };
+    state.precipitation_chart = (struct chart){
+        .x = WEATHER_CHART_X,
+        .y = WEATHER_PRECIPITATION_CHART_Y,
+        .height = WEATHER_PRECIPITATION_CHART_HEIGHT,
+        .column_width = WEATHER_CHART_COLUMN_WIDTH,
+        .style = CHART_BARS,
+        .color = BLUE,
+        .background = WHITE,
+    };
+
+    // All locations go into one query, as comma separated lists
+    const struct settings *settings = settings_get();
+    char latitudes[WEATHER_MAX_LOCATIONS * SETTINGS_COORDINATE_SIZE] = "";
+    char longitudes[WEATHER_MAX_LOCATIONS * SETTINGS_COORDINATE_SIZE] = "";
+    for (size_t i = 0; i < WEATHER_MAX_LOCATIONS; ++i) {
+        const struct settings_location *location = &settings->locations[i];
+        if (location->latitude[0] == '\0')
+            continue;
+        const char *separator = state.location_count > 0 ? "," : "";
+        strcat(strcat(latitudes, separator), location->latitude);
+        strcat(strcat(longitudes, separator), location->longitude);
+        state.names[state.location_count++] = location->name;
+    }
+    int length =
+        snprintf(state.request, sizeof(state.request),
+                 HTTPS_WEATHER_REQUEST_FORMAT, latitudes, longitudes);
+    assert(length > 0 && length < sizeof(state.request));
+}
+
+const char *weather_request(void) { return state.request; }
+
+// Sprite of a WMO weather interpretation code, as used by open-meteo
+static const char *icon_name(int code, bool is_day) {
+    switch (code) {
+    case 0:
+        return is_day ? "clear_day" : "clear_night";
+    case 1:
+    case 2:
+        return is_day ? "partly_day" : "partly_night";
+    case 3:
+        return "cloudy";
+    case 45:
+    case 48:
+        return "fog";
+    case 51:
+    case 53:
+    case 55:
+        return "drizzle";
+    case 56:
+    case 57:
+    case 66:
+    case 67:
+        return "freezing";
+    case 61:
+    case 63:
+    case 65:
+        return "rain";
+    case 71:
+    case 73:
+    case 75:
+    case 77:
+        return "snow";
+    case 80:
+    case 81:
+    case 82:
+        return "showers";
+    case 85:
+    case 86:
+        return "snow_showers";
+    case 95:
+    case 96:
+    case 99:
+        return "thunder";
+    default:
+        return NULL;
+    }
+}
+
+// Next member of the object just opened, false at its end or on an error
+static bool next_member(struct json_reader *reader,
+                        enum json_reader_event *event) {
+    *event = json_reader_next(reader);
+    return *event != JSON_READER_OBJECT_END && *event != JSON_READER_ERROR &&
+           *event != JSON_READER_DONE;
+}
+
+static bool skip_value(struct json_reader *reader,
+                       enum json_reader_event event) {
+    if (event == JSON_READER_OBJECT || event == JSON_READER_ARRAY)
+        return json_reader_skip(reader);
+    return true;
+}
+
+static bool read_tenths(const struct json_reader *reader, int32_t *value) {
+    return json_reader_fixed(reader, 1, value);
+}
+
+static bool read_integer(const struct json_reader *reader, int *value) {
+    int64_t integer;
+    if (!json_reader_integer(reader, &integer))
+        return false;
+    *value = integer;
+    return true;
+}
+
+// The first number of the array just opened, the rest is skipped
+static bool read_first(struct json_reader *reader, int32_t *value) {
+    json_reader_next(reader);
+    return read_tenths(reader, value) && json_reader_skip(reader);
+}
+
+static bool read_first_integer(struct json_reader *reader, int64_t *value) {
+    return json_reader_next(reader) == JSON_READER_NUMBER &&
+           json_reader_integer(reader, value) && json_reader_skip(reader);
+}
+
+// Numbers of the array just opened in tenths, the ones past max are skipped
+static bool read_series(struct json_reader *reader, int16_t *values,
+                        unsigned max, unsigned *count) {
+    *count = 0;
+    enum json_reader_event event;
+    while ((event = json_reader_next(reader)) != JSON_READER_ARRAY_END) {
+        int32_t value = CHART_MISSING;
+        if (!(event == JSON_READER_LITERAL &&
+              json_reader_value(reader, "null")) &&
+            !json_reader_fixed(reader, 1, &value))
+            return false;
+        if (*count < max)
+            values[(*count)++] = MAX(MIN(value, INT16_MAX), CHART_MISSING);
+    }
+    return true;
+}
+
+static bool parse_current(struct json_reader *reader,
+                          struct weather_update *update) {
+    enum json_reader_event event;
+    while (next_member(reader, &event)) {
+        bool ok;
+        if (json_reader_key(reader, "temperature_2m"))
+            ok = read_tenths(reader, &update->current_temp);
+        else if (json_reader_key(reader, "precipitation"))
+            ok = read_tenths(reader, &update->current_precipitation);
+        else if (json_reader_key(reader, "weather_code"))
+            ok = read_integer(reader, &update->weather_code);
+        else if (json_reader_key(reader, "is_day"))
+            ok = read_integer(reader, &update->is_day);
+        else
+            ok = skip_value(reader, event);
+        if (!ok)
+            return false;
+    }
+    update->current = true;
+    return !reader->failed;
+}
+
+// Only the first day, today
+static bool parse_daily(struct json_reader *reader,
+                        struct weather_update *update) {
+    enum json_reader_event event;
+    while (next_member(reader, &event)) {
+        bool ok;
+        if (event == JSON_READER_ARRAY &&
+            json_reader_key(reader, "temperature_2m_max"))
+            ok = read_first(reader, &update->max_daily_temp);
+        else if (event == JSON_READER_ARRAY &&
+                 json_reader_key(reader, "precipitation_sum"))
+            ok = read_first(reader, &update->precipitation_sum);
+        else if (event == JSON_READER_ARRAY &&
+                 json_reader_key(reader, "sunrise"))
+            ok = read_first_integer(reader, &update->sunrise);
+        else if (event == JSON_READER_ARRAY &&
+                 json_reader_key(reader, "sunset"))
+            ok = read_first_integer(reader, &update->sunset);
+        else
+            ok = skip_value(reader, event);
+        if (!ok)
+            return false;
+    }
+    return !reader->failed;
+}
+
+static bool parse_hourly(struct json_reader *reader,
+                         struct weather_forecast *forecast) {
+    unsigned temperatures = 0;
+    unsigned precipitations = 0;
+    enum json_reader_event event;
+    while (next_member(reader, &event)) {
+        bool ok;
+        if (event == JSON_READER_ARRAY && json_reader_key(reader, "time")) {
+            // Consecutive hours, only the first one is needed
+            ok = json_reader_next(reader) == JSON_READER_NUMBER &&
+                 json_reader_integer(reader, &forecast->start) &&
+                 json_reader_skip(reader);
+        } else if (event == JSON_READER_ARRAY &&
+                   json_reader_key(reader, "temperature_2m")) {
+            ok = read_series(reader, forecast->temperature,
+                             WEATHER_FORECAST_HOURS, &temperatures);
+        } else if (event == JSON_READER_ARRAY &&
+                   json_reader_key(reader, "precipitation")) {
+            ok = read_series(reader, forecast->precipitation,
+                             WEATHER_FORECAST_HOURS, &precipitations);
+        } else {
+            ok = skip_value(reader, event);
+        }
+        if (!ok)
+            return false;
+    }
+    forecast->hours = MIN(temperatures, precipitations);
+    return !reader->failed;
+}
+
+// The object of one location, the first one also has the current weather
+static bool parse_location(struct json_reader *reader,
+                           struct weather_update *update, unsigned location) {
+    struct weather_forecast *forecast =
+        location < WEATHER_MAX_LOCATIONS ? &update->forecasts[location] : NULL;
+    enum json_reader_event event;
+    while (next_member(reader, &event)) {
+        bool ok;
+        if (event == JSON_READER_OBJECT && location == 0 &&
+            json_reader_key(reader, "current"))
+            ok = parse_current(reader, update);
+        else if (event == JSON_READER_OBJECT && location == 0 &&
+                 json_reader_key(reader, "daily"))
+            ok = parse_daily(reader, update);
+        else if (event == JSON_READER_OBJECT && forecast != NULL &&
+                 json_reader_key(reader, "hourly"))
+            ok = parse_hourly(reader, forecast);
+        else
+            ok = skip_value(reader, event);
+        if (!ok)
+            return false;
+    }
+    return !reader->failed;
+}
+
+// One location object, or an array of them
+static bool parse_response(struct json_reader *reader,
+                           struct weather_update *update) {
+    enum json_reader_event event = json_reader_next(reader);
+    if (event == JSON_READER_OBJECT) {
+        update->location_count = 1;
+        return parse_location(reader, update, 0) && update->current;
+    }
+    if (event != JSON_READER_ARRAY)
+        return false;
+    while ((event = json_reader_next(reader)) == JSON_READER_OBJECT) {
+        if (!parse_location(reader, update, update->location_count++))
+            return false;
+    }
+    update->location_count =
+        MIN(update->location_count, WEATHER_MAX_LOCATIONS);
+    return event == JSON_READER_ARRAY_END && update->current;
+}
+
+void update_weather(char *http_response) {
+    const char *json_start = strpbrk(http_response, "{[");
+    if (json_start == NULL) {
+        log_warn("No JSON in the weather response");
+        return;
+    }
+
+    // Read value by value, the hourly arrays would not fit a node pool. The
+    // update is static to keep it off the stack.
+    static struct weather_update update;
+    memset(&update, 0, sizeof(update));
+    struct json_reader reader;
+    json_reader_init(&reader, json_start);
+    uint32_t parse_start_us = trace_now();
+    bool parsed = parse_response(&reader, &update);
+    trace_record(TRACE_JSON_PARSE, parse_start_us, trace_now());
+    if (!parsed) {
+        log_warn("Invalid weather response");
+        return;
+    }
+    TRACE_SCOPE(TRACE_STATE_UPDATE);
+
+    // Locations missing from the response keep the published forecast
+    struct weather_model *model =
+        doublebuf_begin(&state.buffer, state.models, sizeof(state.models[0]));
+    model->current_temp = update.current_temp;
+    model->max_daily_temp = update.max_daily_temp;
+    model->current_precipitation = update.current_precipitation;
+    model->precipitation_sum = update.precipitation_sum;
+    model->weather_code = update.weather_code;
+    model->is_day = update.is_day != 0;
+    model->sunrise = update.sunrise;
+    model->sunset = update.sunset;
+    model->stale = false;
+    unsigned count = MIN(update.location_count, state.location_count);
+    memcpy(model->forecasts, update.forecasts,
+           count * sizeof(model->forecasts[0]));
+    doublebuf_publish(&state.buffer);
+}
+
+// Hours already past are dropped, so the charts move on between updates
+static void render_forecast(const struct weather_forecast *forecast,
+                            const char *name) {
+    int64_t now = timebase_utc_us() / 1000000;
+    unsigned past = 0;
+    if (forecast->hours > 0 && now > forecast->start)
+        past = MIN((now - forecast->start) / 3600, forecast->hours);
+    unsigned hours = forecast->hours - past;
+    const int16_t *temperature = forecast->temperature + past;
+    const int16_t *precipitation = forecast->precipitation + past;
+
+    int32_t coldest = INT16_MAX;
+    int32_t warmest = INT16_MIN;
+    int32_t wettest = WEATHER_PRECIPITATION_CHART_MIN_TOP;
+    for (unsigned i = 0; i < hours; ++i) {
+        if (temperature[i] != CHART_MISSING) {
+            coldest = MIN(coldest, temperature[i]);
+            warmest = MAX(warmest, temperature[i]);
+        }
+        wettest = MAX(wettest, precipitation[i]);
+    }
+    // Small changes do not fill the whole height
+    int32_t spread =
+        MAX(warmest - coldest, WEATHER_TEMPERATURE_CHART_MIN_SPREAD);
+    int32_t middle = (coldest + warmest) / 2;
+    chart_draw(&state.temperature_chart, temperature, hours,
+               middle - spread / 2, middle + spread / 2);
+    chart_draw(&state.precipitation_chart, precipitation, hours, 0, wettest);
+
+    if (name != state.drawn_name) {
+        GUI_DrawRectangle(WEATHER_LOCATION_X, WEATHER_LOCATION_Y, 480,
+                          WEATHER_LOCATION_Y + 12, WHITE, DRAW_FULL,
+                          DOT_PIXEL_DFT);
+        GUI_DisString_EN(WEATHER_LOCATION_X, WEATHER_LOCATION_Y, name,
+                         &Font12, LCD_BACKGROUND, BLACK);
+        state.drawn_name = name;
+    }
+}
+
+// Without the software floating point of %f
+static const char *tenths(char *buffer, int32_t value) {
+    fixed_format(buffer, value, 1);
+    return buffer;
 }
 
 void render_weather(void) {
-    critical_section_enter_blocking(&state.cs);
+    TRACE_SCOPE(TRACE_RENDER_WEATHER);
+    // A copy, drawn without holding anything. Static to keep it off the
+    // stack, only the render and weather tasks draw and neither preempts the
+    // other.
+    static struct weather_model model;
+    doublebuf_read(&state.buffer, &model, state.models, sizeof(model));
+    char numbers[4][FIXED_STRING_SIZE];
     char temperature_string[MAX_WEATHER_LINE_STRING_LENGTH];
     snprintf(temperature_string, MAX_WEATHER_LINE_STRING_LENGTH,
-             "Temp: %.1f C, max: %.1f C", state.current_temp,
-             state.max_daily_temp);
+             "Temp: %s C, max: %s C", tenths(numbers[0], model.current_temp),
+             tenths(numbers[1], model.max_daily_temp));
     char precipitation_string[MAX_WEATHER_LINE_STRING_LENGTH];
     snprintf(precipitation_string, MAX_WEATHER_LINE_STRING_LENGTH,
-             "Rain: %.1f mm, sum: %.1f mm", state.current_precipitation,
-             state.precipitation_sum);
-    // Include the drawing in the critical section, to avoid interrupts during
-    // rendering We first need to reset the LCD in the changed region
+             "Rain: %s mm, sum: %s mm",
+             tenths(numbers[2], model.current_precipitation),
+             tenths(numbers[3], model.precipitation_sum));
+    // We first need to reset the LCD in the changed region
+    COLOR color = model.stale ? GRAY : BLUE;
     GUI_DrawRectangle(20, 80, 480, 110 + 24, WHITE, DRAW_FULL, DOT_PIXEL_DFT);
-    GUI_DisString_EN(20, 80, temperature_string, &Font24, LCD_BACKGROUND, BLUE);
+    GUI_DisString_EN(20, 80, temperature_string, &Font24, LCD_BACKGROUND,
+                     color);
     GUI_DisString_EN(20, 110, precipitation_string, &Font24, LCD_BACKGROUND,
-                     BLUE);
-    critical_section_exit(&state.cs);
+                     color);
+    // A miss reads the SD card, an unchanged icon is not drawn again
+    const char *icon = icon_name(model.weather_code, model.is_day);
+    if (icon != NULL)
+        sprites_draw(icon, WEATHER_ICON_X, WEATHER_ICON_Y);
+    // Only what changed since the last call is drawn
+    if (state.location_count > 0) {
+        unsigned location = state.shown_location++ % state.location_count;
+        render_forecast(&model.forecasts[location], state.names[location]);
+    }
+}
+
+void weather_invalidate(void) {
+    chart_invalidate(&state.temperature_chart);
+    chart_invalidate(&state.precipitation_chart);
+    state.drawn_name = NULL;
+}
+
+bool weather_daylight(int64_t *sunrise, int64_t *sunset) {
+    // Its own copy, read from the housekeeping task
+    static struct weather_model model;
+    doublebuf_read(&state.buffer, &model, state.models, sizeof(model));
+    *sunrise = model.sunrise;
+    *sunset = model.sunset;
+    return *sunrise != 0 && *sunset > *sunrise;
+}
+
+void weather_save(struct weather_snapshot *snapshot) {
+    static struct weather_model model;
+    doublebuf_read(&state.buffer, &model, state.models, sizeof(model));
+    snapshot->current_temp = model.current_temp;
+    snapshot->max_daily_temp = model.max_daily_temp;
+    snapshot->current_precipitation = model.current_precipitation;
+    snapshot->precipitation_sum = model.precipitation_sum;
+    snapshot->weather_code = model.weather_code;
+    snapshot->is_day = model.is_day;
+}
+
+void weather_restore(const struct weather_snapshot *snapshot) {
+    struct weather_model *model =
+        doublebuf_begin(&state.buffer, state.models, sizeof(state.models[0]));
+    model->current_temp = snapshot->current_temp;
+    model->max_daily_temp = snapshot->max_daily_temp;
+    model->current_precipitation = snapshot->current_precipitation;
+    model->precipitation_sum = snapshot->precipitation_sum;
+    model->weather_code = snapshot->weather_code;
+    model->is_day = snapshot->is_day != 0;
+    model->stale = true;
+    doublebuf_publish(&state.buffer);
 }
@@ -0,0 +1,108 @@
+// Compares the fixed-point parse and format of src/fixed.c with strtod and
+// snprintf("%.1f"), as the weather rendering used them.
+//
+// Time per call on the host:
+//     cc -O2 -Iinc tools/bench_fixed.c src/fixed.c -o bench_fixed
+//     ./bench_fixed
+//
+// Code size for the display, one path at a time, with the compiler and
+// the C library of the Pico SDK:
+//     FLAGS="-mcpu=cortex-m0plus -mthumb -Os --specs=nano.specs"
+//     arm-none-eabi-gcc $FLAGS -u _printf_float -Iinc -DBENCH_ONLY=1
+//         tools/bench_fixed.c src/fixed.c -o newlib.elf
+//     arm-none-eabi-gcc $FLAGS -Iinc -DBENCH_ONLY=2
+//         tools/bench_fixed.c src/fixed.c -o fixed.elf
+//     arm-none-eabi-size newlib.elf fixed.elf
+// BENCH_ONLY=1 links only the newlib path and 2 only the fixed-point one,
+// both convert the same values once and need no timer.
+
+#include "fixed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef BENCH_ONLY
+#include <time.h>
+#endif
+
+#define ROUNDS 200000
+
+// As they come in the open-meteo responses
+static const char *const samples[] = {
+    "21.3", "-4.7", "0.0", "12.8", "0.1", "35.0", "-12.5", "7.4",
+};
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+static volatile int sink;
+
+static void newlib_path(const char *text) {
+    char buffer[16];
+    double value = strtod(text, NULL);
+    sink += snprintf(buffer, sizeof(buffer), "%.1f", value);
+}
+
+static void fixed_path(const char *text) {
+    char buffer[FIXED_STRING_SIZE];
+    int32_t value = 0;
+    fixed_parse(text, strlen(text), 1, &value);
+    sink += fixed_format(buffer, value, 1);
+}
+
+#ifdef BENCH_ONLY
+
+int main(void) {
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+#if BENCH_ONLY == 1
+        newlib_path(samples[i]);
+#else
+        fixed_path(samples[i]);
+#endif
+    }
+    return sink == 0;
+}
+
+#else
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static double nanoseconds_per_call(void (*path)(const char *)) {
+    double start = seconds();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < SAMPLE_COUNT; ++i)
+            path(samples[i]);
+    }
+    return (seconds() - start) * 1e9 / (ROUNDS * SAMPLE_COUNT);
+}
+
+int main(void) {
+    // Both must print the same
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        char expected[16];
+        char actual[FIXED_STRING_SIZE];
+        int32_t value;
+        snprintf(expected, sizeof(expected), "%.1f", strtod(samples[i], NULL));
+        if (!fixed_parse(samples[i], strlen(samples[i]), 1, &value)) {
+            fprintf(stderr, "Failed to parse %s\n", samples[i]);
+            return 1;
+        }
+        fixed_format(actual, value, 1);
+        if (strcmp(expected, actual) != 0) {
+            fprintf(stderr, "%s: %s != %s\n", samples[i], actual, expected);
+            return 1;
+        }
+    }
+
+    double newlib = nanoseconds_per_call(newlib_path);
+    double fixed = nanoseconds_per_call(fixed_path);
+    printf("strtod + snprintf %%.1f: %6.1f ns per value\n", newlib);
+    printf("fixed_parse + fixed_format: %6.1f ns per value, %.1fx faster\n",
+           fixed, newlib / fixed);
+    return 0;
+}
+
+#endif
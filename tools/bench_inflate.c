@@ -0,0 +1,155 @@
+// Throughput of the streaming inflater of src/inflate.c, fed in pieces the
+// size of TCP segments as the TLS receive callback does, against zlib.
+//
+// On the host, with a synthetic departure board or a decoded body given as a
+// file, e.g. one taken from a replay fixture:
+//     cc -O2 -Iinc tools/bench_inflate.c src/inflate.c -lz -o bench_inflate
+//     ./bench_inflate [body.json]
+// The body is gzip-compressed with zlib at the default level, the same as
+// the APIs send.
+
+#include "inflate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define ROUNDS 2000
+#define SEGMENT_SIZE 1460 // TCP payload of one Ethernet frame
+#define SYNTHETIC_DEPARTURES 20
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Like the departure boards of api.golemio.cz, repetitive with small changes
+static size_t synthetic_board(char *out, size_t size) {
+    size_t len = snprintf(out, size, "{\"stops\":[],\"departures\":[");
+    for (int i = 0; i < SYNTHETIC_DEPARTURES && len < size; ++i) {
+        len += snprintf(
+            out + len, size - len,
+            "%s{\"arrival_timestamp\":{\"predicted\":\"2024-05-01T12:%02d:"
+            "%02d+02:00\",\"scheduled\":\"2024-05-01T12:%02d:00+02:00\"},"
+            "\"delay\":{\"is_available\":true,\"minutes\":%d,\"seconds\":%d},"
+            "\"route\":{\"short_name\":\"%d\",\"type\":0,\"is_night\":false},"
+            "\"stop\":{\"id\":\"U876Z1P\",\"platform_code\":\"A\"},"
+            "\"trip\":{\"headsign\":\"Sidliste Barrandov\",\"id\":\"%d_%d\","
+            "\"is_canceled\":false,\"is_wheelchair_accessible\":true}}",
+            i ? "," : "", i * 3 % 60, i * 7 % 60, i * 3 % 60, i % 4,
+            i * 13 % 60, 14 + i % 3 * 4, 1000 + i, i * 37);
+    }
+    len += snprintf(out + len, size - len, "]}");
+    return len;
+}
+
+static unsigned char *read_file(const char *name, size_t *len) {
+    FILE *file = fopen(name, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    rewind(file);
+    unsigned char *data = malloc(*len);
+    if (fread(data, 1, *len, file) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+static size_t gzip(const unsigned char *in, size_t len, unsigned char *out,
+                   size_t size) {
+    z_stream stream = {0};
+    // 16 over the window bits selects the gzip wrapper
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    stream.next_in = (unsigned char *)in;
+    stream.avail_in = len;
+    stream.next_out = out;
+    stream.avail_out = size;
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END ? stream.total_out : 0;
+}
+
+static enum inflate_status inflate_pieces(const unsigned char *in, size_t len,
+                                          unsigned char *out, size_t size) {
+    static struct inflate_state state;
+    inflate_init(&state, INFLATE_FORMAT_GZIP, out, size);
+    enum inflate_status status = INFLATE_NEED_INPUT;
+    for (size_t i = 0; i < len && status == INFLATE_NEED_INPUT;
+         i += SEGMENT_SIZE) {
+        size_t n = len - i < SEGMENT_SIZE ? len - i : SEGMENT_SIZE;
+        status = inflate_feed(&state, in + i, n);
+    }
+    return status;
+}
+
+int main(int argc, char **argv) {
+    size_t len;
+    unsigned char *body;
+    if (argc > 1) {
+        body = read_file(argv[1], &len);
+        if (!body) {
+            fprintf(stderr, "Failed to read %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        body = malloc(64 * 1024);
+        len = synthetic_board((char *)body, 64 * 1024);
+    }
+
+    size_t size = len + 1024;
+    unsigned char *compressed = malloc(size);
+    unsigned char *out = malloc(len);
+    size_t compressed_len = gzip(body, len, compressed, size);
+    int status = 0;
+    if (compressed_len == 0) {
+        fprintf(stderr, "Failed to compress\n");
+        status = 1;
+    } else if (inflate_pieces(compressed, compressed_len, out, len) !=
+                   INFLATE_DONE ||
+               memcmp(out, body, len) != 0) {
+        fprintf(stderr, "Decoded body differs\n");
+        status = 1;
+    }
+    free(body);
+    if (status != 0) {
+        free(compressed);
+        free(out);
+        return status;
+    }
+
+    double start = seconds();
+    for (int round = 0; round < ROUNDS; ++round)
+        inflate_pieces(compressed, compressed_len, out, len);
+    double ours = seconds() - start;
+
+    start = seconds();
+    for (int round = 0; round < ROUNDS; ++round) {
+        z_stream stream = {0};
+        inflateInit2(&stream, 15 + 16);
+        stream.next_in = compressed;
+        stream.avail_in = compressed_len;
+        stream.next_out = out;
+        stream.avail_out = len;
+        inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+    }
+    double zlib = seconds() - start;
+
+    double megabytes = (double)len * ROUNDS / 1e6;
+    printf("%zu bytes gzip-compressed to %zu, decoded in %d byte pieces\n",
+           len, compressed_len, SEGMENT_SIZE);
+    printf("inflate.c: %7.1f MB/s\n", megabytes / ours);
+    printf("zlib:      %7.1f MB/s\n", megabytes / zlib);
+    free(compressed);
+    free(out);
+    return 0;
+}
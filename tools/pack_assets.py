@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Pack images into the asset file the display reads from the SD card.
+
+Every image is converted to big-endian RGB565, stored run-length encoded
+when that is smaller, and placed on a sector boundary behind an index of
+names, sizes and offsets. See assets.h for the layout. Transparent pixels
+are blended over the background color.
+
+    pack_assets.py --output ASSETS.PAK sun=icons/sun.png rain=icons/rain.png
+    pack_assets.py --output ASSETS.PAK --size 64x64 sun=icons/sun.png
+"""
+
+import argparse
+import struct
+import sys
+
+from PIL import Image
+
+MAGIC = b"RGBP"
+VERSION = 1
+MAX_ASSETS = 64
+NAME_LENGTH = 16
+SECTOR_SIZE = 512
+HEADER = struct.Struct("<4sHH8x")
+ENTRY = struct.Struct("<16sHHB3xII")
+FORMAT_RGB565 = 0
+FORMAT_RLE = 1
+MAX_LITERALS = 0x80
+MAX_REPEAT = 0xFF - 0x7E
+
+
+def rgb565(image, background):
+    """Big-endian RGB565 pixels of the image, row by row."""
+    flat = Image.new("RGBA", image.size, background + (255,))
+    flat.alpha_composite(image.convert("RGBA"))
+    data = flat.tobytes()
+    return [(r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3
+            for r, g, b in zip(data[0::4], data[1::4], data[2::4])]
+
+
+def rle(pixels):
+    """Packets of up to 128 literals or runs of 2 to 129 pixels."""
+    out = bytearray()
+    literals = []
+
+    def flush_literals():
+        while literals:
+            batch = literals[:MAX_LITERALS]
+            del literals[:MAX_LITERALS]
+            out.append(len(batch) - 1)
+            for pixel in batch:
+                out.extend(struct.pack(">H", pixel))
+
+    i = 0
+    while i < len(pixels):
+        run = 1
+        while (i + run < len(pixels) and run < MAX_REPEAT
+               and pixels[i + run] == pixels[i]):
+            run += 1
+        if run >= 2:
+            flush_literals()
+            out.append(run + 0x7E)
+            out += struct.pack(">H", pixels[i])
+        else:
+            literals.append(pixels[i])
+        i += run
+    flush_literals()
+    return bytes(out)
+
+
+def encode(pixels):
+    raw = b"".join(struct.pack(">H", pixel) for pixel in pixels)
+    packed = rle(pixels)
+    if len(packed) < len(raw):
+        return FORMAT_RLE, packed
+    return FORMAT_RGB565, raw
+
+
+def parse_size(text):
+    width, height = text.lower().split("x")
+    return int(width), int(height)
+
+
+def parse_color(text):
+    value = int(text.lstrip("#"), 16)
+    return value >> 16 & 0xFF, value >> 8 & 0xFF, value & 0xFF
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--output", required=True)
+    parser.add_argument("--size", type=parse_size,
+                        help="scale every image to WIDTHxHEIGHT")
+    parser.add_argument("--background", type=parse_color, default="ffffff",
+                        help="color under transparent pixels, as RRGGBB")
+    parser.add_argument("assets", nargs="+", metavar="NAME=FILE")
+    args = parser.parse_args()
+
+    if len(args.assets) > MAX_ASSETS:
+        sys.exit(f"At most {MAX_ASSETS} assets fit the index")
+
+    entries = []
+    for argument in args.assets:
+        name, _, path = argument.partition("=")
+        if not path or len(name.encode()) >= NAME_LENGTH:
+            sys.exit(f"Expected NAME=FILE with a name below {NAME_LENGTH} "
+                     f"characters: {argument}")
+        image = Image.open(path)
+        if args.size:
+            image = image.resize(args.size, Image.LANCZOS)
+        kind, data = encode(rgb565(image, args.background))
+        entries.append((name, image.size, kind, data))
+
+    offset = HEADER.size + ENTRY.size * len(entries)
+    index = bytearray()
+    body = bytearray()
+    for name, (width, height), kind, data in entries:
+        # Each asset is read with one multi-sector read
+        offset = -(-offset // SECTOR_SIZE) * SECTOR_SIZE
+        index += ENTRY.pack(name.encode(), width, height, kind, offset,
+                            len(data))
+        body += data
+        body += bytes(-len(data) % SECTOR_SIZE)
+        offset += len(data) + -len(data) % SECTOR_SIZE
+
+    header = HEADER.pack(MAGIC, VERSION, len(entries)) + index
+    with open(args.output, "wb") as output:
+        output.write(header)
+        output.write(bytes(-len(header) % SECTOR_SIZE))
+        output.write(body)
+
+    for name, (width, height), kind, data in entries:
+        print(f"{name}: {width}x{height} "
+              f"{'rle' if kind == FORMAT_RLE else 'rgb565'} {len(data)} B")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,362 @@
+#!/usr/bin/env python3
+"""Record, list and serve the HTTP response fixtures of replay.h.
+
+A fixture holds raw responses, header and transfer coding included, split
+into the segments they arrived in, with the time of each since the request
+was sent. The display records them to the SD card with -DREPLAY_MODE=1 and
+plays them back with -DREPLAY_MODE=2. This tool records the same on the host
+and serves them to HTTP clients, to benchmark without the real APIs.
+
+    replay_server.py record --output REPLAY0.BIN \\
+        "https://api.open-meteo.com/v1/forecast?latitude=50.07&..."
+    replay_server.py record --output REPLAY1.BIN \\
+        --header "X-Access-Token: <key>" \\
+        "https://api.golemio.cz/v2/pid/departureboards?ids=U876Z1P&..."
+    replay_server.py list REPLAY0.BIN REPLAY1.BIN
+    replay_server.py serve --port 8443 --latency 150 --chunk 512 \\
+        --fragment 100 --gap 5 REPLAY0.BIN
+
+The server answers every request with the next recorded response, through
+all fixtures and then from the first again, at the recorded pace scaled by
+--speed. --latency delays the first byte further, --chunk re-encodes the
+body in chunks of that size and --fragment sends pieces of that size --gap
+apart instead of the recorded segments. Without --cert and --key it makes a
+self-signed certificate with openssl, --plain serves HTTP instead. Every
+response is logged with its time to the first and to the last byte.
+"""
+
+import argparse
+import os
+import socket
+import socketserver
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+MAGIC = 0x594C5052  # "RPLY"
+VERSION = 1
+RESPONSE = struct.Struct("<IHHII")
+SEGMENT = struct.Struct("<II")
+MAX_FILE_SIZE = 256 * 1024
+RECEIVE_SIZE = 16384
+
+
+def read_fixture(path):
+    """Responses of the file, each a list of (offset_us, data) segments."""
+    with open(path, "rb") as file:
+        data = file.read()
+    responses = []
+    position = 0
+    while position < len(data):
+        magic, version, count, size, _ = RESPONSE.unpack_from(data, position)
+        if magic != MAGIC or version != VERSION:
+            sys.exit(f"{path}: invalid response at offset {position}")
+        position += RESPONSE.size
+        end = position + size
+        segments = []
+        for _ in range(count):
+            offset_us, length = SEGMENT.unpack_from(data, position)
+            position += SEGMENT.size
+            segments.append((offset_us, data[position:position + length]))
+            position += length
+        if position != end:
+            sys.exit(f"{path}: segments do not match the response size")
+        responses.append(segments)
+    return responses
+
+
+def append_response(path, segments):
+    payload = b"".join(SEGMENT.pack(offset_us, len(data)) + data
+                       for offset_us, data in segments)
+    if os.path.exists(path) and (os.path.getsize(path) + RESPONSE.size
+                                 + len(payload) > MAX_FILE_SIZE):
+        sys.exit(f"{path}: the display reads at most {MAX_FILE_SIZE} bytes")
+    with open(path, "ab") as file:
+        file.write(RESPONSE.pack(MAGIC, VERSION, len(segments),
+                                 len(payload), 0))
+        file.write(payload)
+
+
+def split_head(raw):
+    """The header up to and without the empty line, and the body."""
+    head, separator, body = raw.partition(b"\r\n\r\n")
+    if not separator:
+        raise ValueError("response without the end of its header")
+    return head, body
+
+
+def header_value(head, name):
+    for line in head.split(b"\r\n")[1:]:
+        key, _, value = line.partition(b":")
+        if key.strip().lower() == name:
+            return value.strip()
+    return None
+
+
+def dechunk(body):
+    out = bytearray()
+    position = 0
+    while True:
+        end = body.index(b"\r\n", position)
+        size = int(body[position:end].split(b";")[0], 16)
+        position = end + 2
+        if size == 0:
+            return bytes(out)
+        out += body[position:position + size]
+        position += size + 2
+
+
+def rechunk(raw, chunk_size):
+    """The response with its body in chunks of the size."""
+    head, body = split_head(raw)
+    encoding = header_value(head, b"transfer-encoding") or b""
+    if b"chunked" in encoding.lower():
+        body = dechunk(body)
+    lines = [line for line in head.split(b"\r\n")
+             if line.partition(b":")[0].strip().lower()
+             not in (b"content-length", b"transfer-encoding")]
+    lines.append(b"Transfer-Encoding: chunked")
+    out = bytearray(b"\r\n".join(lines) + b"\r\n\r\n")
+    for start in range(0, len(body), chunk_size):
+        chunk = body[start:start + chunk_size]
+        out += b"%x\r\n" % len(chunk) + chunk + b"\r\n"
+    out += b"0\r\n\r\n"
+    return bytes(out)
+
+
+def describe(segments):
+    raw = b"".join(data for _, data in segments)
+    try:
+        head, body = split_head(raw)
+        status = head.split(b"\r\n")[0].decode(errors="replace")
+    except ValueError:
+        head, body, status = raw, b"", "incomplete"
+    encoding = (header_value(head, b"content-encoding") or b"identity")
+    transfer = (header_value(head, b"transfer-encoding") or b"identity")
+    first = segments[0][0] / 1000 if segments else 0
+    last = segments[-1][0] / 1000 if segments else 0
+    return (f"{status}, header {len(head)} B, body {len(body)} B "
+            f"{encoding.decode()}/{transfer.decode()}, "
+            f"{len(segments)} segments, first byte {first:.1f} ms, "
+            f"last byte {last:.1f} ms")
+
+
+def command_list(args):
+    for path in args.fixtures:
+        for index, segments in enumerate(read_fixture(path)):
+            print(f"{path}[{index}]: {describe(segments)}")
+
+
+def command_record(args):
+    url = urllib.parse.urlsplit(args.url)
+    https = url.scheme == "https"
+    port = url.port or (443 if https else 80)
+    target = url.path or "/"
+    if url.query:
+        target += "?" + url.query
+    # Like build_request() in network.c, but the server closes after it
+    request = (f"GET {target} HTTP/1.1\r\nHost: {url.hostname}\r\n"
+               + "".join(f"{header}\r\n" for header in args.header)
+               + "Accept-Encoding: gzip, deflate\r\nConnection: close\r\n\r\n")
+
+    with socket.create_connection((url.hostname, port)) as plain:
+        connection = plain
+        if https:
+            context = ssl.create_default_context()
+            connection = context.wrap_socket(plain,
+                                             server_hostname=url.hostname)
+        start = time.perf_counter()
+        connection.sendall(request.encode())
+        segments = []
+        while True:
+            data = connection.recv(RECEIVE_SIZE)
+            if not data:
+                break
+            offset_us = int((time.perf_counter() - start) * 1e6)
+            segments.append((offset_us, data))
+    if not segments:
+        sys.exit("No response")
+    append_response(args.output, segments)
+    print(f"{args.output}: {describe(segments)}")
+
+
+def fragments(segments, args):
+    """(offset_us, data) to send for a recorded response."""
+    def paced(offset_us):
+        return int(offset_us / args.speed) if args.speed > 0 else 0
+
+    if args.chunk is None and args.fragment is None:
+        return [(paced(offset_us), data) for offset_us, data in segments]
+    raw = b"".join(data for _, data in segments)
+    if args.chunk is not None:
+        raw = rechunk(raw, args.chunk)
+    if args.fragment is None:
+        return [(paced(segments[0][0]), raw)]
+    first_us = paced(segments[0][0])
+    return [(first_us + index * args.gap * 1000,
+             raw[start:start + args.fragment])
+            for index, start in enumerate(range(0, len(raw),
+                                                 args.fragment))]
+
+
+class ReplayHandler(socketserver.BaseRequestHandler):
+    def handle(self):
+        server = self.server
+        connection = self.request
+        if server.context:
+            try:
+                connection = server.context.wrap_socket(connection,
+                                                        server_side=True)
+            except (ssl.SSLError, OSError) as error:
+                print(f"{self.client_address[0]}: {error}", flush=True)
+                return
+        connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        pending = b""
+        while True:
+            # Requests carry no body, the header is all there is
+            while b"\r\n\r\n" not in pending:
+                try:
+                    data = connection.recv(RECEIVE_SIZE)
+                except (ssl.SSLError, OSError):
+                    data = b""
+                if not data:
+                    return
+                pending += data
+            head, _, pending = pending.partition(b"\r\n\r\n")
+            request_line = head.split(b"\r\n")[0].decode(errors="replace")
+            if not self.respond(connection, request_line):
+                return
+            if (header_value(head, b"connection") or b"").lower() == b"close":
+                connection.close()
+                return
+
+    def respond(self, connection, request_line):
+        server = self.server
+        with server.lock:
+            name, segments = server.responses[server.next_response]
+            server.next_response = ((server.next_response + 1)
+                                    % len(server.responses))
+        start = time.perf_counter()
+        latency_us = server.args.latency * 1000
+        sent = 0
+        first_ms = None
+        try:
+            for offset_us, data in fragments(segments, server.args):
+                delay = (start + (latency_us + offset_us) / 1e6
+                         - time.perf_counter())
+                if delay > 0:
+                    time.sleep(delay)
+                connection.sendall(data)
+                sent += len(data)
+                if first_ms is None:
+                    first_ms = (time.perf_counter() - start) * 1000
+        except (ssl.SSLError, OSError) as error:
+            print(f"{request_line}: {error}", flush=True)
+            return False
+        last_ms = (time.perf_counter() - start) * 1000
+        print(f"{request_line} -> {name}: {sent} B, first byte "
+              f"{first_ms or 0:.1f} ms, last byte {last_ms:.1f} ms",
+              flush=True)
+        return True
+
+
+class ReplayServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, args, responses, context):
+        super().__init__((args.host, args.port), ReplayHandler)
+        self.args = args
+        self.responses = responses
+        self.context = context
+        self.lock = threading.Lock()
+        self.next_response = 0
+
+
+def self_signed(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048",
+                    "-nodes", "-days", "1", "-subj", "/CN=localhost",
+                    "-keyout", key, "-out", cert],
+                   check=True, capture_output=True)
+    return cert, key
+
+
+def command_serve(args):
+    responses = [(f"{path}[{index}]", segments)
+                 for path in args.fixtures
+                 for index, segments in enumerate(read_fixture(path))
+                 if segments]
+    if not responses:
+        sys.exit("No responses to serve")
+
+    with tempfile.TemporaryDirectory() as directory:
+        context = None
+        if not args.plain:
+            cert, key = args.cert, args.key
+            if cert is None or key is None:
+                cert, key = self_signed(directory)
+            context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            context.load_cert_chain(cert, key)
+        with ReplayServer(args, responses, context) as server:
+            scheme = "http" if args.plain else "https"
+            print(f"Serving {len(responses)} responses on "
+                  f"{scheme}://{args.host}:{args.port}/", flush=True)
+            try:
+                server.serve_forever()
+            except KeyboardInterrupt:
+                pass
+
+
+def positive(text):
+    value = int(text)
+    if value <= 0:
+        raise argparse.ArgumentTypeError("must be positive")
+    return value
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    record = commands.add_parser("record", help="append a response")
+    record.add_argument("--output", required=True)
+    record.add_argument("--header", action="append", default=[],
+                        metavar="NAME: VALUE")
+    record.add_argument("url")
+    record.set_defaults(run=command_record)
+
+    listing = commands.add_parser("list", help="describe the responses")
+    listing.add_argument("fixtures", nargs="+")
+    listing.set_defaults(run=command_list)
+
+    serve = commands.add_parser("serve", help="serve the responses")
+    serve.add_argument("--host", default="0.0.0.0")
+    serve.add_argument("--port", type=int, default=8443)
+    serve.add_argument("--cert")
+    serve.add_argument("--key")
+    serve.add_argument("--plain", action="store_true")
+    serve.add_argument("--latency", type=int, default=0, metavar="MS",
+                       help="before the first byte, on top of the recorded")
+    serve.add_argument("--speed", type=float, default=1.0,
+                       help="of the recorded pace, 0 for none")
+    serve.add_argument("--chunk", type=positive, metavar="BYTES")
+    serve.add_argument("--fragment", type=positive, metavar="BYTES")
+    serve.add_argument("--gap", type=int, default=0, metavar="MS",
+                       help="between fragments")
+    serve.add_argument("fixtures", nargs="+")
+    serve.set_defaults(run=command_serve)
+
+    args = parser.parse_args()
+    args.run(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Compile the UTC offset transitions of one tzdata zone into a C table.
+
+The table holds every offset change between the first and last year, found
+by scanning the zone with zoneinfo day by day and bisecting each change down
+to the second. The device looks offsets up with a binary search, see tz.h.
+"""
+
+import argparse
+from datetime import datetime, timedelta, timezone
+from zoneinfo import ZoneInfo
+
+
+def offset(zone, utc_seconds):
+    moment = datetime.fromtimestamp(utc_seconds, tz=timezone.utc)
+    return int(moment.astimezone(zone).utcoffset().total_seconds())
+
+
+def abbreviation(zone, utc_seconds):
+    moment = datetime.fromtimestamp(utc_seconds, tz=timezone.utc)
+    return moment.astimezone(zone).tzname()
+
+
+def transitions(zone, first_year, last_year):
+    start = int(datetime(first_year, 1, 1, tzinfo=timezone.utc).timestamp())
+    end = int(datetime(last_year + 1, 1, 1, tzinfo=timezone.utc).timestamp())
+    day = int(timedelta(days=1).total_seconds())
+    found = []
+    current = offset(zone, start)
+    for t in range(start, end, day):
+        following = offset(zone, t + day)
+        if following == current:
+            continue
+        # First second with the new offset
+        low, high = t, t + day
+        while high - low > 1:
+            middle = (low + high) // 2
+            if offset(zone, middle) == current:
+                low = middle
+            else:
+                high = middle
+        found.append((high, following, abbreviation(zone, high)))
+        current = following
+    return offset(zone, start), abbreviation(zone, start), found
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--zone", required=True)
+    parser.add_argument("--first-year", type=int, required=True)
+    parser.add_argument("--last-year", type=int, required=True)
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+
+    zone = ZoneInfo(args.zone)
+    initial, initial_abbreviation, table = transitions(
+        zone, args.first_year, args.last_year)
+    lines = [
+        "// Generated by tools/tzgen.py, do not edit",
+        f"// {args.zone}, {args.first_year} to {args.last_year}",
+        "",
+        '#include "tz.h"',
+        "",
+        f'const char tz_zone_name[] = "{args.zone}";',
+        f"const int32_t tz_initial_offset = {initial};",
+        f'const char tz_initial_abbreviation[] = "{initial_abbreviation}";',
+        "",
+        "const struct tz_transition tz_transitions[] = {",
+    ]
+    for utc, utc_offset, name in table:
+        lines.append(f'    {{{utc}u, {utc_offset}, "{name}"}},')
+    lines += [
+        "};",
+        "const size_t tz_transition_count =",
+        "    sizeof(tz_transitions) / sizeof(tz_transitions[0]);",
+        "",
+    ]
+    with open(args.output, "w") as output:
+        output.write("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()